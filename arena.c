@@ -0,0 +1,55 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Arena module containing functions for allocating objects that all live
+ * exactly as long as each other (such as everything to do with one request),
+ * by bumping a pointer through a block of memory, then freeing them all at
+ * once.
+ */
+
+#include "arena.h"
+
+#include <assert.h>
+
+// alignment of every object, enough for the pointers and integers (at most
+// 64-bit) objects are made of
+#define ARENA_ALIGN 8
+// room taken at the start of an allocation that overflows, to link it
+#define OVERFLOW_LINK_SIZE ARENA_ALIGN
+
+// Initialises `arena` to allocate from the block `base` of `size` bytes
+// (which the arena does not own), all of it free
+void init_arena(arena_t *arena, void *base, size_t size) {
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+    arena->overflow = NULL;
+}
+
+// Returns `size` bytes from `arena` (uninitialised), aligned for any of the
+// objects this server makes, to be freed along with everything else in the
+// arena by arena_reset()
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (size <= arena->size - arena->used) {
+        void *obj = arena->base + arena->used;
+        arena->used += size;
+        return obj;
+    }
+    uint8_t *block = malloc(OVERFLOW_LINK_SIZE + size);
+    assert(block);
+    *(void **)block = arena->overflow;
+    arena->overflow = block;
+    return block + OVERFLOW_LINK_SIZE;
+}
+
+// Frees everything allocated from `arena`, making all of its block free again
+void arena_reset(arena_t *arena) {
+    while (arena->overflow) {
+        void *next = *(void **)arena->overflow;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->used = 0;
+}
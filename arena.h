@@ -0,0 +1,31 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Arena module containing functions for allocating objects that all live
+ * exactly as long as each other (such as everything to do with one request),
+ * by bumping a pointer through a block of memory, then freeing them all at
+ * once.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// An allocator over the block `base` of `size` bytes, of which the first
+// `used` are taken. Allocations too large for what is left are each made
+// with malloc(), and linked in `overflow` to be freed when the arena is reset
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    void *overflow;
+} arena_t;
+
+void init_arena(arena_t *arena, void *base, size_t size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+
+#endif
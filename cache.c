@@ -3,9 +3,20 @@
  * Author: Jonathan Jauhari 1038331
  *
  * Cache module containing functions for manipulation of resource record
- * caches, for a DNS server. The cache is assumed to only hold a set
- * number of IPv6 resource records. The eviction policy is based on least
- * TTL.
+ * caches, for a DNS server. The cache holds replies to questions, in wire
+ * format, as many as fit in its memory budget, indexed by a hash table on
+ * the name, type and class of their question, and by a min-heap ordered for
+ * eviction. The eviction policy is based on least TTL, unless another is
+ * chosen (LRU, LFU or FIFO, to compare them on a trace). Expired replies are
+ * kept for a while, to be served stale if upstream cannot be reached
+ * (RFC 8767), and reclaimed after as new ones are put in (under least TTL;
+ * under the other policies, only as they come up for eviction). Entries hit
+ * often are refreshed ahead of expiring: the cache tells one of those who hit
+ * them late in their TTL to refresh them, so they are replaced before they
+ * expire. A cache may be shared between threads: it is split into shards by
+ * the hash of the question, each with its own table, heap, share of the
+ * budget and lock, held by every operation on the shard. Copies are returned
+ * rather than entries still in the cache.
  */
 
 #include "cache.h"
@@ -14,99 +25,525 @@
 #include <stdbool.h>
 #include <string.h>
 
-cache_entry_t *cache_find(cache_t *cache, char *name);
-bool cache_is_full(cache_t *cache);
+// number of buckets a shard starts with
+#define INITIAL_NBUCKETS 16
+// length of the reply held by entries of the smallest size class
+#define MIN_CLASS_DATA_LEN 32
+// memory taken to index each entry: as the hash table and the heap double in
+// size when full, at most two pointers each
+#define ENTRY_INDEX_SIZE (4 * sizeof(cache_entry_t *))
 
-// Creates and returns a new cache with a set `capacity`
-cache_t *new_cache(size_t capacity) {
+void init_cache_shard(cache_shard_t *shard, size_t max_bytes);
+size_t cache_slab_size(size_t max_bytes);
+void destroy_cache_shard(cache_shard_t *shard);
+cache_shard_t *cache_shard(cache_t *cache, cache_key_t *key);
+uint16_t cache_get_locked(cache_t *cache, cache_shard_t *shard,
+                          cache_key_t *key, uint8_t *reply, uint16_t size,
+                          time_t *cached_time, time_t *expiry_time,
+                          bool *refresh);
+cache_entry_t *cache_put_locked(cache_t *cache, cache_shard_t *shard,
+                                cache_key_t *key, uint32_t ttl,
+                                uint8_t *reply, uint16_t reply_len,
+                                arena_t *arena);
+cache_entry_t **cache_find(cache_shard_t *shard, cache_key_t *key);
+cache_entry_t *cache_alloc(cache_shard_t *shard, cache_key_t *key,
+                           uint8_t *reply, uint16_t reply_len,
+                           time_t cached_time, time_t expiry_time);
+void cache_free(cache_shard_t *shard, cache_entry_t *entry);
+int cache_size_class(uint16_t reply_len);
+size_t cache_entry_nbytes(cache_shard_t *shard, int size_class);
+cache_entry_t *cache_evict(cache_shard_t *shard, cache_entry_t *entry,
+                           arena_t *arena);
+void cache_insert(cache_t *cache, cache_shard_t *shard, cache_entry_t *entry);
+cache_entry_t *cache_remove(cache_t *cache, cache_shard_t *shard,
+                            cache_entry_t **slot);
+cache_entry_t *cache_remove_min(cache_t *cache, cache_shard_t *shard);
+cache_entry_t **cache_reclaim_expired(cache_t *cache, cache_shard_t *shard,
+                                      time_t now, arena_t *arena,
+                                      cache_entry_t **last);
+void cache_grow(cache_shard_t *shard);
+bool cache_has_room(cache_shard_t *shard, size_t nbytes);
+
+int cache_cmp(cache_t *cache, cache_entry_t *entry1, cache_entry_t *entry2);
+void heap_push(cache_t *cache, cache_shard_t *shard, cache_entry_t *entry);
+void heap_remove(cache_t *cache, cache_shard_t *shard, cache_entry_t *entry);
+void heap_set(cache_shard_t *shard, size_t i, cache_entry_t *entry);
+void heap_sift_up(cache_t *cache, cache_shard_t *shard, size_t i);
+void heap_sift_down(cache_t *cache, cache_shard_t *shard, size_t i,
+                    size_t size);
+
+// Creates and returns a new cache holding as many replies as fit in
+// `max_bytes` bytes of memory, split evenly between `nshards` shards,
+// evicting by `policy`, refreshing hot entries in the last `refresh_percent`
+// percent of their TTL (never, if 0), and keeping expired ones for
+// `max_stale` seconds to be served stale
+cache_t *new_cache(size_t max_bytes, int nshards, int refresh_percent,
+                   time_t max_stale, cache_policy_t policy) {
+    assert(nshards > 0);
     cache_t *cache = malloc(sizeof(*cache));
     assert(cache);
 
-    cache->entries = new_list();
-    cache->capacity = capacity;
+    cache->nshards = nshards;
+    cache->shards = malloc(nshards * sizeof(*cache->shards));
+    assert(cache->shards);
+    for (int i = 0; i < nshards; i++) {
+        init_cache_shard(&cache->shards[i], max_bytes / nshards);
+    }
+    cache->refresh_percent = refresh_percent;
+    cache->max_stale = max_stale;
+    cache->policy = policy;
+    cache->clock = time;
 
     return cache;
 }
 
-// Frees a cache and the linked list that backs it, and the entries in it
+// Frees a cache, the hash tables that back it, and the entries in it
 void free_cache(cache_t *cache) {
-    node_t *curr = cache->entries->head;
-    while (curr) {
-        free_cache_entry(curr->data);
-        curr = curr->next;
+    for (int i = 0; i < cache->nshards; i++) {
+        destroy_cache_shard(&cache->shards[i]);
     }
-    free_list(cache->entries);
+    free(cache->shards);
     free(cache);
 }
 
-// Attempt to retrieve from `cache` an unexpired cache entry for a resource
-// record with name `name`. If such an entry exists, its TTL is updated and
-// a deep copy of the entry is returned (remember to free). Otherwise, NULL
+// Initialises the empty shard `shard`, holding as many replies as fit in
+// `max_bytes` bytes of memory
+void init_cache_shard(cache_shard_t *shard, size_t max_bytes) {
+    shard->nbuckets = INITIAL_NBUCKETS;
+    shard->buckets = calloc(shard->nbuckets, sizeof(*shard->buckets));
+    shard->heap_capacity = INITIAL_NBUCKETS;
+    shard->heap = malloc(shard->heap_capacity * sizeof(*shard->heap));
+    assert(shard->buckets && shard->heap);
+    shard->size = 0;
+    shard->nbytes = 0;
+    shard->max_bytes = max_bytes;
+    shard->nuses = 0;
+    size_t slab_size = cache_slab_size(max_bytes);
+    for (int i = 0; i < CACHE_NUM_SIZE_CLASSES; i++) {
+        init_slab(&shard->slabs[i],
+                  sizeof(cache_entry_t) + (MIN_CLASS_DATA_LEN << i),
+                  slab_size);
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+}
+
+// Returns the size of the slabs the entries of a shard with `max_bytes`
+// bytes of memory are allocated from: SLAB_SIZE, unless a slab of every size
+// class would not fit in the shard together, as a shard short of room cannot
+// take a slab of the size class it needs from another
+size_t cache_slab_size(size_t max_bytes) {
+    size_t slab_size = SLAB_SIZE;
+    while (slab_size > 1 && slab_size * CACHE_NUM_SIZE_CLASSES > max_bytes) {
+        slab_size /= 2;
+    }
+    return slab_size;
+}
+
+// Frees what `shard` holds: its hash table, heap and entries
+void destroy_cache_shard(cache_shard_t *shard) {
+    for (int i = 0; i < CACHE_NUM_SIZE_CLASSES; i++) {
+        destroy_slab(&shard->slabs[i]);
+    }
+    free(shard->buckets);
+    free(shard->heap);
+    pthread_mutex_destroy(&shard->lock);
+}
+
+// Returns the shard of `cache` holding the entry with key `key`, if any. The
+// hash is mixed first, as its low bits pick the bucket within the shard.
+cache_shard_t *cache_shard(cache_t *cache, cache_key_t *key) {
+    uint32_t mixed = cache_key_hash(key) * 2654435769u;
+    return &cache->shards[((uint64_t)mixed * cache->nshards) >> 32];
+}
+
+// Attempt to retrieve from `cache` an unexpired reply to the question with
+// key `key` (the first of a query). If there is one, it is copied into
+// `reply`, of size `size`, with its TTLs counting down the time since it was
+// cached: all there is left to do to send it is set its ID. When it expires
+// is put in `expiry_time`, and its length is returned. Otherwise, 0 is
+// returned. The TTLs are counted down once the lock is released.
+// Unless `refresh` is NULL (the caller cannot refresh the entry now), it is
+// set to whether the caller should refresh the entry hit: if it is hot and
+// due, and no one else was told to in the last CACHE_REFRESH_TIMEOUT
+// seconds.
+uint16_t cache_get(cache_t *cache, cache_key_t *key, uint8_t *reply,
+                   uint16_t size, time_t *expiry_time, bool *refresh) {
+    time_t cached_time;
+    cache_shard_t *shard = cache_shard(cache, key);
+    pthread_mutex_lock(&shard->lock);
+    uint16_t len = cache_get_locked(cache, shard, key, reply, size,
+                                    &cached_time, expiry_time, refresh);
+    pthread_mutex_unlock(&shard->lock);
+    if (len > 0) {
+        age_records(reply, len, cache->clock(NULL) - cached_time, 0);
+    }
+    return len;
+}
+
+// Attempt to retrieve from `cache` an expired reply to the question with key
+// `key`, as long as it has not been expired for longer than the cache keeps
+// such replies. If there is one, it is copied into `reply`, of size `size`,
+// its TTLs set to CACHE_STALE_TTL, and its length is returned. Otherwise, 0
 // is returned.
-cache_entry_t *cache_get(cache_t *cache, char *name) {
-    cache_entry_t *entry = cache_find(cache, name);
-    if (entry && !cache_entry_is_expired(entry)) {
-        time_t curr_time = time(NULL);
-        int diff = (int)difftime(curr_time, entry->cached_time);
-        if (diff > entry->record->ttl) {
-            entry->record->ttl = 0;
-        } else {
-            entry->record->ttl = entry->record->ttl - diff;
+uint16_t cache_get_stale(cache_t *cache, cache_key_t *key, uint8_t *reply,
+                         uint16_t size) {
+    uint16_t len = 0;
+    time_t cached_time = 0;
+    time_t curr_time = cache->clock(NULL);
+    cache_shard_t *shard = cache_shard(cache, key);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = *cache_find(shard, key);
+    if (entry && cache_entry_is_expired(entry, curr_time) &&
+        !cache_entry_is_dead(entry, curr_time, cache->max_stale) &&
+        entry->reply_len <= size) {
+        memcpy(reply, entry->reply, entry->reply_len);
+        cached_time = entry->cached_time;
+        len = entry->reply_len;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (len > 0) {
+        age_records(reply, len, curr_time - cached_time, CACHE_STALE_TTL);
+    }
+    return len;
+}
+
+// cache_get(), for when the lock of `shard`, the shard of `key`, is already
+// held, leaving the TTLs of the reply as they were when it was cached, at
+// `cached_time`
+uint16_t cache_get_locked(cache_t *cache, cache_shard_t *shard,
+                          cache_key_t *key, uint8_t *reply, uint16_t size,
+                          time_t *cached_time, time_t *expiry_time,
+                          bool *refresh) {
+    cache_entry_t *entry = *cache_find(shard, key);
+    time_t curr_time = cache->clock(NULL);
+    if (!entry || cache_entry_is_expired(entry, curr_time) ||
+        entry->reply_len > size) {
+        return 0;
+    }
+    entry->hits++;
+    if (cache->policy == CACHE_EVICT_LRU || cache->policy == CACHE_EVICT_LFU) {
+        // it only goes later in the order of eviction
+        entry->used = ++shard->nuses;
+        heap_sift_down(cache, shard, entry->heap_index, shard->size);
+    }
+    if (refresh) {
+        // a refresh that failed, or never got a reply, no longer counts
+        *refresh = entry->refresh_deadline <= curr_time &&
+                   entry->hits >= CACHE_REFRESH_MIN_HITS &&
+                   cache_entry_is_due(entry, curr_time,
+                                      cache->refresh_percent);
+        if (*refresh) {
+            entry->refresh_deadline = curr_time + CACHE_REFRESH_TIMEOUT;
+        }
+    }
+    memcpy(reply, entry->reply, entry->reply_len);
+    *cached_time = entry->cached_time;
+    *expiry_time = entry->expiry_time;
+    return entry->reply_len;
+}
+
+// Returns the slot in `shard` that points to the entry holding a reply to the
+// question with key `key`. The slot points to NULL if there is no such entry
+// (the end of the bucket it would be in).
+cache_entry_t **cache_find(cache_shard_t *shard, cache_key_t *key) {
+    uint32_t hash = cache_key_hash(key);
+    cache_entry_t **slot = &shard->buckets[hash & (shard->nbuckets - 1)];
+    while (*slot) {
+        if ((*slot)->hash == hash && cache_entry_has_key(*slot, key)) {
+            break;
         }
-        cache_entry_t *new_entry = new_cache_entry(
-            entry->record, entry->cached_time, entry->expiry_time);
-        if (!cache_entry_is_expired(new_entry)) {
-            return new_entry;
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Returns a new entry of `shard` containing the reply `reply` of length
+// `reply_len` to the question with key `key` (this function will copy it)
+// and the time it was cached/will expire, allocated from the slab of its size
+// class, which the shard is charged for if it grows. It is not in the shard
+// yet.
+cache_entry_t *cache_alloc(cache_shard_t *shard, cache_key_t *key,
+                           uint8_t *reply, uint16_t reply_len,
+                           time_t cached_time, time_t expiry_time) {
+    int size_class = cache_size_class(reply_len);
+    slab_t *slab = &shard->slabs[size_class];
+    shard->nbytes -= slab->nbytes;
+    cache_entry_t *entry = slab_alloc(slab);
+    shard->nbytes += slab->nbytes;
+    init_cache_entry(entry, key, reply, reply_len, cached_time, expiry_time);
+    entry->size_class = size_class;
+    entry->used = ++shard->nuses;
+    return entry;
+}
+
+// Frees `entry`, allocated by cache_alloc() but no longer in `shard`, which
+// is no longer charged for its slab if that is freed too
+void cache_free(cache_shard_t *shard, cache_entry_t *entry) {
+    slab_t *slab = &shard->slabs[entry->size_class];
+    shard->nbytes -= slab->nbytes;
+    slab_free(slab, entry);
+    shard->nbytes += slab->nbytes;
+}
+
+// Returns the size class of the entries that can hold a reply of length
+// `reply_len`, or -1 if it is too long for any
+int cache_size_class(uint16_t reply_len) {
+    size_t data_len = cache_entry_size(reply_len) - sizeof(cache_entry_t);
+    for (int i = 0; i < CACHE_NUM_SIZE_CLASSES; i++) {
+        if (data_len <= ((size_t)MIN_CLASS_DATA_LEN << i)) {
+            return i;
         }
     }
-    return NULL;
+    return -1;
+}
+
+// Returns the memory `shard` takes on for another entry of size class
+// `size_class`: its indexing, and a new slab unless the slab of its size
+// class has room for it
+size_t cache_entry_nbytes(cache_shard_t *shard, int size_class) {
+    return slab_alloc_nbytes(&shard->slabs[size_class]) + ENTRY_INDEX_SIZE;
+}
+
+// Frees `entry`, just removed from `shard` to make room, returning a copy of
+// its key and times instead, allocated from `arena`
+cache_entry_t *cache_evict(cache_shard_t *shard, cache_entry_t *entry,
+                           arena_t *arena) {
+    cache_entry_t *evicted = copy_cache_entry_key(entry, arena);
+    cache_free(shard, entry);
+    return evicted;
 }
 
-// Returns the first entry in `cache` (this should be the only one if any)
-// that holds a record with name `name`, NULL otherwise.
-cache_entry_t *cache_find(cache_t *cache, char *name) {
-    if (!cache) {
+// Inserts `entry` into `shard` of `cache`, at the front of its bucket and
+// into the heap, growing the hash table if it is getting too full
+void cache_insert(cache_t *cache, cache_shard_t *shard, cache_entry_t *entry) {
+    if (shard->size >= shard->nbuckets) {
+        cache_grow(shard);
+    }
+    heap_push(cache, shard, entry);
+    size_t i = entry->hash & (shard->nbuckets - 1);
+    entry->next = shard->buckets[i];
+    shard->buckets[i] = entry;
+    shard->size++;
+    shard->nbytes += ENTRY_INDEX_SIZE;
+}
+
+// Removes the entry `slot` points to from `shard` of `cache`, and returns it
+cache_entry_t *cache_remove(cache_t *cache, cache_shard_t *shard,
+                            cache_entry_t **slot) {
+    cache_entry_t *entry = *slot;
+    heap_remove(cache, shard, entry);
+    *slot = entry->next;
+    entry->next = NULL;
+    shard->size--;
+    shard->nbytes -= ENTRY_INDEX_SIZE;
+    return entry;
+}
+
+// Removes the entry of `shard` of `cache` that goes first in the context of
+// eviction, and returns it, or NULL if the shard is empty
+cache_entry_t *cache_remove_min(cache_t *cache, cache_shard_t *shard) {
+    if (shard->size == 0) {
         return NULL;
     }
-    node_t *curr = cache->entries->head;
-    while (curr) {
-        if (strcmp((char *)curr->data->record->name, name) == 0) {
-            return curr->data;
+    cache_entry_t *min = shard->heap[0];
+    cache_entry_t **slot = &shard->buckets[min->hash & (shard->nbuckets - 1)];
+    while (*slot != min) {
+        slot = &(*slot)->next;
+    }
+    return cache_remove(cache, shard, slot);
+}
+
+// Evicts every entry of `shard` of `cache` that has expired by the time
+// `now`, and can no longer be served stale either, linking their copies (see
+// cache_evict()) from `last`. Returns where the next entry evicted is to be
+// linked from. Under least TTL, as they are at the top of the heap, each
+// takes O(log n) to find and remove, once; under the other policies, only
+// those at the top are.
+cache_entry_t **cache_reclaim_expired(cache_t *cache, cache_shard_t *shard,
+                                      time_t now, arena_t *arena,
+                                      cache_entry_t **last) {
+    while (shard->size > 0 &&
+           cache_entry_is_dead(shard->heap[0], now, cache->max_stale)) {
+        *last = cache_evict(shard, cache_remove_min(cache, shard), arena);
+        last = &(*last)->next;
+    }
+    return last;
+}
+
+// Doubles the number of buckets of `shard`, moving every entry into its new
+// bucket. This keeps about one entry per bucket, so that finding an entry
+// takes constant time.
+void cache_grow(cache_shard_t *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    cache_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+    assert(buckets);
+
+    for (size_t i = 0; i < shard->nbuckets; i++) {
+        cache_entry_t *curr = shard->buckets[i];
+        while (curr) {
+            cache_entry_t *next = curr->next;
+            cache_entry_t **bucket = &buckets[curr->hash & (nbuckets - 1)];
+            curr->next = *bucket;
+            *bucket = curr;
+            curr = next;
         }
-        curr = curr->next;
     }
-    return NULL;
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
 }
 
-// Returns true if the cache is full, false otherwise
-bool cache_is_full(cache_t *cache) {
-    return list_size(cache->entries) == cache->capacity;
+// Returns true if there is room in `shard` for another `nbytes` bytes,
+// false otherwise
+bool cache_has_room(cache_shard_t *shard, size_t nbytes) {
+    return shard->nbytes + nbytes <= shard->max_bytes;
 }
 
-// Puts a resource record `record` into `cache`. If an expired entry holding
-// that record exists, it is evicted and replaced by `record`. Otherwise, if
-// the cache is full, then the record with the lowest TTL is replaced
-// instead. In both cases, the record evicted is returned (remember to free
-// this). If no record is evicted, then this function returns NULL.
-cache_entry_t *cache_put(cache_t *cache, record_t *record) {
-    assert(cache && record);
+// Puts the reply `reply` of length `reply_len` to the question with key `key`
+// into `cache`, to expire in `ttl` seconds. The reply must hold the header,
+// the question and the answers, and nothing else. If an entry for that
+// question exists, expired or not, it is evicted and replaced by `reply`.
+// Otherwise, any other entries expired for good (see cache_entry_is_dead())
+// are evicted. Then, while the shard of the question does not have room for
+// `reply` (nor a new slab for it, if it needs one), the replies going first
+// by its policy (with the lowest TTL, by default) are evicted. The entries
+// evicted are returned, linked in the order they were evicted, as copies of
+// their keys and times (see copy_cache_entry_key()) allocated from `arena`
+// (freed along with it). If no entry is evicted, or if `reply` cannot be
+// cached at all, then this function returns NULL.
+cache_entry_t *cache_put(cache_t *cache, cache_key_t *key, uint32_t ttl,
+                         uint8_t *reply, uint16_t reply_len, arena_t *arena) {
+    assert(cache && key && reply && arena);
 
-    time_t curr_time = time(NULL);
-    cache_entry_t *new_entry =
-        new_cache_entry(record, curr_time, curr_time + record->ttl);
+    cache_shard_t *shard = cache_shard(cache, key);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *evicted =
+        cache_put_locked(cache, shard, key, ttl, reply, reply_len, arena);
+    pthread_mutex_unlock(&shard->lock);
+    return evicted;
+}
 
-    cache_entry_t *to_evict = cache_find(cache, (char *)record->name);
-    if (to_evict && cache_entry_is_expired(to_evict)) {
-        list_remove(cache->entries, to_evict);
-        list_add_end(cache->entries, new_entry);
-        return to_evict;
+// cache_put(), for when the lock of `shard`, the shard of `key`, is already
+// held
+cache_entry_t *cache_put_locked(cache_t *cache, cache_shard_t *shard,
+                                cache_key_t *key, uint32_t ttl,
+                                uint8_t *reply, uint16_t reply_len,
+                                arena_t *arena) {
+    int size_class = cache_size_class(reply_len);
+    if (size_class < 0 || shard->slabs[size_class].slab_size +
+                                  ENTRY_INDEX_SIZE > shard->max_bytes) {
+        return NULL;
+    }
+    time_t curr_time = cache->clock(NULL);
+
+    cache_entry_t *evicted = NULL;
+    cache_entry_t **last = &evicted;
+    cache_entry_t **slot = cache_find(shard, key);
+    if (*slot) {
+        *last = cache_evict(shard, cache_remove(cache, shard, slot), arena);
+        last = &(*last)->next;
+    } else {
+        last = cache_reclaim_expired(cache, shard, curr_time, arena, last);
+    }
+    while (!cache_has_room(shard, cache_entry_nbytes(shard, size_class))) {
+        *last = cache_evict(shard, cache_remove_min(cache, shard), arena);
+        last = &(*last)->next;
     }
-    if (cache_is_full(cache)) {
-        cache_entry_t *to_evict = list_min(cache->entries, cache_entry_cmp);
-        list_remove(cache->entries, to_evict);
-        list_add_end(cache->entries, new_entry);
-        return to_evict;
+
+    cache_insert(cache, shard, cache_alloc(shard, key, reply, reply_len,
+                                           curr_time, curr_time + ttl));
+    return evicted;
+}
+
+// Compares two entries of `cache` in the context of eviction, by its policy:
+// returns a negative number if `entry1` goes first, a positive one if
+// `entry2` does, and 0 if they are the same entry
+int cache_cmp(cache_t *cache, cache_entry_t *entry1, cache_entry_t *entry2) {
+    switch (cache->policy) {
+    case CACHE_EVICT_LFU:
+        if (entry1->hits != entry2->hits) {
+            return entry1->hits < entry2->hits ? -1 : +1;
+        }
+        // fall through
+    case CACHE_EVICT_LRU:
+    case CACHE_EVICT_FIFO:
+        // no two entries of a shard are used at once
+        return (entry1->used > entry2->used) - (entry1->used < entry2->used);
+    default:
+        return cache_entry_cmp(entry1, entry2);
     }
-    list_add_end(cache->entries, new_entry);
-    return NULL;
-}
\ No newline at end of file
+}
+
+// Adds `entry` to the heap of `shard` of `cache` (not counted in its size
+// yet), growing the heap if needed
+void heap_push(cache_t *cache, cache_shard_t *shard, cache_entry_t *entry) {
+    if (shard->size == shard->heap_capacity) {
+        shard->heap_capacity *= 2;
+        shard->heap = realloc(shard->heap,
+                              shard->heap_capacity * sizeof(*shard->heap));
+        assert(shard->heap);
+    }
+    heap_set(shard, shard->size, entry);
+    heap_sift_up(cache, shard, shard->size);
+}
+
+// Removes `entry` from the heap of `shard` of `cache` (still counted in its
+// size), by moving the last entry of the heap in its place
+void heap_remove(cache_t *cache, cache_shard_t *shard, cache_entry_t *entry) {
+    size_t i = entry->heap_index;
+    size_t last = shard->size - 1;
+    if (i == last) {
+        return;
+    }
+    heap_set(shard, i, shard->heap[last]);
+    if (i > 0 &&
+        cache_cmp(cache, shard->heap[i], shard->heap[(i - 1) / 2]) < 0) {
+        heap_sift_up(cache, shard, i);
+    } else {
+        heap_sift_down(cache, shard, i, last);
+    }
+}
+
+// Puts `entry` at index `i` of the heap of `shard`, keeping track of where
+void heap_set(cache_shard_t *shard, size_t i, cache_entry_t *entry) {
+    shard->heap[i] = entry;
+    entry->heap_index = i;
+}
+
+// Moves the entry at index `i` of the heap of `shard` of `cache` up, until
+// its parent goes before it
+void heap_sift_up(cache_t *cache, cache_shard_t *shard, size_t i) {
+    cache_entry_t *entry = shard->heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (cache_cmp(cache, shard->heap[parent], entry) <= 0) {
+            break;
+        }
+        heap_set(shard, i, shard->heap[parent]);
+        i = parent;
+    }
+    heap_set(shard, i, entry);
+}
+
+// Moves the entry at index `i` of the heap of `shard` of `cache`, of `size`
+// entries, down, until it goes before both its children
+void heap_sift_down(cache_t *cache, cache_shard_t *shard, size_t i,
+                    size_t size) {
+    cache_entry_t *entry = shard->heap[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && cache_cmp(cache, shard->heap[child + 1],
+                                          shard->heap[child]) < 0) {
+            child++;
+        }
+        if (cache_cmp(cache, entry, shard->heap[child]) <= 0) {
+            break;
+        }
+        heap_set(shard, i, shard->heap[child]);
+        i = child;
+    }
+    heap_set(shard, i, entry);
+}
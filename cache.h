@@ -3,32 +3,99 @@
  * Author: Jonathan Jauhari 1038331
  *
  * Cache module containing functions for manipulation of resource record
- * caches, for a DNS server. The cache is assumed to only hold a set
- * number of IPv6 resource records. The eviction policy is based on least
- * TTL.
+ * caches, for a DNS server. The cache holds replies to questions, in wire
+ * format, as many as fit in its memory budget, indexed by a hash table on
+ * the name, type and class of their question, and by a min-heap on when they
+ * expire. The eviction policy is based on least TTL, and expired replies are
+ * reclaimed as new ones are put in. A cache may be shared between threads:
+ * it is split into shards by the hash of the question, each with its own
+ * lock, held by every operation on it, and copies are returned rather than
+ * entries still in the cache.
  */
 
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "arena.h"
 #include "dns_message.h"
 #include "cache_entry.h"
-#include "list.h"
+#include "slab.h"
 
-// A cache has a set capacity, and contains list of entries, which contain the
-// resource records and the time they were cached.
+// number of hits after which an entry is worth refreshing before it expires
+#define CACHE_REFRESH_MIN_HITS 3
+// how long, in seconds, a refresh of an entry has to replace it before
+// another may be started: longer than upstream is waited on for a reply
+#define CACHE_REFRESH_TIMEOUT 5
+
+// TTL of the records of a reply served stale (RFC 8767)
+#define CACHE_STALE_TTL 30
+
+// number of shards the cache of a server is split into, so that workers
+// contend for the lock of a shard only when they hit the same part of it
+#define CACHE_NUM_SHARDS 16
+
+// number of sizes of entries, each allocated from its own slab, by the
+// length of their reply: up to 32, 64, 128, ... or 64K bytes
+#define CACHE_NUM_SIZE_CLASSES 12
+
+// The policies a cache can evict entries by, to make room for new ones
+typedef enum {
+    CACHE_EVICT_LEAST_TTL,  // the entry expiring first
+    CACHE_EVICT_LRU,        // the entry hit least recently
+    CACHE_EVICT_LFU,        // the entry hit least often, then least recently
+    CACHE_EVICT_FIFO,       // the entry put in first
+    CACHE_NUM_POLICIES
+} cache_policy_t;
+
+// A shard of a cache has its share of the memory budget, and contains a hash
+// table of entries, which contain the replies and the time they were cached.
+// Entries whose keys hash to the same bucket are chained together. The same
+// entries are kept in a binary min-heap, ordered for eviction by the policy
+// of the cache (the first to expire at the top, by default). Entries are
+// allocated from slabs, one per size class, given back once empty. The
+// shard is charged for its slabs whole, however few of their entries are in
+// use, and for the indexing of its entries: entries are evicted to keep
+// that within its share of the budget, so the memory of a cache is bounded
+// by its budget, bar the copies it returns and the slack of malloc(). The
+// lock guards all of these.
+typedef struct {
+    cache_entry_t **buckets;
+    size_t nbuckets;  // always a power of 2
+    cache_entry_t **heap;
+    size_t heap_capacity;
+    size_t size;  // number of entries, in the hash table and the heap
+    size_t nbytes;  // memory taken by the slabs and the indexing of entries
+    size_t max_bytes;
+    uint64_t nuses;  // entries put in or hit so far, to order them by use
+    slab_t slabs[CACHE_NUM_SIZE_CLASSES];
+    pthread_mutex_t lock;
+} cache_shard_t;
+
+// A cache is split into shards, each holding the entries whose keys hash to
+// it, and evicting them on its own. The time is taken from `clock`, time()
+// unless replaced (to replay a trace on a virtual clock, say).
 typedef struct {
-    list_t *entries;
-    size_t capacity;
+    cache_shard_t *shards;
+    int nshards;
+    int refresh_percent;  // of their TTL left under which hot entries refresh
+    time_t max_stale;  // how long expired entries are kept to be served stale
+    cache_policy_t policy;
+    time_t (*clock)(time_t *);
 } cache_t;
 
-cache_t *new_cache(size_t capacity);
+cache_t *new_cache(size_t max_bytes, int nshards, int refresh_percent,
+                   time_t max_stale, cache_policy_t policy);
 void free_cache(cache_t *cache);
 
-cache_entry_t *cache_get(cache_t *cache, char *name);
-cache_entry_t *cache_put(cache_t *cache, record_t *record);
+uint16_t cache_get(cache_t *cache, cache_key_t *key, uint8_t *reply,
+                   uint16_t size, time_t *expiry_time, bool *refresh);
+uint16_t cache_get_stale(cache_t *cache, cache_key_t *key, uint8_t *reply,
+                         uint16_t size);
+cache_entry_t *cache_put(cache_t *cache, cache_key_t *key, uint32_t ttl,
+                         uint8_t *reply, uint16_t reply_len, arena_t *arena);
 
 #endif
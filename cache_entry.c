@@ -3,85 +3,167 @@
  * Author: Jonathan Jauhari 1038331
  *
  * Cache entry module containing functions for manipulation of cached
- * resource record entries.
+ * reply entries.
  */
 
 #include "cache_entry.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Create and returns a new cache entry containing the record (this function
-// will copy it) and the time it was cached/will expire. May be used as a deep
-// copy function.
-cache_entry_t *new_cache_entry(record_t *record, time_t cached_time,
-                               time_t expiry_time) {
-    cache_entry_t *entry = malloc(sizeof(*entry));
-    record_t *new_record = malloc(sizeof(*new_record));
-    assert(entry && new_record);
-
-    // copy the record
-    new_record->name = malloc(strlen((char *)record->name) + 1);
-    strcpy((char *)new_record->name, (char *)record->name);
-
-    new_record->type = record->type;
-    new_record->class = record->class;
-    new_record->ttl = record->ttl;
-    new_record->rdlen = record->rdlen;
+// parameters of the FNV-1a hash function (32-bit)
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
 
-    new_record->rdata = malloc(strlen(record->rdata) + 1);
-    strcpy(new_record->rdata, record->rdata);
+// the number of bytes at the end of a question after its name (QTYPE and
+// QCLASS), which are compared as they are
+#define QUESTION_FIXED_SIZE 4
 
-    entry->record = new_record;
-    entry->cached_time = cached_time;
-    entry->expiry_time = expiry_time;
+// Create and returns a new cache entry containing the reply `reply` of
+// length `reply_len` (this function will copy it) to the question with key
+// `key`, and the time it was cached/will expire, in one allocation.
+cache_entry_t *new_cache_entry(cache_key_t *key, uint8_t *reply,
+                               uint16_t reply_len, time_t cached_time,
+                               time_t expiry_time) {
+    cache_entry_t *entry = malloc(cache_entry_size(reply_len));
+    assert(entry);
+    init_cache_entry(entry, key, reply, reply_len, cached_time, expiry_time);
+    return entry;
+}
 
+// Returns a copy of `cache_entry` with the header and question of its reply
+// (its key) but not its answers, in one allocation from `arena` (freed along
+// with it): enough to tell what it held a reply to, and until when
+cache_entry_t *copy_cache_entry_key(cache_entry_t *cache_entry,
+                                    arena_t *arena) {
+    cache_key_t key = {.question = cache_entry->reply + HEADER_SIZE,
+                       .len = cache_entry->question_len};
+    uint16_t len = HEADER_SIZE + cache_entry->question_len;
+    cache_entry_t *entry = arena_alloc(arena, cache_entry_size(len));
+    init_cache_entry(entry, &key, cache_entry->reply, len,
+                     cache_entry->cached_time, cache_entry->expiry_time);
     return entry;
 }
 
-// Frees a cache entry and the resource record it holds
+// Frees a cache entry created by new_cache_entry(), and the reply it holds
 void free_cache_entry(cache_entry_t *cache_entry) {
-    free(cache_entry->record->name);
-    free(cache_entry->record->rdata);
-    free(cache_entry->record);
     free(cache_entry);
 }
 
-// Returns true if the time-to-live of `cache_entry` is 0, false otherwise
-bool cache_entry_is_expired(cache_entry_t *cache_entry) {
-    return cache_entry->record->ttl == 0;
+// Initialises the cache entry `cache_entry`, of at least
+// cache_entry_size(reply_len) bytes, to contain the reply `reply` (this
+// function will copy it) to the question with key `key`, which must be the
+// question of the reply, and the time it was cached/will expire
+void init_cache_entry(cache_entry_t *cache_entry, cache_key_t *key,
+                      uint8_t *reply, uint16_t reply_len, time_t cached_time,
+                      time_t expiry_time) {
+    memcpy(cache_entry->reply, reply, reply_len);
+    cache_entry->reply_len = reply_len;
+    cache_entry->question_len = key->len;
+
+    cache_entry->cached_time = cached_time;
+    cache_entry->expiry_time = expiry_time;
+    cache_entry->hash = cache_key_hash(key);
+    cache_entry->hits = 0;
+    cache_entry->used = 0;
+    cache_entry->refresh_deadline = 0;
+    cache_entry->size_class = 0;
+    cache_entry->next = NULL;
+    cache_entry->heap_index = 0;
+}
+
+// Returns the size of a cache entry holding a reply of length `reply_len`
+size_t cache_entry_size(uint16_t reply_len) {
+    return sizeof(cache_entry_t) + reply_len;
+}
+
+// Returns true if `cache_entry` has expired by the time `now`, false
+// otherwise
+bool cache_entry_is_expired(cache_entry_t *cache_entry, time_t now) {
+    return cache_entry->expiry_time <= now;
+}
+
+// Returns true if `cache_entry` has been expired for `max_stale` seconds by
+// the time `now`, so it can no longer be served stale either
+bool cache_entry_is_dead(cache_entry_t *cache_entry, time_t now,
+                         time_t max_stale) {
+    return cache_entry->expiry_time + max_stale <= now;
+}
+
+// Returns true if `cache_entry` is due to be refreshed by the time `now`: if
+// it is in the last `refresh_percent` percent of its TTL. Never, if 0.
+bool cache_entry_is_due(cache_entry_t *cache_entry, time_t now,
+                        int refresh_percent) {
+    time_t ttl = cache_entry->expiry_time - cache_entry->cached_time;
+    return (cache_entry->expiry_time - now) * 100 < ttl * refresh_percent;
 }
 
 // Compares two cache entries in the context of cache eviction.
-// `entry1` goes before `entry2` if its current TTL is less, breaking ties
-// with the name of the resource records the entries hold.
+// `entry1` goes before `entry2` if it expires sooner (so its current TTL is
+// less), breaking ties with the questions the entries answer.
 int cache_entry_cmp(cache_entry_t *entry1, cache_entry_t *entry2) {
-    record_t *record1 = entry1->record;
-    record_t *record2 = entry2->record;
-    if (record1->ttl < record2->ttl) {
+    if (entry1->expiry_time < entry2->expiry_time) {
         return -1;
-    } else if (record1->ttl > record2->ttl) {
+    } else if (entry1->expiry_time > entry2->expiry_time) {
         return +1;
-    } else {
-        return strcmp((char *)record1->name, (char *)record2->name);
     }
+    uint16_t len1 = entry1->question_len, len2 = entry2->question_len;
+    int cmp = memcmp(entry1->reply + HEADER_SIZE, entry2->reply + HEADER_SIZE,
+                     len1 < len2 ? len1 : len2);
+    return cmp != 0 ? cmp : len1 - len2;
 }
 
-// Returns true if `entry1` and `entry2` hold resource records with the same
-// name
+// Returns true if `entry1` and `entry2` hold replies to questions with the
+// same key: name (ignoring case), type and class
 bool cache_entry_eq(cache_entry_t *entry1, cache_entry_t *entry2) {
-    return strcmp((char *)entry1->record->name,
-                  (char *)entry2->record->name) == 0;
+    cache_key_t key = {.question = entry2->reply + HEADER_SIZE,
+                       .len = entry2->question_len};
+    return cache_entry_has_key(entry1, &key);
 }
 
-// Get the time `cache_entry` expires and put it in `timestamp`, which has
-// length `len`, formatted like 2021-05-10T02:07:11+0000. Returns a pointer
-// to `timestamp`.
-char *cache_entry_get_expiry(cache_entry_t *cache_entry, char *timestamp,
-                             size_t len) {
-    struct tm *tm = gmtime(&cache_entry->expiry_time);
+// Put the name of the question `cache_entry` holds a reply to into `text`
+// (of at least MAX_NAME_SIZE bytes), returning a pointer to `text`
+char *cache_entry_name(cache_entry_t *cache_entry, char *text) {
+    return get_name(cache_entry->reply, cache_entry->reply_len, HEADER_SIZE,
+                    text);
+}
 
-    strftime(timestamp, len, "%FT%T%z", tm);
-    return timestamp;
+// Returns the hash of the key `key` of a cached reply, its name ignoring
+// case, as DNS does. Length octets of labels are below the ASCII letters, so
+// folding the case of every octet of the name only folds its letters.
+uint32_t cache_key_hash(cache_key_t *key) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    size_t name_len = key->len - QUESTION_FIXED_SIZE;
+    for (size_t i = 0; i < key->len; i++) {
+        uint8_t c = i < name_len ? tolower(key->question[i]) : key->question[i];
+        hash = (hash ^ c) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Returns true if `cache_entry` holds a reply to the question with key `key`:
+// with the same name (ignoring case), type and class
+bool cache_entry_has_key(cache_entry_t *cache_entry, cache_key_t *key) {
+    cache_key_t entry_key = {.question = cache_entry->reply + HEADER_SIZE,
+                             .len = cache_entry->question_len};
+    return cache_key_eq(&entry_key, key);
+}
+
+// Returns true if the keys `key1` and `key2` are of the same question: with
+// the same name (ignoring case), type and class
+bool cache_key_eq(cache_key_t *key1, cache_key_t *key2) {
+    size_t name_len = key2->len - QUESTION_FIXED_SIZE;
+    if (key1->len != key2->len ||
+        memcmp(key1->question + name_len, key2->question + name_len,
+               QUESTION_FIXED_SIZE) != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        if (tolower(key1->question[i]) != tolower(key2->question[i])) {
+            return false;
+        }
+    }
+    return true;
 }
@@ -3,32 +3,74 @@
  * Author: Jonathan Jauhari 1038331
  *
  * Cache entry module containing functions for manipulation of cached
- * resource record entries.
+ * reply entries.
  */
 
 #ifndef CACHE_ENTRY_H
 #define CACHE_ENTRY_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include "arena.h"
 #include "dns_message.h"
 
-// A cache entry stores the record and the time it was cached
+// The key of a cache entry: the question it holds a reply to, as it is on
+// the wire (QNAME, QTYPE then QCLASS), its name compared ignoring case
 typedef struct {
-    record_t *record;
+    uint8_t *question;
+    uint16_t len;
+} cache_key_t;
+
+// A cache entry stores a reply, in wire format, to a question: its header,
+// the question and the answers, ready to be sent (once its ID and TTLs are
+// set). The question of the reply, right after its header, is the key of the
+// entry. Along with it are the time it was cached, the hash of its key, how
+// many times it was hit and when it was last used (put in or hit, counted in
+// uses of the cache), until when it is being refreshed, the next entry in its
+// bucket of the cache, and its position in the cache's heap. The reply is
+// stored inline, in one allocation: the entry is as long as it is, see
+// cache_entry_size().
+typedef struct cache_entry cache_entry_t;
+struct cache_entry {
+    uint16_t reply_len;
+    uint16_t question_len;
+    uint8_t size_class;  // which slab of the cache it was allocated from
     time_t cached_time;
     time_t expiry_time;
-} cache_entry_t;
+    uint32_t hash;
+    uint32_t hits;
+    uint64_t used;
+    time_t refresh_deadline;  // 0 if it is not being refreshed
+    cache_entry_t *next;
+    size_t heap_index;
+    uint8_t reply[];
+};
 
-cache_entry_t *new_cache_entry(record_t *record, time_t cached_time,
+cache_entry_t *new_cache_entry(cache_key_t *key, uint8_t *reply,
+                               uint16_t reply_len, time_t cached_time,
                                time_t expiry_time);
+cache_entry_t *copy_cache_entry_key(cache_entry_t *cache_entry,
+                                    arena_t *arena);
 void free_cache_entry(cache_entry_t *cache_entry);
+void init_cache_entry(cache_entry_t *cache_entry, cache_key_t *key,
+                      uint8_t *reply, uint16_t reply_len, time_t cached_time,
+                      time_t expiry_time);
+size_t cache_entry_size(uint16_t reply_len);
 
-bool cache_entry_is_expired(cache_entry_t *cache_entry);
+bool cache_entry_is_expired(cache_entry_t *cache_entry, time_t now);
+bool cache_entry_is_dead(cache_entry_t *cache_entry, time_t now,
+                         time_t max_stale);
+bool cache_entry_is_due(cache_entry_t *cache_entry, time_t now,
+                        int refresh_percent);
 int cache_entry_cmp(cache_entry_t *entry1, cache_entry_t *entry2);
 bool cache_entry_eq(cache_entry_t *entry1, cache_entry_t *entry2);
+char *cache_entry_name(cache_entry_t *cache_entry, char *text);
 
-char *cache_entry_get_expiry(cache_entry_t *cache_entry, char *timestamp,
-                             size_t len);
+uint32_t cache_key_hash(cache_key_t *key);
+bool cache_key_eq(cache_key_t *key1, cache_key_t *key2);
+bool cache_entry_has_key(cache_entry_t *cache_entry, cache_key_t *key);
 
 #endif
@@ -0,0 +1,483 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Cache simulator program: replays a trace of queries against the cache
+ * module, on a virtual clock, for each of a few memory budgets and eviction
+ * policies, and reports how well each does: the share of queries and of
+ * bytes replied to from the cache, and the rate of queries left to forward
+ * upstream. This is to size caches, and pick their policy, from real
+ * traffic, offline.
+ *
+ * A trace is either a log of the DNS server (its "requested" lines, at the
+ * times they were logged), or a capture in a .raw file (messages prefixed
+ * with their two-byte size): its queries, a fixed time apart, and the replies
+ * to them. Several traces are replayed one after the other. A reply to a
+ * query is cached as the server would cache it; if the trace has none (logs
+ * never do), it is made up, with one AAAA record and a set TTL. Refreshing
+ * ahead and serving stale replies are not simulated.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "config.h"
+#include "dns_message.h"
+#include "util.h"
+
+// default memory budgets to simulate
+#define DEFAULT_SIZES "256K,1M,4M,16M,64M"
+// default TTL of the replies made up, in seconds
+#define DEFAULT_TTL 300
+// default rate of the queries of a capture, which has no times, in queries
+// per second
+#define DEFAULT_QPS 100
+// the most memory budgets simulated
+#define MAX_SIZES 32
+// size of the block of the arena evicted entries are copied into
+#define ARENA_SIZE 4096
+// the largest log line read
+#define MAX_LINE_LEN 1024
+// the most bytes a query of the trace takes
+#define MAX_QUERY_SIZE (HEADER_SIZE + MAX_NAME_SIZE + 4)
+
+// names of the eviction policies, by cache_policy_t
+char *policy_names[] = {"least-ttl", "lru", "lfu", "fifo"};
+
+// The settings of a simulation
+typedef struct {
+    size_t sizes[MAX_SIZES];  // memory budgets, in bytes
+    int nsizes;
+    bool policies[CACHE_NUM_POLICIES];  // which are simulated
+    uint32_t ttl;  // of the replies made up
+    double qps;    // of the queries of captures
+} sim_config_t;
+
+// A query of the trace: when it was made, and the question it asks (as on
+// the wire) in the trace's pool of questions
+typedef struct {
+    time_t time;
+    size_t offset;
+    uint16_t len;
+} trace_query_t;
+
+// A trace of queries, in the order they were made, and the replies to them
+// found in the trace, kept in a cache of their own (that never evicts nor
+// expires) by their question
+typedef struct {
+    trace_query_t *queries;
+    size_t nqueries;
+    size_t capacity;
+    uint8_t *questions;
+    size_t questions_len;
+    size_t questions_capacity;
+    cache_t *replies;
+    time_t start_time;
+    time_t end_time;
+} trace_t;
+
+// What a simulation counted
+typedef struct {
+    uint64_t queries;
+    uint64_t hits;
+    uint64_t bytes;
+    uint64_t hit_bytes;
+    uint64_t evictions;
+} sim_result_t;
+
+void parse_sim_config(sim_config_t *config, int argc, char *argv[]);
+void print_sim_usage(char *prog);
+
+void init_trace(trace_t *trace);
+void free_trace(trace_t *trace);
+void load_log(trace_t *trace, char *path);
+void load_capture(trace_t *trace, char *path, double qps);
+void add_query(trace_t *trace, time_t time, uint8_t *question, uint16_t len);
+
+sim_result_t simulate(trace_t *trace, sim_config_t *config, size_t max_bytes,
+                      cache_policy_t policy);
+uint16_t get_reply(trace_t *trace, cache_key_t *key, uint32_t ttl,
+                   uint8_t *reply);
+time_t get_virtual_time(time_t *tloc);
+time_t get_zero_time(time_t *tloc);
+
+// the time on the virtual clock of the simulation
+time_t virtual_time = 0;
+
+// Replays the traces given against a cache of each size and policy asked
+// for, and prints how each does, as tab-separated values. See
+// print_sim_usage() for the options.
+int main(int argc, char *argv[]) {
+    sim_config_t config;
+    parse_sim_config(&config, argc, argv);
+
+    trace_t trace;
+    init_trace(&trace);
+    for (int i = optind; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        if (len >= 4 && strcmp(argv[i] + len - 4, ".raw") == 0) {
+            load_capture(&trace, argv[i], config.qps);
+        } else {
+            load_log(&trace, argv[i]);
+        }
+    }
+    if (trace.nqueries == 0) {
+        fprintf(stderr, "no queries to replay\n");
+        exit(EXIT_FAILURE);
+    }
+    double secs = trace.end_time - trace.start_time + 1;
+    fprintf(stderr, "%zu queries over %.0f s (%.1f/s)\n", trace.nqueries,
+            secs, trace.nqueries / secs);
+
+    printf("policy\tbytes\thit_ratio\tbyte_hit_ratio\tupstream_qps\t"
+           "evictions\n");
+    for (int policy = 0; policy < CACHE_NUM_POLICIES; policy++) {
+        if (!config.policies[policy]) {
+            continue;
+        }
+        for (int i = 0; i < config.nsizes; i++) {
+            sim_result_t result =
+                simulate(&trace, &config, config.sizes[i], policy);
+            printf("%s\t%zu\t%.4f\t%.4f\t%.2f\t%llu\n", policy_names[policy],
+                   config.sizes[i], (double)result.hits / result.queries,
+                   (double)result.hit_bytes / result.bytes,
+                   (result.queries - result.hits) / secs,
+                   (unsigned long long)result.evictions);
+            fflush(stdout);
+        }
+    }
+    free_trace(&trace);
+    return 0;
+}
+
+// Fills in `config` from the command line arguments `argv`: options first,
+// then the traces. Exits if the arguments are invalid.
+void parse_sim_config(sim_config_t *config, int argc, char *argv[]) {
+    char *sizes = DEFAULT_SIZES;
+    char *policies = NULL;
+    config->ttl = DEFAULT_TTL;
+    config->qps = DEFAULT_QPS;
+
+    int opt;
+    bool valid = true;
+    while ((opt = getopt(argc, argv, "m:e:t:q:")) != -1) {
+        switch (opt) {
+        case 'm':
+            sizes = optarg;
+            break;
+        case 'e':
+            policies = optarg;
+            break;
+        case 't':
+            config->ttl = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            config->qps = atof(optarg);
+            valid &= config->qps > 0;
+            break;
+        default:
+            valid = false;
+        }
+    }
+
+    // comma-separated lists, copied since strtok() writes to them
+    char list[MAX_LINE_LEN];
+    config->nsizes = 0;
+    snprintf(list, sizeof(list), "%s", sizes);
+    for (char *size = strtok(list, ","); size; size = strtok(NULL, ",")) {
+        if (config->nsizes == MAX_SIZES ||
+            (config->sizes[config->nsizes++] = parse_size(size)) == 0) {
+            valid = false;
+        }
+    }
+    for (int i = 0; i < CACHE_NUM_POLICIES; i++) {
+        config->policies[i] = policies == NULL;
+    }
+    if (policies) {
+        snprintf(list, sizeof(list), "%s", policies);
+        for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+            int i = 0;
+            while (i < CACHE_NUM_POLICIES && strcmp(name, policy_names[i])) {
+                i++;
+            }
+            if (i < CACHE_NUM_POLICIES) {
+                config->policies[i] = true;
+            } else {
+                valid = false;
+            }
+        }
+    }
+
+    if (!valid || config->nsizes == 0 || argc - optind < 1) {
+        print_sim_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Print the usage of the program `prog` to stderr
+void print_sim_usage(char *prog) {
+    fprintf(stderr, "usage %s [-m sizes] [-e policies] [-t ttl] [-q qps] "
+                    "trace...\n", prog);
+    fprintf(stderr, "  -m sizes     memory budgets of the cache, like 64K or "
+                    "256M, separated by ','\n"
+                    "               (default %s)\n", DEFAULT_SIZES);
+    fprintf(stderr, "  -e policies  eviction policies, of least-ttl, lru, "
+                    "lfu and fifo,\n"
+                    "               separated by ',' (default all)\n");
+    fprintf(stderr, "  -t ttl       TTL of the replies the traces have none "
+                    "for (default %d)\n", DEFAULT_TTL);
+    fprintf(stderr, "  -q qps       rate of the queries of .raw captures "
+                    "(default %d)\n", DEFAULT_QPS);
+    fprintf(stderr, "  trace        a log of the server, or a .raw capture\n");
+}
+
+// Initialises `trace` with no queries
+void init_trace(trace_t *trace) {
+    trace->nqueries = 0;
+    trace->capacity = 1024;
+    trace->queries = malloc(trace->capacity * sizeof(*trace->queries));
+    trace->questions_len = 0;
+    trace->questions_capacity = 64 * 1024;
+    trace->questions = malloc(trace->questions_capacity);
+    assert(trace->queries && trace->questions);
+    trace->replies = new_cache(SIZE_MAX, 1, 0, 0, CACHE_EVICT_LEAST_TTL);
+    trace->replies->clock = get_zero_time;
+    trace->start_time = 0;
+    trace->end_time = 0;
+}
+
+// Frees the queries and replies of `trace`
+void free_trace(trace_t *trace) {
+    free(trace->queries);
+    free(trace->questions);
+    free_cache(trace->replies);
+}
+
+// Adds to `trace` a query made at `time` (on the clock of the trace), with
+// the question `question` of length `len` (this function will copy it)
+void add_query(trace_t *trace, time_t time, uint8_t *question, uint16_t len) {
+    if (trace->nqueries == trace->capacity) {
+        trace->capacity *= 2;
+        trace->queries = realloc(trace->queries,
+                                 trace->capacity * sizeof(*trace->queries));
+        assert(trace->queries);
+    }
+    while (trace->questions_len + len > trace->questions_capacity) {
+        trace->questions_capacity *= 2;
+        trace->questions =
+            realloc(trace->questions, trace->questions_capacity);
+        assert(trace->questions);
+    }
+    if (trace->nqueries == 0 || time < trace->start_time) {
+        trace->start_time = time;
+    }
+    if (trace->nqueries == 0 || time > trace->end_time) {
+        trace->end_time = time;
+    }
+    trace_query_t *query = &trace->queries[trace->nqueries++];
+    query->time = time;
+    query->offset = trace->questions_len;
+    query->len = len;
+    memcpy(trace->questions + trace->questions_len, question, len);
+    trace->questions_len += len;
+}
+
+// Adds to `trace` the queries logged by the DNS server in the log at `path`,
+// as far apart as they were logged, after those already in it. The log does
+// not say what type of records they were for, so they are taken to be for
+// AAAA records. Queries replied to with RCODE 4, logged as unimplemented
+// right after, are left out, as they were never forwarded nor cached. Exits
+// if error.
+void load_log(trace_t *trace, char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char line[MAX_LINE_LEN];
+    uint8_t query[MAX_QUERY_SIZE];
+    char name[MAX_NAME_SIZE + 1];
+    bool first = true;
+    time_t shift = 0;  // from the clock of the log to that of the trace
+    while (fgets(line, sizeof(line), fp)) {
+        time_t time;
+        char *event = parse_timestamp(line, &time);
+        if (!event) {
+            continue;
+        }
+        if (first) {
+            shift = trace->nqueries > 0 ? trace->end_time + 1 - time : 0;
+            first = false;
+        }
+        time += shift;
+        if (sscanf(event, " requested %255s", name) == 1) {
+            uint16_t len = make_query(query, 0, name, AAAA_RR_TYPE);
+            if (len > 0) {
+                add_query(trace, time, query + HEADER_SIZE,
+                          len - HEADER_SIZE);
+            }
+        } else if (strcmp(event, " unimplemented request\n") == 0 &&
+                   trace->nqueries > 0) {
+            trace_query_t *last = &trace->queries[--trace->nqueries];
+            trace->questions_len = last->offset;
+        }
+    }
+    fclose(fp);
+}
+
+// Adds to `trace` the queries in the capture at `path`, made at `qps`
+// queries per second after those already in it, and keeps the replies in
+// it, the last one to each question. Exits if error.
+void load_capture(trace_t *trace, char *path, double qps) {
+    size_t size;
+    uint8_t *data = read_file(path, &size);
+    time_t start_time = trace->nqueries > 0 ? trace->end_time + 1 : 0;
+    size_t nqueries = 0;
+    uint8_t arena_block[ARENA_SIZE];
+    arena_t arena;
+    init_arena(&arena, arena_block, sizeof(arena_block));
+
+    size_t offset = 0;
+    while (offset + sizeof(uint16_t) <= size) {
+        uint16_t len;
+        memcpy(&len, data + offset, sizeof(len));
+        len = ntohs(len);
+        offset += sizeof(len);
+        if (offset + len > size) {
+            fprintf(stderr, "%s: truncated message\n", path);
+            exit(EXIT_FAILURE);
+        }
+        dns_message_t msg;
+        if (!init_dns_message(&msg, data + offset, len) ||
+            msg.qdcount != 1) {
+            offset += len;
+            continue;  // nothing to replay, nor to cache
+        }
+        cache_key_t key = {.question = data + offset + HEADER_SIZE,
+                           .len = msg.questions_end - HEADER_SIZE};
+        if (msg.qr) {
+            // kept "forever", on a clock that never moves
+            cache_put(trace->replies, &key, UINT32_MAX, msg.data, len,
+                      &arena);
+        } else if (msg.opcode == QUERY_OPCODE) {
+            add_query(trace, start_time + (time_t)(nqueries++ / qps),
+                      key.question, key.len);
+        }
+        offset += len;
+    }
+    free(data);
+}
+
+// Replays the queries of `trace` against a cache of `max_bytes` bytes
+// evicting by `policy`, and returns what was counted. A query the cache has
+// no reply to is replied to with the reply found in the trace, or one made
+// up with the settings `config`, and it is cached (if it would be).
+sim_result_t simulate(trace_t *trace, sim_config_t *config, size_t max_bytes,
+                      cache_policy_t policy) {
+    sim_result_t result = {0};
+    // one shard, so that the policy orders every entry against every other
+    cache_t *cache = new_cache(max_bytes, 1, 0, 0, policy);
+    cache->clock = get_virtual_time;
+    uint8_t *reply = malloc(MAX_MESSAGE_SIZE);
+    uint8_t *arena_block = malloc(ARENA_SIZE);
+    assert(reply && arena_block);
+    arena_t arena;
+    init_arena(&arena, arena_block, ARENA_SIZE);
+
+    for (size_t i = 0; i < trace->nqueries; i++) {
+        trace_query_t *query = &trace->queries[i];
+        virtual_time = query->time;
+        cache_key_t key = {.question = trace->questions + query->offset,
+                           .len = query->len};
+        time_t expiry_time;
+        uint16_t len = cache_get(cache, &key, reply, MAX_MESSAGE_SIZE,
+                                 &expiry_time, NULL);
+        result.queries++;
+        if (len > 0) {
+            result.hits++;
+            result.hit_bytes += len;
+            result.bytes += len;
+            continue;
+        }
+
+        // forwarded upstream
+        len = get_reply(trace, &key, config->ttl, reply);
+        result.bytes += len;
+        dns_message_t msg;
+        uint32_t ttl;
+        uint16_t nscount;
+        if (!init_dns_message(&msg, reply, len)) {
+            continue;
+        }
+        uint16_t cached_len = get_cacheable(&msg, &ttl, &nscount);
+        if (cached_len > 0) {
+            set_record_counts(reply, msg.ancount, nscount, 0);
+            cache_entry_t *evicted =
+                cache_put(cache, &key, ttl, reply, cached_len, &arena);
+            // only entries pushed out before they expired count, not those
+            // reclaimed or replaced once expired
+            for (; evicted; evicted = evicted->next) {
+                result.evictions += evicted->expiry_time > virtual_time;
+            }
+            arena_reset(&arena);
+        }
+    }
+
+    free_cache(cache);
+    free(reply);
+    free(arena_block);
+    return result;
+}
+
+// Puts in `reply` the reply to the question with key `key` found in `trace`,
+// or if there is none, a reply made up for it with one AAAA record and TTL
+// `ttl`. Returns the length of the reply.
+uint16_t get_reply(trace_t *trace, cache_key_t *key, uint32_t ttl,
+                   uint8_t *reply) {
+    time_t expiry_time;
+    uint16_t len = cache_get(trace->replies, key, reply, MAX_MESSAGE_SIZE,
+                             &expiry_time, NULL);
+    if (len > 0) {
+        return len;
+    }
+    uint8_t query[MAX_QUERY_SIZE];
+    memset(query, 0, HEADER_SIZE);
+    query[5] = 1;  // QDCOUNT
+    memcpy(query + HEADER_SIZE, key->question, key->len);
+    dns_message_t msg;
+    bool valid = init_dns_message(&msg, query, HEADER_SIZE + key->len);
+    assert(valid);
+    uint8_t addr[16] = {0x20, 0x01, 0x0d, 0xb8};
+    len = make_reply(&msg, NO_ERROR_RCODE, reply);
+    len = add_record(reply, len, MAX_MESSAGE_SIZE, HEADER_SIZE, AAAA_RR_TYPE,
+                     ttl, addr, sizeof(addr));
+    set_record_counts(reply, 1, 0, 0);
+    return len;
+}
+
+// The clock of the caches simulated: returns the time on the virtual clock,
+// also put in `tloc` if not NULL, like time()
+time_t get_virtual_time(time_t *tloc) {
+    if (tloc) {
+        *tloc = virtual_time;
+    }
+    return virtual_time;
+}
+
+// The clock of the replies of a trace, which never moves: returns 0, also
+// put in `tloc` if not NULL, like time()
+time_t get_zero_time(time_t *tloc) {
+    if (tloc) {
+        *tloc = 0;
+    }
+    return 0;
+}
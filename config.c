@@ -0,0 +1,159 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Config module containing the settings of the DNS server, read from its
+ * command line arguments.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// default number of worker threads
+#define DEFAULT_NWORKERS 1
+// default number of connections to upstream, per worker
+#define DEFAULT_UPS_NCONNS 2
+// default memory budget of the cache, in bytes
+#define DEFAULT_CACHE_BYTES (64 * 1024 * 1024)
+// default percentage of their TTL left under which hot entries are refreshed
+#define DEFAULT_REFRESH_PERCENT 10
+// default number of seconds expired entries may be served stale for
+#define DEFAULT_MAX_STALE (24 * 60 * 60)
+
+void print_usage(char *prog);
+
+// Fills in `config` from the command line arguments `argv`: options first,
+// then the hostname and port of the upstream server. Exits if the arguments
+// are invalid.
+void parse_config(config_t *config, int argc, char *argv[]) {
+    config->nworkers = DEFAULT_NWORKERS;
+    config->pin_cpus = false;
+    config->ups_nconns = DEFAULT_UPS_NCONNS;
+    config->ups_over_udp = false;
+    config->cache_bytes = DEFAULT_CACHE_BYTES;
+    config->refresh_percent = DEFAULT_REFRESH_PERCENT;
+    config->max_stale = DEFAULT_MAX_STALE;
+    config->stats_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:pc:um:r:s:S:")) != -1) {
+        switch (opt) {
+        case 'w':
+            config->nworkers = atoi(optarg);
+            if (config->nworkers <= 0) {
+                // one worker per online CPU
+                config->nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        case 'p':
+            config->pin_cpus = true;
+            break;
+        case 'c':
+            config->ups_nconns = atoi(optarg);
+            if (config->ups_nconns <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            config->ups_over_udp = true;
+            break;
+        case 'm':
+            config->cache_bytes = parse_size(optarg);
+            if (config->cache_bytes == 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            config->refresh_percent = atoi(optarg);
+            if (config->refresh_percent < 0 || config->refresh_percent > 99) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            config->max_stale = atoi(optarg);
+            if (config->max_stale < 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            config->stats_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 2) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    config->ups_name = argv[optind];
+    config->ups_port = argv[optind + 1];
+}
+
+// Print the usage of the program `prog` to stderr
+void print_usage(char *prog) {
+    fprintf(stderr, "usage %s [-w workers] [-p] [-c conns] [-u] [-m size] "
+                    "[-r percent] [-s secs] [-S path]\n"
+                    "       hostname port\n", prog);
+    fprintf(stderr, "  -w workers  number of worker threads (0 for one per "
+                    "CPU, default %d)\n", DEFAULT_NWORKERS);
+    fprintf(stderr, "  -p          pin each worker thread to its own CPU\n");
+    fprintf(stderr, "  -c conns    number of connections to upstream per "
+                    "worker (default %d)\n", DEFAULT_UPS_NCONNS);
+    fprintf(stderr, "  -u          forward over UDP, then over TCP if the "
+                    "reply is truncated\n");
+    fprintf(stderr, "  -m size     memory budget of the cache, in bytes, or "
+                    "with a K, M or G suffix\n"
+                    "              (default %dM)\n",
+            DEFAULT_CACHE_BYTES / (1024 * 1024));
+    fprintf(stderr, "  -r percent  refresh hot entries in the last percent of "
+                    "their TTL, 0 to never\n"
+                    "              (default %d)\n",
+            DEFAULT_REFRESH_PERCENT);
+    fprintf(stderr, "  -s secs     serve expired entries for up to secs "
+                    "seconds when upstream is\n"
+                    "              slow or down, 0 to never (default %d)\n",
+            DEFAULT_MAX_STALE);
+    fprintf(stderr, "  -S path     export metrics, in the Prometheus text "
+                    "format, to each client\n"
+                    "              of a UNIX socket at path\n");
+}
+
+// Returns the number of bytes `str` stands for, like 512, 64K, 256M or 2G,
+// or 0 if it is invalid
+size_t parse_size(char *str) {
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str) {
+        return 0;
+    }
+    switch (*end) {
+    case 'G':
+    case 'g':
+        size *= 1024;
+        // fall through
+    case 'M':
+    case 'm':
+        size *= 1024;
+        // fall through
+    case 'K':
+    case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    if (*end != '\0') {
+        return 0;
+    }
+    return size;
+}
@@ -0,0 +1,32 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Config module containing the settings of the DNS server, read from its
+ * command line arguments.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// The settings of the DNS server
+typedef struct {
+    char *ups_name;  // hostname of the upstream server
+    char *ups_port;  // port of the upstream server
+    int nworkers;    // number of worker threads, each with its own listener
+    bool pin_cpus;   // whether to pin each worker to its own CPU
+    int ups_nconns;  // number of connections to upstream, per worker
+    bool ups_over_udp;  // whether to forward over UDP first, TCP if truncated
+    size_t cache_bytes;  // memory budget of the cache
+    int refresh_percent;  // of their TTL left under which hot entries refresh
+    int max_stale;  // seconds expired entries are kept to be served stale
+    char *stats_path;  // UNIX socket to export metrics on, or NULL if none
+} config_t;
+
+void parse_config(config_t *config, int argc, char *argv[]);
+size_t parse_size(char *str);
+
+#endif
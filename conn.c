@@ -0,0 +1,361 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Connection module containing functions for reading and writing DNS
+ * messages over non-blocking TCP sockets. Reading and writing are
+ * independent, so many messages may be in flight on one connection
+ * (pipelining, RFC 7766), each advanced whenever epoll reports its socket
+ * as ready.
+ */
+
+#include "conn.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// initial size of the buffer messages are read into: enough for most
+// messages, it grows for larger ones
+#define CONN_BUF_SIZE 4096
+// the number of bytes queued up to be written past which a connection is
+// backlogged, see conn_is_backlogged()
+#define CONN_MAX_BACKLOG (4 * CONN_BUF_SIZE)
+// the number of bytes in the size header of a message over TCP
+#define SIZE_HEADER_LEN 2
+
+void conn_update_events(conn_t *conn);
+void conn_release(conn_t *conn);
+
+// Initialises a loop `loop` over the epoll instance `epfd`, with no
+// connections closed
+void init_conn_loop(conn_loop_t *loop, int epfd) {
+    loop->epfd = epfd;
+    loop->closed = NULL;
+    loop->ready_head = NULL;
+    loop->ready_tail = NULL;
+}
+
+// Frees all connections closed so far in `loop`, once nothing refers to them
+void conn_loop_free_closed(conn_loop_t *loop) {
+    while (loop->closed) {
+        conn_t *next = loop->closed->next_closed;
+        free_conn(loop->closed);
+        loop->closed = next;
+    }
+}
+
+// Takes the connection marked ready first out of the list of `loop`, and
+// returns it, or NULL if there is none. It is still referenced: the caller is
+// to call conn_unref() once done with it.
+conn_t *conn_loop_next_ready(conn_loop_t *loop) {
+    conn_t *conn = loop->ready_head;
+    if (conn) {
+        loop->ready_head = conn->next_ready;
+        if (!loop->ready_head) {
+            loop->ready_tail = NULL;
+        }
+        conn->next_ready = NULL;
+        conn->ready = false;
+    }
+    return conn;
+}
+
+// Creates and returns a new connection over the non-blocking socket `fd`,
+// starting in state `state`, and registers it with the epoll instance of
+// `loop`. Exits if error.
+conn_t *new_conn(int fd, conn_loop_t *loop, fd_kind_t kind,
+                 conn_state_t state) {
+    conn_t *conn = malloc(sizeof(*conn));
+    uint8_t *rbuf = malloc(CONN_BUF_SIZE);
+    assert(conn && rbuf);
+
+    conn->kind = kind;
+    conn->fd = fd;
+    conn->loop = loop;
+    conn->state = state;
+    conn->events = 0;
+    conn->paused = false;
+    conn->eof = false;
+
+    conn->rbuf = rbuf;
+    conn->rcap = CONN_BUF_SIZE;
+    conn->rstart = 0;
+    conn->rlen = 0;
+    conn->read_time = 0;
+
+    conn->wbuf = NULL;
+    conn->wcap = 0;
+    conn->wlen = 0;
+    conn->nwritten = 0;
+
+    conn->refs = 0;
+    conn->data = NULL;
+    conn->next_closed = NULL;
+    conn->ready = false;
+    conn->next_ready = NULL;
+
+    struct epoll_event event = {.events = 0, .data.ptr = conn};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    conn_update_events(conn);
+    return conn;
+}
+
+// Frees a connection and its buffers. It must be closed beforehand.
+void free_conn(conn_t *conn) {
+    free(conn->rbuf);
+    free(conn->wbuf);
+    free(conn);
+}
+
+// Closes the socket of `conn` (which also removes it from epoll). The
+// connection is marked closed so that any pending events for it are ignored,
+// and freed by its loop once nothing refers to it.
+void conn_close(conn_t *conn) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    close(conn->fd);
+    conn->state = CONN_CLOSED;
+    conn->events = 0;
+    if (conn->refs == 0) {
+        conn_release(conn);
+    }
+}
+
+// Adds a reference to `conn`, so that it is not freed even once closed
+void conn_ref(conn_t *conn) {
+    conn->refs++;
+}
+
+// Removes a reference to `conn`, added by conn_ref(). If it is closed and
+// this was the last reference, it is freed once the current events are done.
+void conn_unref(conn_t *conn) {
+    assert(conn->refs > 0);
+    conn->refs--;
+    if (conn->refs == 0 && conn->state == CONN_CLOSED) {
+        conn_release(conn);
+    }
+}
+
+// Marks `conn` as ready, unless it is already: it has work for its owner to
+// do that no event will report, and is put at the end of its loop's list, to
+// be taken with conn_loop_next_ready(). It is referenced until then.
+void conn_mark_ready(conn_t *conn) {
+    if (conn->ready) {
+        return;
+    }
+    conn->ready = true;
+    conn_ref(conn);
+    if (conn->loop->ready_tail) {
+        conn->loop->ready_tail->next_ready = conn;
+    } else {
+        conn->loop->ready_head = conn;
+    }
+    conn->loop->ready_tail = conn;
+}
+
+// Puts the closed connection `conn` on its loop's list of connections to free
+void conn_release(conn_t *conn) {
+    conn->next_closed = conn->loop->closed;
+    conn->loop->closed = conn;
+}
+
+// Pauses reading from `conn` if `paused` (messages already read can still be
+// taken), otherwise resumes it.
+void conn_pause(conn_t *conn, bool paused) {
+    conn->paused = paused;
+    conn_update_events(conn);
+}
+
+// Returns true if `conn` is open and has nothing left to write
+bool conn_is_idle(conn_t *conn) {
+    return conn->state == CONN_OPEN && conn->nwritten == conn->wlen;
+}
+
+// Returns true if `conn` has more bytes queued up to be written than it
+// should keep: the peer is slow to read them, so its owner is to stop
+// queueing up more (such as by no longer reading requests from it) until
+// conn_write() drains them.
+bool conn_is_backlogged(conn_t *conn) {
+    return conn->wlen - conn->nwritten > CONN_MAX_BACKLOG;
+}
+
+// Updates the events `conn` is registered for with epoll, if needed: it
+// waits to be writable while connecting or while it has something to write,
+// and to be readable unless paused. Errors and hang ups are always
+// reported. Exits if error.
+void conn_update_events(conn_t *conn) {
+    uint32_t events = 0;
+    if (conn->state == CONN_CONNECTING) {
+        events = EPOLLOUT;
+    } else if (conn->state == CONN_OPEN) {
+        if (!conn->paused && !conn->eof) {
+            events |= EPOLLIN;
+        }
+        if (conn->nwritten < conn->wlen) {
+            events |= EPOLLOUT;
+        }
+    } else {
+        return;
+    }
+    if (events == conn->events) {
+        return;
+    }
+    conn->events = events;
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Checks whether a connection in progress to upstream succeeded, opening it
+// if so.
+conn_io_t conn_finish_connect(conn_t *conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+        error != 0) {
+        return CONN_IO_ERROR;
+    }
+    conn->state = CONN_OPEN;
+    conn_update_events(conn);
+    return CONN_IO_DONE;
+}
+
+// Reads as many bytes as are available from `conn` (and fit in its buffer,
+// which grows to fit the message at its start) with one system call. Take
+// the messages read with conn_next_message(): any taken before are no longer
+// valid after this.
+conn_io_t conn_read(conn_t *conn) {
+    // move what is left to the start of the buffer, to make room
+    if (conn->rstart > 0) {
+        memmove(conn->rbuf, conn->rbuf + conn->rstart, conn->rlen);
+        conn->rstart = 0;
+    }
+    if (conn->rlen >= SIZE_HEADER_LEN) {
+        uint16_t size_header;
+        memcpy(&size_header, conn->rbuf, sizeof(size_header));
+        size_t msg_len = SIZE_HEADER_LEN + ntohs(size_header);
+        if (msg_len > conn->rcap) {
+            conn->rbuf = realloc(conn->rbuf, msg_len);
+            assert(conn->rbuf);
+            conn->rcap = msg_len;
+        }
+    }
+    if (conn->rlen == conn->rcap) {
+        // full of whole messages, which must be taken first
+        return CONN_IO_DONE;
+    }
+
+    ssize_t nread;
+    do {
+        nread = read(conn->fd, conn->rbuf + conn->rlen,
+                     conn->rcap - conn->rlen);
+    } while (nread < 0 && errno == EINTR);
+    if (nread < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return CONN_IO_AGAIN;
+        }
+        return CONN_IO_ERROR;
+    }
+    if (nread == 0) {
+        conn->eof = true;
+        conn_update_events(conn);
+        return CONN_IO_EOF;
+    }
+    conn->rlen += nread;
+    conn->read_time = get_time_us();
+    return CONN_IO_DONE;
+}
+
+// Takes the next whole message read from `conn`, if any: points `data` to
+// it (without its size header) and sets `len` to its length, then returns
+// true. Otherwise returns false. The message is valid until the next
+// conn_read().
+bool conn_next_message(conn_t *conn, uint8_t **data, uint16_t *len) {
+    while (conn->rlen >= SIZE_HEADER_LEN) {
+        uint16_t size_header;
+        memcpy(&size_header, conn->rbuf + conn->rstart, sizeof(size_header));
+        uint16_t msg_len = ntohs(size_header);
+        if (conn->rlen < (size_t)SIZE_HEADER_LEN + msg_len) {
+            return false;
+        }
+        *data = conn->rbuf + conn->rstart + SIZE_HEADER_LEN;
+        *len = msg_len;
+        conn->rstart += SIZE_HEADER_LEN + msg_len;
+        conn->rlen -= SIZE_HEADER_LEN + msg_len;
+        if (msg_len > 0) {
+            return true;
+        }
+        // skip empty messages
+    }
+    return false;
+}
+
+// Writes as much of what is queued up as the socket of `conn` accepts.
+conn_io_t conn_write(conn_t *conn) {
+    if (conn->state != CONN_OPEN) {
+        return conn->state == CONN_CLOSED ? CONN_IO_ERROR : CONN_IO_AGAIN;
+    }
+    while (conn->nwritten < conn->wlen) {
+        ssize_t nwritten = write(conn->fd, conn->wbuf + conn->nwritten,
+                                 conn->wlen - conn->nwritten);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_update_events(conn);
+                return CONN_IO_AGAIN;
+            }
+            return CONN_IO_ERROR;
+        }
+        conn->nwritten += nwritten;
+    }
+    conn->wlen = 0;
+    conn->nwritten = 0;
+    conn_update_events(conn);
+    return CONN_IO_DONE;
+}
+
+// Queues up `len` bytes of a DNS message `data` (this function will copy
+// it, adding the two-byte size header for TCP) to be written to `conn`,
+// after anything already queued. Nothing is written yet (see conn_write()),
+// but `conn` now waits to be writable.
+void conn_send(conn_t *conn, uint8_t *data, uint16_t len) {
+    // drop what was written already, to make room
+    if (conn->nwritten > 0) {
+        memmove(conn->wbuf, conn->wbuf + conn->nwritten,
+                conn->wlen - conn->nwritten);
+        conn->wlen -= conn->nwritten;
+        conn->nwritten = 0;
+    }
+    size_t needed = conn->wlen + SIZE_HEADER_LEN + len;
+    if (needed > conn->wcap) {
+        conn->wcap = conn->wcap ? conn->wcap : CONN_BUF_SIZE;
+        while (conn->wcap < needed) {
+            conn->wcap *= 2;
+        }
+        conn->wbuf = realloc(conn->wbuf, conn->wcap);
+        assert(conn->wbuf);
+    }
+
+    uint16_t size_header = htons(len);
+    memcpy(conn->wbuf + conn->wlen, &size_header, sizeof(size_header));
+    memcpy(conn->wbuf + conn->wlen + SIZE_HEADER_LEN, data, len);
+    conn->wlen = needed;
+    conn_update_events(conn);
+}
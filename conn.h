@@ -0,0 +1,117 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Connection module containing functions for reading and writing DNS
+ * messages over non-blocking TCP sockets. Reading and writing are
+ * independent, so many messages may be in flight on one connection
+ * (pipelining, RFC 7766), each advanced whenever epoll reports its socket
+ * as ready.
+ */
+
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+// The states a connection moves through
+typedef enum {
+    CONN_CONNECTING,  // waiting for a connection to upstream to complete
+    CONN_OPEN,        // reading and writing messages
+    CONN_CLOSED       // closed, to be freed once nothing refers to it
+} conn_state_t;
+
+// The result of advancing a connection by reading or writing
+typedef enum {
+    CONN_IO_DONE,   // bytes were read, or everything queued was written
+    CONN_IO_AGAIN,  // the socket would block, wait for the next event
+    CONN_IO_EOF,    // the peer will not send anything more
+    CONN_IO_ERROR   // the connection failed
+} conn_io_t;
+
+typedef struct conn conn_t;
+
+// The epoll instance connections are registered with, along with the
+// connections closed while handling its current events: these are only
+// freed once the events are done, since later ones may refer to them. Also
+// kept are the connections marked ready: those with work for their owner to
+// do that no event will report, in the order they were marked.
+typedef struct {
+    int epfd;
+    conn_t *closed;
+    conn_t *ready_head;
+    conn_t *ready_tail;
+} conn_loop_t;
+
+// A non-blocking TCP connection, either from a client or to upstream. The
+// `kind` is first so that the connection can be registered with epoll
+// directly.
+struct conn {
+    fd_kind_t kind;
+    int fd;
+    conn_loop_t *loop;
+    conn_state_t state;
+    uint32_t events;  // the events currently registered with epoll
+    bool paused;      // whether reading is paused by the owner
+    bool eof;         // whether the peer will not send anything more
+
+    // bytes read but not yet taken as messages (which are prefixed with a
+    // two-byte size header over TCP), starting at `rstart`, and when bytes
+    // were last read, in µs: every whole message was received by then
+    uint8_t *rbuf;
+    size_t rcap;
+    size_t rstart;
+    size_t rlen;
+    uint64_t read_time;
+
+    // bytes queued up to be written, of which `nwritten` already were
+    uint8_t *wbuf;
+    size_t wcap;
+    size_t wlen;
+    size_t nwritten;
+
+    // the number of things (such as requests) that refer to the connection,
+    // which is not freed until there are none
+    int refs;
+
+    // anything its owner wants to keep with it
+    void *data;
+
+    // link in the loop's list of connections closed but not yet freed
+    conn_t *next_closed;
+
+    // whether it is in the loop's list of connections marked ready, and its
+    // link in it
+    bool ready;
+    conn_t *next_ready;
+};
+
+void init_conn_loop(conn_loop_t *loop, int epfd);
+void conn_loop_free_closed(conn_loop_t *loop);
+conn_t *conn_loop_next_ready(conn_loop_t *loop);
+
+conn_t *new_conn(int fd, conn_loop_t *loop, fd_kind_t kind,
+                 conn_state_t state);
+void free_conn(conn_t *conn);
+
+void conn_close(conn_t *conn);
+void conn_ref(conn_t *conn);
+void conn_unref(conn_t *conn);
+void conn_mark_ready(conn_t *conn);
+
+void conn_pause(conn_t *conn, bool paused);
+bool conn_is_idle(conn_t *conn);
+bool conn_is_backlogged(conn_t *conn);
+
+conn_io_t conn_finish_connect(conn_t *conn);
+conn_io_t conn_read(conn_t *conn);
+bool conn_next_message(conn_t *conn, uint8_t **data, uint16_t *len);
+conn_io_t conn_write(conn_t *conn);
+
+void conn_send(conn_t *conn, uint8_t *data, uint16_t len);
+
+#endif
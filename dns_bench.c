@@ -0,0 +1,692 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Benchmark program: a load generator that replays a corpus of DNS queries
+ * against a DNS server, over TCP or UDP, from many connections at once in a
+ * non-blocking event loop. The corpus is read from .raw files, each holding
+ * messages prefixed with their two-byte size (as the server's test packets
+ * are); replies in them are skipped. It reports the rate replies came back
+ * at, percentiles of their latency and how many queries failed.
+ *
+ * Queries are sent either as fast as the server replies, keeping a fixed
+ * number in flight on each connection, or at a fixed rate whatever the
+ * server does. At a fixed rate, latencies are measured from when each query
+ * was due to be sent, so that a server falling behind cannot hide it.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "dns_message.h"
+#include "metrics.h"
+#include "net.h"
+#include "util.h"
+
+// default number of connections (or UDP sockets) to the server
+#define DEFAULT_NCONNS 1
+// default number of queries in flight per connection, as fast as possible
+#define DEFAULT_DEPTH 1
+// default number of seconds to send queries for
+#define DEFAULT_SECS 10
+// how long to wait for a reply before counting the query as timed out
+#define BENCH_TIMEOUT_MS 2000
+// maximum number of events handled per call to epoll_wait()
+#define MAX_EVENTS 256
+// the number of possible DNS message IDs
+#define NUM_IDS (UINT16_MAX + 1)
+
+// The settings of the benchmark
+typedef struct {
+    char *name;      // hostname of the server
+    char *port;      // port of the server
+    bool over_udp;   // whether to send over UDP rather than TCP
+    int nconns;      // number of connections (or UDP sockets)
+    int depth;       // queries in flight per connection, if no fixed rate
+    double qps;      // fixed rate to send queries at, or 0 if none
+    int secs;        // how long to send queries for
+} bench_config_t;
+
+// The queries to replay, in turn, parsed where they lie: in the contents of
+// the files they were read from
+typedef struct {
+    dns_message_t *msgs;
+    int count;
+    int next;
+    uint8_t **files;
+    int nfiles;
+} corpus_t;
+
+typedef struct bench_conn bench_conn_t;
+typedef struct bench_query bench_query_t;
+
+// A connection to the server: a TCP connection, or a UDP socket. The `kind`
+// is first so that a UDP socket can be registered with epoll directly (a
+// TCP connection is registered as its conn_t).
+struct bench_conn {
+    fd_kind_t kind;
+    int fd;          // UDP only
+    conn_t *conn;    // TCP only, NULL if it could not be reopened
+    bool opened;     // TCP: whether it ever connected
+    int ninflight;
+};
+
+// A query in flight, found by the ID it was sent with. Those in flight are
+// kept in the order they were sent, which, as every query waits as long, is
+// the order to time them out in.
+struct bench_query {
+    bool inflight;
+    dns_message_t *msg;   // the query in the corpus it is a copy of
+    bench_conn_t *conn;
+    uint64_t start_time;  // when sent, or due to be sent, in µs
+    uint64_t deadline;    // when to time out, in ms
+    bench_query_t *prev;
+    bench_query_t *next;
+};
+
+// What happened to the queries sent
+typedef struct {
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t rcodes[16];  // of the replies
+    uint64_t truncated;   // replies with the TC bit set
+    uint64_t timeouts;
+    uint64_t unmatched;   // replies to no query in flight
+    uint64_t dropped;     // queries lost with their connection, or unsent
+    uint64_t conn_errors;
+} bench_counts_t;
+
+// A benchmark run: its connections, the queries in flight on them, and what
+// was measured
+typedef struct {
+    bench_config_t config;
+    net_addr_t addr;
+    conn_loop_t loop;
+    corpus_t corpus;
+
+    bench_conn_t *conns;
+    int next_conn;  // the next to send on, at a fixed rate
+
+    bench_query_t *queries;  // by ID
+    uint16_t next_id;
+    int ninflight;
+    bench_query_t *sent_head;
+    bench_query_t *sent_tail;
+    uint8_t *send_buf;
+    uint8_t *recv_buf;  // UDP only
+
+    uint64_t start_time;  // in µs
+    uint64_t end_time;    // when to stop sending, in µs
+    uint64_t nscheduled;  // queries due so far, at a fixed rate
+    bool running;
+
+    histogram_t latencies;
+    bench_counts_t counts;
+} bench_t;
+
+void parse_bench_config(bench_config_t *config, int argc, char *argv[]);
+void print_usage(char *prog);
+void load_corpus(corpus_t *corpus, char **paths, int npaths);
+void free_corpus(corpus_t *corpus);
+void open_conn(bench_t *bench, bench_conn_t *bc);
+void drop_conn(bench_t *bench, bench_conn_t *bc);
+void fill_conn(bench_t *bench, bench_conn_t *bc);
+void flush_conns(bench_t *bench);
+
+void run_bench(bench_t *bench);
+int next_timeout(bench_t *bench, uint64_t now);
+void send_due(bench_t *bench, uint64_t now);
+bool send_query(bench_t *bench, bench_conn_t *bc, uint64_t start_time);
+int new_query_id(bench_t *bench);
+void handle_event(bench_t *bench, void *ptr);
+void handle_reply(bench_t *bench, bench_conn_t *bc, uint8_t *reply,
+                  uint16_t len);
+void expire_queries(bench_t *bench, uint64_t now);
+void finish_query(bench_t *bench, bench_query_t *query);
+
+void print_report(bench_t *bench, double secs);
+
+// Replays the queries in the .raw files given against the server at the
+// hostname and port given, and prints what was measured. See print_usage()
+// for the options.
+int main(int argc, char *argv[]) {
+    bench_t bench;
+    parse_bench_config(&bench.config, argc, argv);
+    load_corpus(&bench.corpus, argv + optind + 2, argc - optind - 2);
+    resolve_address(&bench.addr, bench.config.name, bench.config.port);
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    init_conn_loop(&bench.loop, epfd);
+    bench.queries = calloc(NUM_IDS, sizeof(*bench.queries));
+    bench.send_buf = malloc(MAX_MESSAGE_SIZE);
+    bench.recv_buf = malloc(MAX_MESSAGE_SIZE);
+    bench.conns = calloc(bench.config.nconns, sizeof(*bench.conns));
+    assert(bench.queries && bench.send_buf && bench.recv_buf && bench.conns);
+    bench.next_conn = 0;
+    bench.next_id = random_seed();
+    bench.ninflight = 0;
+    bench.sent_head = NULL;
+    bench.sent_tail = NULL;
+    bench.nscheduled = 0;
+    init_histogram(&bench.latencies);
+    memset(&bench.counts, 0, sizeof(bench.counts));
+
+    // a server hanging up must not kill the benchmark when writing to it
+    signal(SIGPIPE, SIG_IGN);
+
+    bench.start_time = get_time_us();
+    bench.end_time = bench.start_time + bench.config.secs * 1000000ULL;
+    bench.running = true;
+    for (int i = 0; i < bench.config.nconns; i++) {
+        open_conn(&bench, &bench.conns[i]);
+        fill_conn(&bench, &bench.conns[i]);
+    }
+    run_bench(&bench);
+    print_report(&bench, bench.config.secs);
+
+    for (int i = 0; i < bench.config.nconns; i++) {
+        if (bench.conns[i].conn) {
+            conn_close(bench.conns[i].conn);
+        }
+        if (bench.config.over_udp) {
+            close(bench.conns[i].fd);
+        }
+    }
+    conn_loop_free_closed(&bench.loop);
+    close(epfd);
+    free(bench.conns);
+    free(bench.recv_buf);
+    free(bench.send_buf);
+    free(bench.queries);
+    free_corpus(&bench.corpus);
+    return 0;
+}
+
+// Fills in `config` from the command line arguments `argv`: options first,
+// then the hostname and port of the server, then at least one .raw file.
+// Exits if the arguments are invalid.
+void parse_bench_config(bench_config_t *config, int argc, char *argv[]) {
+    config->over_udp = false;
+    config->nconns = DEFAULT_NCONNS;
+    config->depth = DEFAULT_DEPTH;
+    config->qps = 0;
+    config->secs = DEFAULT_SECS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "uc:i:q:d:")) != -1) {
+        switch (opt) {
+        case 'u':
+            config->over_udp = true;
+            break;
+        case 'c':
+            config->nconns = atoi(optarg);
+            break;
+        case 'i':
+            config->depth = atoi(optarg);
+            break;
+        case 'q':
+            config->qps = atof(optarg);
+            break;
+        case 'd':
+            config->secs = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind < 3 || config->nconns <= 0 || config->depth <= 0 ||
+        config->qps < 0 || config->secs <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    config->name = argv[optind];
+    config->port = argv[optind + 1];
+}
+
+// Print the usage of the program `prog` to stderr
+void print_usage(char *prog) {
+    fprintf(stderr, "usage %s [-u] [-c conns] [-i depth] [-q qps] [-d secs] "
+                    "hostname port\n"
+                    "       file.raw...\n", prog);
+    fprintf(stderr, "  -u        send over UDP rather than TCP\n");
+    fprintf(stderr, "  -c conns  number of connections (or UDP sockets) "
+                    "(default %d)\n", DEFAULT_NCONNS);
+    fprintf(stderr, "  -i depth  queries in flight per connection, without "
+                    "-q (default %d)\n", DEFAULT_DEPTH);
+    fprintf(stderr, "  -q qps    send at a fixed rate, whatever the server "
+                    "replies, rather than\n"
+                    "            as fast as it replies\n");
+    fprintf(stderr, "  -d secs   how long to send queries for "
+                    "(default %d)\n", DEFAULT_SECS);
+}
+
+// Loads every query in the `npaths` .raw files at `paths` into `corpus`.
+// Exits if a file cannot be read, is malformed, or if there are no queries.
+void load_corpus(corpus_t *corpus, char **paths, int npaths) {
+    int capacity = 16;
+    corpus->msgs = malloc(capacity * sizeof(*corpus->msgs));
+    corpus->files = malloc(npaths * sizeof(*corpus->files));
+    assert(corpus->msgs && corpus->files);
+    corpus->count = 0;
+    corpus->next = 0;
+    corpus->nfiles = npaths;
+
+    for (int i = 0; i < npaths; i++) {
+        size_t size;
+        uint8_t *data = read_file(paths[i], &size);
+        corpus->files[i] = data;
+        size_t offset = 0;
+        while (offset + sizeof(uint16_t) <= size) {
+            uint16_t len;
+            memcpy(&len, data + offset, sizeof(len));
+            len = ntohs(len);
+            offset += sizeof(len);
+            if (offset + len > size) {
+                fprintf(stderr, "%s: truncated message\n", paths[i]);
+                exit(EXIT_FAILURE);
+            }
+            dns_message_t msg;
+            if (!init_dns_message(&msg, data + offset, len)) {
+                fprintf(stderr, "%s: malformed message\n", paths[i]);
+                exit(EXIT_FAILURE);
+            }
+            offset += len;
+            if (msg.qr) {
+                continue;  // a reply, not to replay
+            }
+            if (corpus->count == capacity) {
+                capacity *= 2;
+                corpus->msgs =
+                    realloc(corpus->msgs, capacity * sizeof(*corpus->msgs));
+                assert(corpus->msgs);
+            }
+            corpus->msgs[corpus->count++] = msg;
+        }
+    }
+    if (corpus->count == 0) {
+        fprintf(stderr, "no queries to replay\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Frees the queries of `corpus`, and the contents of the files they are in
+void free_corpus(corpus_t *corpus) {
+    for (int i = 0; i < corpus->nfiles; i++) {
+        free(corpus->files[i]);
+    }
+    free(corpus->files);
+    free(corpus->msgs);
+}
+
+// Opens the connection (or UDP socket) `bc` to the server. Exits if a UDP
+// socket cannot be opened; a TCP connection that cannot be is left NULL.
+void open_conn(bench_t *bench, bench_conn_t *bc) {
+    bc->ninflight = 0;
+    if (bench->config.over_udp) {
+        bc->kind = FD_UPSTREAM_UDP;
+        bc->fd = connect_udp(&bench->addr);
+        if (bc->fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = bc};
+        if (epoll_ctl(bench->loop.epfd, EPOLL_CTL_ADD, bc->fd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    bc->kind = FD_UPSTREAM;
+    bc->fd = -1;
+    bc->conn = NULL;
+    bc->opened = false;
+    int sockfd = connect_nonblocking(&bench->addr);
+    if (sockfd < 0) {
+        bench->counts.conn_errors++;
+        return;
+    }
+    bc->conn = new_conn(sockfd, &bench->loop, FD_UPSTREAM, CONN_CONNECTING);
+    bc->conn->data = bc;
+}
+
+// Closes the TCP connection `bc`, which failed, dropping the queries in
+// flight on it. It is reopened if it was open before, so one failing to
+// connect at all is not retried over and over.
+void drop_conn(bench_t *bench, bench_conn_t *bc) {
+    bench->counts.conn_errors++;
+    for (bench_query_t *query = bench->sent_head; query;) {
+        bench_query_t *next = query->next;
+        if (query->conn == bc) {
+            bench->counts.dropped++;
+            finish_query(bench, query);
+        }
+        query = next;
+    }
+    bool opened = bc->opened;
+    conn_close(bc->conn);
+    bc->conn = NULL;
+    if (opened && bench->running) {
+        open_conn(bench, bc);
+        fill_conn(bench, bc);
+    }
+}
+
+// Sends queries on `bc` until it has as many in flight as it may, if they are
+// sent as fast as the server replies, and it is open
+void fill_conn(bench_t *bench, bench_conn_t *bc) {
+    if (bench->config.qps > 0 || (!bench->config.over_udp && !bc->conn)) {
+        return;
+    }
+    while (bench->running && bc->ninflight < bench->config.depth &&
+           send_query(bench, bc, get_time_us())) {
+    }
+}
+
+// Writes the queries queued up on every TCP connection, as much as possible
+// right away
+void flush_conns(bench_t *bench) {
+    for (int i = 0; i < bench->config.nconns; i++) {
+        bench_conn_t *bc = &bench->conns[i];
+        if (bc->conn && bc->conn->state == CONN_OPEN &&
+            !conn_is_idle(bc->conn) && conn_write(bc->conn) == CONN_IO_ERROR) {
+            drop_conn(bench, bc);
+        }
+    }
+}
+
+// Runs the event loop of `bench`: sends queries until its time is up, then
+// waits for the replies to those in flight, or for them to time out
+void run_bench(bench_t *bench) {
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        uint64_t now = get_time_us();
+        if (bench->running && now >= bench->end_time) {
+            bench->running = false;
+        }
+        if (bench->running) {
+            send_due(bench, now);
+        }
+        expire_queries(bench, now / 1000);
+        if (!bench->running && bench->ninflight == 0) {
+            break;
+        }
+        flush_conns(bench);
+
+        int nevents = epoll_wait(bench->loop.epfd, events, MAX_EVENTS,
+                                 next_timeout(bench, now));
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < nevents; i++) {
+            handle_event(bench, events[i].data.ptr);
+        }
+        conn_loop_free_closed(&bench->loop);
+    }
+}
+
+// Returns how long `bench` may wait for events from the time `now`, in µs,
+// before it has a query to send, to time out, or its time is up, in ms
+// (rounded down: under 1 ms, it polls without waiting, so that queries at a
+// fixed rate are sent on time)
+int next_timeout(bench_t *bench, uint64_t now) {
+    if (bench->running && bench->config.qps > 0) {
+        uint64_t due_time = bench->start_time +
+                            bench->nscheduled * 1e6 / bench->config.qps;
+        return due_time > now ? (due_time - now) / 1000 : 0;
+    }
+    now /= 1000;
+    uint64_t until = bench->running ? bench->end_time / 1000 : UINT64_MAX;
+    if (bench->sent_head && bench->sent_head->deadline < until) {
+        until = bench->sent_head->deadline;
+    }
+    if (until == UINT64_MAX) {
+        return -1;
+    }
+    return until > now ? until - now : 0;
+}
+
+// Sends every query due by the time `now`, in µs, at a fixed rate, each on
+// the next connection in turn
+void send_due(bench_t *bench, uint64_t now) {
+    if (bench->config.qps <= 0) {
+        return;
+    }
+    // the first query is due right at the start
+    uint64_t ndue = (now - bench->start_time) * bench->config.qps / 1e6 + 1;
+    for (; bench->nscheduled < ndue; bench->nscheduled++) {
+        uint64_t due_time =
+            bench->start_time + bench->nscheduled * 1e6 / bench->config.qps;
+        bench_conn_t *bc = &bench->conns[bench->next_conn];
+        bench->next_conn = (bench->next_conn + 1) % bench->config.nconns;
+        if ((!bench->config.over_udp && !bc->conn) ||
+            !send_query(bench, bc, due_time)) {
+            bench->counts.dropped++;
+        }
+    }
+}
+
+// Sends the next query of the corpus on `bc` (over TCP, it is only queued up,
+// see flush_conns()), timed from `start_time`, in µs, with an ID of its own.
+// Returns false if it could not be sent.
+bool send_query(bench_t *bench, bench_conn_t *bc, uint64_t start_time) {
+    int id = new_query_id(bench);
+    if (id < 0) {
+        return false;
+    }
+    corpus_t *corpus = &bench->corpus;
+    dns_message_t *msg = &corpus->msgs[corpus->next];
+    corpus->next = (corpus->next + 1) % corpus->count;
+
+    memcpy(bench->send_buf, msg->data, msg->size);
+    uint16_t net_id = htons(id);
+    memcpy(bench->send_buf, &net_id, sizeof(net_id));
+    if (bench->config.over_udp) {
+        if (send(bc->fd, bench->send_buf, msg->size, 0) < 0) {
+            return false;
+        }
+    } else {
+        conn_send(bc->conn, bench->send_buf, msg->size);
+    }
+
+    bench_query_t *query = &bench->queries[id];
+    query->inflight = true;
+    query->msg = msg;
+    query->conn = bc;
+    query->start_time = start_time;
+    query->deadline = get_time_ms() + BENCH_TIMEOUT_MS;
+    query->next = NULL;
+    query->prev = bench->sent_tail;
+    if (bench->sent_tail) {
+        bench->sent_tail->next = query;
+    } else {
+        bench->sent_head = query;
+    }
+    bench->sent_tail = query;
+
+    bc->ninflight++;
+    bench->ninflight++;
+    bench->counts.sent++;
+    return true;
+}
+
+// Returns an ID no query in flight has, taken in turn, or -1 if every ID is
+// taken
+int new_query_id(bench_t *bench) {
+    if (bench->ninflight == NUM_IDS) {
+        return -1;
+    }
+    while (bench->queries[bench->next_id].inflight) {
+        bench->next_id++;
+    }
+    return bench->next_id++;
+}
+
+// Handles an event for the connection (or UDP socket) `ptr`: finishes
+// connecting, and reads and handles replies
+void handle_event(bench_t *bench, void *ptr) {
+    fd_kind_t *kind = ptr;
+    if (*kind == FD_UPSTREAM_UDP) {
+        bench_conn_t *bc = ptr;
+        ssize_t nread;
+        while ((nread = recv(bc->fd, bench->recv_buf, MAX_MESSAGE_SIZE, 0)) >=
+               0) {
+            handle_reply(bench, bc, bench->recv_buf, nread);
+        }
+        return;
+    }
+
+    conn_t *conn = ptr;
+    bench_conn_t *bc = conn->data;
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn->state == CONN_CONNECTING) {
+        if (conn_finish_connect(conn) == CONN_IO_ERROR) {
+            drop_conn(bench, bc);
+            return;
+        }
+        bc->opened = true;
+    }
+    if (conn_write(conn) == CONN_IO_ERROR) {
+        drop_conn(bench, bc);
+        return;
+    }
+    conn_io_t status;
+    do {
+        status = conn_read(conn);
+        uint8_t *reply;
+        uint16_t len;
+        while (conn_next_message(conn, &reply, &len)) {
+            handle_reply(bench, bc, reply, len);
+        }
+    } while (status == CONN_IO_DONE && bc->conn == conn);
+    if (bc->conn == conn &&
+        (status == CONN_IO_EOF || status == CONN_IO_ERROR)) {
+        drop_conn(bench, bc);
+    }
+}
+
+// Handles the reply `reply` of length `len` read from `bc`: if it answers a
+// query in flight on it (with the same ID and question), its latency and
+// RCODE are recorded, and another query takes its place.
+void handle_reply(bench_t *bench, bench_conn_t *bc, uint8_t *reply,
+                  uint16_t len) {
+    uint64_t now = get_time_us();
+    dns_message_t msg;
+    if (!init_dns_message(&msg, reply, len)) {
+        bench->counts.unmatched++;
+        return;
+    }
+    bench_query_t *query = &bench->queries[msg.id];
+    dns_message_t *sent = query->msg;
+    if (!query->inflight || query->conn != bc || !msg.qr ||
+        msg.questions_end != sent->questions_end ||
+        memcmp(reply + HEADER_SIZE, sent->data + HEADER_SIZE,
+               msg.questions_end - HEADER_SIZE) != 0) {
+        bench->counts.unmatched++;
+        return;
+    }
+    histogram_record(&bench->latencies,
+                     now > query->start_time ? now - query->start_time : 0);
+    bench->counts.replies++;
+    bench->counts.rcodes[msg.rcode]++;
+    if (msg.tc) {
+        bench->counts.truncated++;
+    }
+    finish_query(bench, query);
+    fill_conn(bench, bc);
+}
+
+// Times out each query in flight by the time `now`, in ms, letting another
+// take its place
+void expire_queries(bench_t *bench, uint64_t now) {
+    while (bench->sent_head && bench->sent_head->deadline <= now) {
+        bench_query_t *query = bench->sent_head;
+        bench_conn_t *bc = query->conn;
+        bench->counts.timeouts++;
+        finish_query(bench, query);
+        fill_conn(bench, bc);
+    }
+}
+
+// Done with `query`, no longer in flight
+void finish_query(bench_t *bench, bench_query_t *query) {
+    if (query->prev) {
+        query->prev->next = query->next;
+    } else {
+        bench->sent_head = query->next;
+    }
+    if (query->next) {
+        query->next->prev = query->prev;
+    } else {
+        bench->sent_tail = query->prev;
+    }
+    query->prev = query->next = NULL;
+    query->inflight = false;
+    query->conn->ninflight--;
+    bench->ninflight--;
+}
+
+// Prints what `bench` measured over the `secs` seconds it sent queries for
+void print_report(bench_t *bench, double secs) {
+    bench_counts_t *counts = &bench->counts;
+    bench_config_t *config = &bench->config;
+    printf("%d %s connection%s, ", config->nconns,
+           config->over_udp ? "UDP" : "TCP", config->nconns == 1 ? "" : "s");
+    if (config->qps > 0) {
+        printf("%.0f queries/s offered", config->qps);
+    } else {
+        printf("%d in flight each", config->depth);
+    }
+    printf(", %d queries in the corpus, %.0f s\n", bench->corpus.count, secs);
+
+    printf("sent        %llu\n", (unsigned long long)counts->sent);
+    printf("replies     %llu (%.1f/s)\n", (unsigned long long)counts->replies,
+           counts->replies / secs);
+    printf("  NOERROR %llu, NXDOMAIN %llu, SERVFAIL %llu, NOTIMP %llu, "
+           "other %llu, truncated %llu\n",
+           (unsigned long long)counts->rcodes[NO_ERROR_RCODE],
+           (unsigned long long)counts->rcodes[NAME_ERROR_RCODE],
+           (unsigned long long)counts->rcodes[SERVER_FAILURE_RCODE],
+           (unsigned long long)counts->rcodes[NOT_IMPLEMENTED_RCODE],
+           (unsigned long long)(counts->replies -
+                                counts->rcodes[NO_ERROR_RCODE] -
+                                counts->rcodes[NAME_ERROR_RCODE] -
+                                counts->rcodes[SERVER_FAILURE_RCODE] -
+                                counts->rcodes[NOT_IMPLEMENTED_RCODE]),
+           (unsigned long long)counts->truncated);
+    printf("errors      timeouts %llu, dropped %llu, unmatched %llu, "
+           "connection %llu\n",
+           (unsigned long long)counts->timeouts,
+           (unsigned long long)counts->dropped,
+           (unsigned long long)counts->unmatched,
+           (unsigned long long)counts->conn_errors);
+
+    double percents[] = {50, 90, 99, 99.9, 100};
+    printf("latency ms ");
+    for (size_t i = 0; i < sizeof(percents) / sizeof(*percents); i++) {
+        printf(" p%g %.3f", percents[i],
+               histogram_percentile(&bench->latencies, percents[i]) / 1e3);
+    }
+    printf("\n");
+}
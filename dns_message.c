@@ -2,17 +2,16 @@
  * COMP30023 Project 2
  * Author: Jonathan Jauhari 1038331
  * 
- * DNS message module containing functions for creating (partial DNS
- * messages), parsing from bytes and interpreting them.
+ * DNS message module containing functions for parsing (partial) DNS
+ * messages in place, without copying or allocating, interpreting them and
+ * editing replies.
  */
 
 #include "dns_message.h"
 
 #include <arpa/inet.h>
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 // bitmasks for reading flags/codes in the second 2-byte field of the message
 #define QR_MASK (1 << QR_OFFSET)
@@ -24,7 +23,7 @@
 #define RCODE_MASK (0xF << RCODE_OFFSET)
 
 // bitmask representing the bits to be cleared when reading the name offset
-// in the answers section (16-bits, two leftmost bits one)
+// of a pointer in a domain (16-bits, two leftmost bits one)
 #define NAME_OFFSET_MASK ((1 << 15) | (1 << 14))
 
 // bit positions to shift left, used in setting these codes in the message
@@ -36,107 +35,167 @@
 #define RA_OFFSET 7
 #define RCODE_OFFSET 0
 
-// the number of bytes in the answer section if responding from cache,
-// relies on the assumption of only IPv6 answers in the cache, and that only
-// one answer is in the response
-#define ANSWER_SIZE 28
+// offsets of the fields in the header of a DNS message
+#define FLAGS_OFFSET 2
+#define QDCOUNT_OFFSET 4
+#define ANCOUNT_OFFSET 6
 
-// the number of bytes in the header of a DNS message
-#define HEADER_SIZE 12
-// response code designating functionality that is not implemented
-#define NOT_IMPLEMENTED_RCODE 4
+// offset of the TTL in a resource record, after its name
+#define RECORD_TTL_OFFSET 4
 
-uint8_t *read_domain(uint8_t *domain, bytes_t *bytes);
-char *read_ip_addr(char *addr, uint16_t rdlen, bytes_t *bytes);
+// the number of bytes in a resource record after its name (TYPE, CLASS, TTL
+// and RDLENGTH)
+#define RECORD_FIXED_SIZE 10
+// the number of bytes in a question after its name (QTYPE and QCLASS)
+#define QUESTION_FIXED_SIZE 4
+// the fewest bytes in the RDATA of a SOA record: two names (MNAME and RNAME)
+// of at least one byte each, then SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM
+#define SOA_MIN_RDATA_SIZE (2 + 5 * sizeof(uint32_t))
 
-uint16_t get_flags(dns_message_t *msg);
-
-void read_header(dns_message_t *msg);
-void read_queries(dns_message_t *msg);
-void read_answers(dns_message_t *msg);
-
-// Allocates a dns_message, based on the length of the message in bytes
-// `nbytes`, and returns it *uninitialised*. The queries and answer section
-// are not allocated, (they will be allocated at initialisation).
-dns_message_t *new_dns_message(uint16_t nbytes) {
-    dns_message_t *msg = malloc(sizeof(*msg));
-    assert(msg);
-
-    msg->bytes = new_bytes(nbytes);
-    msg->queries = NULL;
-    msg->answers = NULL;
+// the largest length of a label of a domain
+#define MAX_LABEL_LEN 63
 
-    return msg;
-}
-
-// Creates and initialises a dns_message then returns it, filling in the
-// header, question and answers section and nothing more, from bytes `data`
-// of length `nbytes`.
-dns_message_t *init_dns_message(uint8_t *data, uint16_t nbytes) {
-    dns_message_t *msg = new_dns_message(nbytes);
-    memcpy(msg->bytes->data, data, nbytes);
+bool is_name_pointer(uint8_t label_len);
+bool read_name(bytes_t *bytes, name_view_t *name);
+bool read_question(bytes_t *bytes, query_t *query);
+bool read_record(bytes_t *bytes, record_t *record);
 
-    read_header(msg);
-    read_queries(msg);
-    read_answers(msg);
-
-    return msg;
-}
+uint16_t get_flags(dns_message_t *msg);
 
-// Frees a dns_message: make sure it was initialised before calling this.
-void free_dns_message(dns_message_t *msg) {
-    free_bytes(msg->bytes);
+void read_header(dns_message_t *msg, bytes_t *bytes);
+
+// Initialises the dns_message `msg` from the bytes `data` of length `nbytes`,
+// in place: `data` is not copied, and must outlive `msg`. Only the header and
+// the questions section are read, which is all it takes to look up or
+// forward a query; see read_answers() for the rest. Returns false if the
+// message is malformed (too short for what its header says it holds).
+bool init_dns_message(dns_message_t *msg, uint8_t *data, uint16_t nbytes) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = 0};
+    msg->data = data;
+    msg->size = nbytes;
+    if (nbytes < HEADER_SIZE) {
+        return false;
+    }
+    read_header(msg, &bytes);
 
     for (size_t i = 0; i < msg->qdcount; i++) {
-        free(msg->queries[i].qname);
+        query_t query;
+        if (!read_question(&bytes, &query)) {
+            return false;
+        }
+        if (i == 0) {
+            msg->question = query;
+        }
     }
-    free(msg->queries);
+    msg->questions_end = bytes.offset;
+    msg->answers_end = 0;
+    msg->authority_end = 0;
+    return true;
+}
 
+// Reads the answers and authority sections of `msg`, initialised by
+// init_dns_message(), if they were not read already: sets its first answer and
+// the ends of both sections. Returns false if either is malformed.
+bool read_answers(dns_message_t *msg) {
+    bytes_t bytes = {.data = msg->data, .size = msg->size};
+    if (msg->answers_end != 0) {
+        return true;
+    }
+    bytes.offset = msg->questions_end;
     for (size_t i = 0; i < msg->ancount; i++) {
-        free(msg->answers[i].name);
-        free(msg->answers[i].rdata);
+        record_t answer;
+        if (!read_record(&bytes, &answer)) {
+            return false;
+        }
+        if (i == 0) {
+            msg->answer = answer;
+        }
+    }
+    msg->answers_end = bytes.offset;
+
+    for (size_t i = 0; i < msg->nscount; i++) {
+        record_t record;
+        if (!read_record(&bytes, &record)) {
+            msg->answers_end = 0;
+            return false;
+        }
     }
-    free(msg->answers);
+    msg->authority_end = bytes.offset;
+    return true;
+}
 
-    free(msg);
+// Returns true if the octet `label_len` that starts a label is instead the
+// first octet of a pointer to a name elsewhere in the message
+bool is_name_pointer(uint8_t label_len) {
+    return ((label_len << 8) & NAME_OFFSET_MASK) == NAME_OFFSET_MASK;
 }
 
-// Read a domain (a sequence of labels separated by '.') from `bytes` into a
-// null-terminated array of octets `domain` which can be treated as a string,
-// since we are allowed to assume domain names are ASCII only. Returns a
-// pointer to `domain`.
-uint8_t *read_domain(uint8_t *domain, bytes_t *bytes) {
-    uint8_t octet;
-    uint8_t label_size = 0;
-    while ((label_size = read8(&octet, bytes)) != 0) {
-        int i;
-        uint8_t label[label_size + 1];
-        for (i = 0; i < label_size; i++) {
-            label[i] = read8(&octet, bytes);
+// Read a domain from `bytes` into the view `name`, moving the offset of
+// `bytes` past it: up to its empty label, or a pointer to the rest of it
+// elsewhere in the message. Returns false if the domain is malformed or runs
+// past the end of `bytes`.
+bool read_name(bytes_t *bytes, name_view_t *name) {
+    uint8_t label_len;
+    name->offset = bytes->offset;
+    while (true) {
+        if (bytes->offset >= bytes->size) {
+            return false;
         }
-        label[label_size] = '\0';
-
-        if (strlen((char *)domain) != 0) {
-            strcat((char *)domain, ".");
+        read8(&label_len, bytes);
+        if (label_len == 0) {
+            break;
+        }
+        if (is_name_pointer(label_len)) {
+            if (bytes->offset >= bytes->size) {
+                return false;
+            }
+            bytes->offset++;  // the second octet of the pointer ends the name
+            break;
         }
-        strncat((char *)domain, (char *)label, label_size);
+        if (label_len > MAX_LABEL_LEN ||
+            label_len > bytes->size - bytes->offset) {
+            return false;
+        }
+        bytes->offset += label_len;
     }
-    return domain;
+    name->len = bytes->offset - name->offset;
+    return name->len <= MAX_NAME_SIZE;
 }
 
-// Read an IPv6 IP address from `rdlen` bytes of `bytes` into a string `addr`,
-// returning a pointer to `addr`. Conversion from binary network format to
-// presentation form is done by `inet_ntop()`.
-char *read_ip_addr(char *addr, uint16_t rdlen, bytes_t *bytes) {
-    inet_ntop(AF_INET6, bytes->data + bytes->offset, addr, INET6_ADDRSTRLEN);
-    bytes->offset += rdlen * sizeof(*addr);
-    return addr;
+// Read a question from `bytes` into `query`, moving the offset of `bytes`
+// past it. Returns false if it runs past the end of `bytes`.
+bool read_question(bytes_t *bytes, query_t *query) {
+    if (!read_name(bytes, &query->qname) ||
+        bytes->size - bytes->offset < QUESTION_FIXED_SIZE) {
+        return false;
+    }
+    read16(&query->qtype, bytes);
+    read16(&query->qclass, bytes);
+    return true;
 }
 
-// Set the header fields in `msg`, based on the bytes array that it contains
-void read_header(dns_message_t *msg) {
-    bytes_t *bytes = msg->bytes;
+// Read a resource record from `bytes` into `record`, moving the offset of
+// `bytes` past it. Its RDATA is left where it is. Returns false if it runs
+// past the end of `bytes`.
+bool read_record(bytes_t *bytes, record_t *record) {
+    if (!read_name(bytes, &record->name) ||
+        bytes->size - bytes->offset < RECORD_FIXED_SIZE) {
+        return false;
+    }
+    read16(&record->type, bytes);
+    read16(&record->class, bytes);
+    read32(&record->ttl, bytes);
+    read16(&record->rdlen, bytes);
+    if (record->rdlen > bytes->size - bytes->offset) {
+        return false;
+    }
+    record->rdata = bytes->offset;
+    bytes->offset += record->rdlen;
+    return true;
+}
 
+// Set the header fields in `msg`, reading them from `bytes`
+void read_header(dns_message_t *msg, bytes_t *bytes) {
     read16(&msg->id, bytes);
 
     uint16_t flags;
@@ -145,10 +204,10 @@ void read_header(dns_message_t *msg) {
     // for RCODE.
     msg->qr = (flags & QR_MASK) >> QR_OFFSET;
     msg->opcode = (flags & OPCODE_MASK) >> OPCODE_OFFSET;
-    msg->aa = (flags & AA_MASK) >> AA_OFFSET;     
-    msg->tc = (flags & TC_MASK) >> TC_OFFSET;     
-    msg->rd = (flags & RD_MASK) >> RD_OFFSET;     
-    msg->ra = (flags & RA_MASK) >> RA_OFFSET;         
+    msg->aa = (flags & AA_MASK) >> AA_OFFSET;
+    msg->tc = (flags & TC_MASK) >> TC_OFFSET;
+    msg->rd = (flags & RD_MASK) >> RD_OFFSET;
+    msg->ra = (flags & RA_MASK) >> RA_OFFSET;
     // 3 bits of z is ignored
     msg->rcode = (flags & RCODE_MASK) >> RCODE_OFFSET;
 
@@ -158,159 +217,390 @@ void read_header(dns_message_t *msg) {
     read16(&msg->arcount, bytes);
 }
 
-// Set the queries field in `msg`, based on the bytes array that it contains.
-// This function allocates the queries in `msg`.
-void read_queries(dns_message_t *msg) {
-    bytes_t *bytes = msg->bytes;
-    query_t *queries = malloc(msg->qdcount * sizeof(*queries));
-    assert(queries);
+// Return the integer value of the 2nd 2-byte field in the binary
+// representation of `msg`.
+uint16_t get_flags(dns_message_t *msg) {
+    uint16_t flags = 0;
+    flags |= msg->qr << QR_OFFSET;
+    flags |= msg->opcode << OPCODE_OFFSET;
+    flags |= msg->aa << AA_OFFSET;
+    flags |= msg->tc << TC_OFFSET;
+    flags |= msg->rd << RD_OFFSET;
+    flags |= msg->ra << RA_OFFSET;
+    flags |= msg->rcode << RCODE_OFFSET;
+    return flags;
+}
 
-    for (size_t i = 0; i < msg->qdcount; i++) {
-        query_t query;
-        query.qname = malloc(bytes->size * sizeof(*query.qname));
-        assert(query.qname);
-        *query.qname = '\0';
+// Given a query `msg` that contains NO ANSWERS, put together in `reply` (of
+// at least `msg->size` bytes) a reply to be sent back to the client,
+// responding with RCODE `rcode` and no answers, by copying the query.
+// Returns the length of the reply.
+uint16_t make_error_reply(dns_message_t *msg, uint8_t rcode, uint8_t *reply) {
+    bytes_t bytes = {.data = reply, .size = msg->size, .offset = FLAGS_OFFSET};
+    // the questions, and additional records if any, are kept as they are
+    memcpy(reply, msg->data, msg->size);
+
+    // Respond (QR=1) with RA = true, RCODE = `rcode`
+    uint16_t flags = get_flags(msg);
+    flags |= true << RA_OFFSET;
+    flags |= rcode << RCODE_OFFSET;
+    flags |= true << QR_OFFSET;
+    write16(&bytes, flags);
+    return msg->size;
+}
 
-        read_domain(query.qname, bytes);
-        read16(&query.qtype, bytes);
-        read16(&query.qclass, bytes);
+// Given a query `msg`, put together in `reply` (of at least
+// `msg->questions_end` bytes) the start of an authoritative reply to it with
+// RCODE `rcode`: its header and questions, with no records yet, see
+// add_record(). Returns the length of the reply so far.
+uint16_t make_reply(dns_message_t *msg, uint8_t rcode, uint8_t *reply) {
+    bytes_t bytes = {.data = reply, .size = msg->questions_end,
+                     .offset = FLAGS_OFFSET};
+    memcpy(reply, msg->data, msg->questions_end);
+
+    // Respond (QR=1) with AA = RA = true, RCODE = `rcode`, not truncated
+    uint16_t flags = get_flags(msg) & ~(TC_MASK | RCODE_MASK);
+    flags |= true << AA_OFFSET;
+    flags |= true << RA_OFFSET;
+    flags |= rcode << RCODE_OFFSET;
+    flags |= true << QR_OFFSET;
+    write16(&bytes, flags);
+    set_record_counts(reply, 0, 0, 0);
+    return msg->questions_end;
+}
 
-        queries[i] = query;
+// Append to the DNS message `data` of length `nbytes` a resource record of
+// class IN, whose name is the one at `name_offset` (as a pointer to it), of
+// type `type`, TTL `ttl` and RDATA `rdata` of length `rdlen`, if the message
+// stays within `max_size` bytes. The header's record counts are left to the
+// caller, see set_record_counts(). Returns the new length of the message, or
+// 0 if the record does not fit.
+uint16_t add_record(uint8_t *data, uint16_t nbytes, uint16_t max_size,
+                    uint16_t name_offset, uint16_t type, uint32_t ttl,
+                    uint8_t *rdata, uint16_t rdlen) {
+    size_t len = nbytes + sizeof(uint16_t) + RECORD_FIXED_SIZE + rdlen;
+    if (len > max_size) {
+        return 0;
     }
-    msg->queries = queries;
+    bytes_t bytes = {.data = data, .size = len, .offset = nbytes};
+    write16(&bytes, NAME_OFFSET_MASK | name_offset);
+    write16(&bytes, type);
+    write16(&bytes, IN_CLASS);
+    write32(&bytes, ttl);
+    write16(&bytes, rdlen);
+    memcpy(data + bytes.offset, rdata, rdlen);
+    return len;
 }
 
-// Set the queries field in `msg`, based on the bytes array that it contains
-// This function allocates the answers in `msg`.
-void read_answers(dns_message_t *msg) {
-    bytes_t *bytes = msg->bytes;
-    record_t *answers = malloc(msg->ancount * sizeof(*answers));
-    assert(answers);
+// Put together in `query` (of at least HEADER_SIZE + MAX_NAME_SIZE + 4
+// bytes) a standard query with ID `id`, recursion desired, for the records
+// of type `qtype` and class IN of the domain `name`, as labels separated by
+// '.'. Returns the length of the query, or 0 if `name` is not a valid domain.
+uint16_t make_query(uint8_t *query, uint16_t id, char *name, uint16_t qtype) {
+    bytes_t bytes = {.data = query, .size = MAX_MESSAGE_SIZE, .offset = 0};
+    write16(&bytes, id);
+    write16(&bytes, RD_MASK);
+    write16(&bytes, 1);
+    set_record_counts(query, 0, 0, 0);
+    bytes.offset = HEADER_SIZE;
+    while (*name) {
+        size_t label_len = strcspn(name, ".");
+        if (label_len == 0 || label_len > MAX_LABEL_LEN ||
+            bytes.offset - HEADER_SIZE + label_len + 2 > MAX_NAME_SIZE) {
+            return 0;
+        }
+        query[bytes.offset++] = label_len;
+        memcpy(query + bytes.offset, name, label_len);
+        bytes.offset += label_len;
+        name += label_len + (name[label_len] == '.');
+    }
+    query[bytes.offset++] = 0;
+    write16(&bytes, qtype);
+    write16(&bytes, IN_CLASS);
+    return bytes.offset;
+}
 
-    for (size_t i = 0; i < msg->ancount; i++) {
-        record_t answer;
-        uint16_t name_offset = 0;
-        read16(&name_offset, bytes);
+// Put the text of the domain at `offset` of the DNS message `data` of length
+// `nbytes` into `text` (of at least MAX_NAME_SIZE bytes) as labels separated
+// by '.', since we are allowed to assume domain names are ASCII only,
+// following pointers to the rest of it. This is done in one pass over its
+// labels. If the name is malformed, `text` holds the labels up to where it
+// is. Returns a pointer to `text`.
+char *get_name(uint8_t *data, uint16_t nbytes, uint16_t offset, char *text) {
+    size_t len = 0;
+    while (offset < nbytes) {
+        uint8_t label_len = data[offset];
+        if (is_name_pointer(label_len)) {
+            if (offset + 1 >= nbytes) {
+                break;
+            }
+            uint16_t target =
+                ((label_len << 8) | data[offset + 1]) & ~NAME_OFFSET_MASK;
+            if (target >= offset) {
+                break;  // pointing backwards only, so it cannot loop
+            }
+            offset = target;
+            continue;
+        }
+        size_t dot = len > 0;
+        if (label_len == 0 || label_len > MAX_LABEL_LEN ||
+            label_len >= nbytes - offset ||
+            len + dot + label_len >= MAX_NAME_SIZE) {
+            break;
+        }
+        if (dot) {
+            text[len++] = '.';
+        }
+        memcpy(text + len, data + offset + 1, label_len);
+        len += label_len;
+        offset += 1 + label_len;
+    }
+    text[len] = '\0';
+    return text;
+}
 
-        // check that first (leftmost) two bits in 16-bit field are 0b11.
-        assert(((name_offset & NAME_OFFSET_MASK) ^ NAME_OFFSET_MASK) == 0);
+// Read the resource record at `offset` of the DNS message `data` of length
+// `nbytes` into `record`, the next one being at `record->rdata +
+// record->rdlen`. Returns false if it runs past the end of the message.
+bool get_record(uint8_t *data, uint16_t nbytes, uint16_t offset,
+                record_t *record) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = offset};
+    return read_record(&bytes, record);
+}
 
-        // clear first two bits (16th and 15th), this is the offset needed
-        name_offset &= ~NAME_OFFSET_MASK;
+// Return the largest reply the sender of query `msg` accepts over UDP: the
+// payload size of its EDNS(0) OPT record (RFC 6891) if it has one, at least
+// `min_size` and at most `max_size`, otherwise `min_size`. This reads the
+// records after the questions, so is best left until a reply is too long
+// for `min_size`.
+uint16_t get_udp_payload_size(dns_message_t *msg, uint16_t min_size,
+                              uint16_t max_size) {
+    bytes_t bytes = {.data = msg->data, .size = msg->size};
+    if (!read_answers(msg)) {
+        return min_size;  // malformed
+    }
+    bytes.offset = msg->answers_end;
 
-        // save the old offset before temporarily setting the name offset
-        // to read the domain name, then resetting back to the old offset.
-        uint16_t old_offset = bytes->offset;
-        bytes->offset = name_offset;
-        answer.name = malloc(bytes->size * sizeof(*answer.name));
-        assert(answer.name);
-        *answer.name = '\0';
-        read_domain(answer.name, bytes);
-        bytes->offset = old_offset;
+    size_t nrecords = msg->nscount + msg->arcount;
+    for (size_t i = 0; i < nrecords; i++) {
+        record_t record;
+        if (!read_record(&bytes, &record)) {
+            break;  // malformed
+        }
+        // the class of an OPT record is the sender's UDP payload size
+        if (record.type == OPT_RR_TYPE) {
+            if (record.class < min_size) {
+                return min_size;
+            }
+            return record.class < max_size ? record.class : max_size;
+        }
+    }
+    return min_size;
+}
 
-        read16(&answer.type, bytes);
-        read16(&answer.class, bytes);
-        read32(&answer.ttl, bytes);
+// Return the offset of the end of the questions section in the DNS message
+// `data` of length `nbytes`, reading no further. Returns 0 if the message is
+// too short to hold its questions.
+uint16_t get_questions_end(uint8_t *data, uint16_t nbytes) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = QDCOUNT_OFFSET};
+    uint16_t qdcount;
+    if (nbytes < HEADER_SIZE) {
+        return 0;
+    }
+    read16(&qdcount, &bytes);
+    bytes.offset = HEADER_SIZE;
+    for (size_t i = 0; i < qdcount; i++) {
+        query_t query;
+        if (!read_question(&bytes, &query)) {
+            return 0;
+        }
+    }
+    return bytes.offset;
+}
 
-        read16(&answer.rdlen, bytes);
+// Return true if the DNS message `data` of length `nbytes` is a plain query:
+// a standard query, not truncated, with one question and no answer or
+// authority records (additional records, such as an OPT record, are fine),
+// without parsing it into a dns_message_t
+bool is_plain_query(uint8_t *data, uint16_t nbytes) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = FLAGS_OFFSET};
+    uint16_t flags, qdcount, ancount, nscount;
+    if (nbytes < HEADER_SIZE) {
+        return false;
+    }
+    read16(&flags, &bytes);
+    read16(&qdcount, &bytes);
+    read16(&ancount, &bytes);
+    read16(&nscount, &bytes);
+    return (flags & (QR_MASK | OPCODE_MASK | TC_MASK)) == 0 && qdcount == 1 &&
+           ancount == 0 && nscount == 0;
+}
 
-        char *addr = malloc(INET6_ADDRSTRLEN);
-        assert(addr);
-        read_ip_addr(addr, answer.rdlen, bytes);
-        answer.rdata = addr;
+// Return true if the TC (truncated) bit is set in the DNS message `data` of
+// length `nbytes`, without parsing it into a dns_message_t
+bool get_truncated(uint8_t *data, uint16_t nbytes) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = FLAGS_OFFSET};
+    uint16_t flags;
+    if (nbytes < HEADER_SIZE) {
+        return false;
+    }
+    return (read16(&flags, &bytes) & TC_MASK) >> TC_OFFSET;
+}
 
-        answers[i] = answer;
+// Put the IPv6 address in the RDATA of the AAAA record `record` of the DNS
+// message `data` into a string `addr` (of length at least INET6_ADDRSTRLEN),
+// returning a pointer to `addr`. Conversion from binary network format to
+// presentation form is done by `inet_ntop()`.
+char *get_ip_addr(uint8_t *data, record_t *record, char *addr) {
+    if (record->rdlen != sizeof(struct in6_addr) ||
+        !inet_ntop(AF_INET6, data + record->rdata, addr, INET6_ADDRSTRLEN)) {
+        strcpy(addr, "?");
     }
-    msg->answers = answers;
+    return addr;
 }
 
-// Return the integer value of the 2nd 2-byte field in the binary
-// representation of `msg`.
-uint16_t get_flags(dns_message_t *msg) {
-    uint16_t flags = 0;
-    flags |= msg->qr << QR_OFFSET;
-    flags |= msg->opcode << OPCODE_OFFSET;
-    flags |= msg->aa << AA_OFFSET;
-    flags |= msg->tc << TC_OFFSET;
-    flags |= msg->rd << RD_OFFSET;
-    flags |= msg->ra << RA_OFFSET;
-    flags |= msg->rcode << RCODE_OFFSET;
-    return flags;
+// Return the least TTL of the answers of the DNS message `msg`, which must have
+// been read by read_answers(), or 0 if it has none: the time the whole answer
+// section (the RRsets, and any CNAME chain leading to them) can be kept for
+uint32_t get_answers_ttl(dns_message_t *msg) {
+    uint32_t ttl = 0;
+    uint16_t offset = msg->questions_end;
+    for (size_t i = 0; i < msg->ancount; i++) {
+        record_t answer;
+        if (!get_record(msg->data, msg->size, offset, &answer)) {
+            return 0;  // malformed
+        }
+        if (i == 0 || answer.ttl < ttl) {
+            ttl = answer.ttl;
+        }
+        offset = answer.rdata + answer.rdlen;
+    }
+    return ttl;
 }
 
-// Given a message `msg` that contains ONLY ONE non-AAAA query AND NO
-// ANSWERS, return a message to be sent back a message to the client,
-// responding with RCODE NOT_IMPLEMENTED, deep copying the request `msg` to
-// form a reply. Exits if error.
-dns_message_t *new_unimplemented_message(dns_message_t *msg) {
-    bytes_t *bytes = new_bytes(msg->bytes->size);
-    write16(bytes, msg->id);
+// Return how long the negative reply `msg` (one with no answers to its
+// question) can be cached for, as of RFC 2308: the least of the TTL of the SOA
+// record in its authority section and the MINIMUM field of that SOA. Its
+// answers must have been read by read_answers(). Returns 0 if it has no SOA.
+uint32_t get_negative_ttl(dns_message_t *msg) {
+    bytes_t bytes = {.data = msg->data, .size = msg->size};
+    uint16_t offset = msg->answers_end;
+    for (size_t i = 0; i < msg->nscount; i++) {
+        record_t record;
+        if (!get_record(msg->data, msg->size, offset, &record)) {
+            return 0;  // malformed
+        }
+        // MINIMUM is the last field of the RDATA, after two names and four
+        // other 32-bit fields
+        if (record.type == SOA_RR_TYPE &&
+            record.rdlen >= SOA_MIN_RDATA_SIZE) {
+            uint32_t minimum;
+            bytes.offset = record.rdata + record.rdlen - sizeof(minimum);
+            read32(&minimum, &bytes);
+            return record.ttl < minimum ? record.ttl : minimum;
+        }
+        offset = record.rdata + record.rdlen;
+    }
+    return 0;
+}
 
-    // Respond (QR=1) with RA = true, RCODE = NOT_IMPLEMENTED
-    uint16_t flags = get_flags(msg);
-    flags |= true << RA_OFFSET;
-    flags |= NOT_IMPLEMENTED_RCODE << RCODE_OFFSET;
-    flags |= true << QR_OFFSET;
-    write16(bytes, flags);
-
-    // copy all the questions
-    uint16_t qlen = msg->bytes->offset - bytes->offset;
-    memcpy(bytes->data + bytes->offset, msg->bytes->data + bytes->offset,
-           qlen);
-    bytes->offset += qlen;
-
-    // copy additional records if any
-    uint16_t rest_len = msg->bytes->size - msg->bytes->offset;
-    memcpy(bytes->data + bytes->offset,
-           msg->bytes->data + msg->bytes->offset, rest_len);
-
-    dns_message_t *reply = init_dns_message(bytes->data, bytes->size);
-    free_bytes(bytes);
-    return reply;
+// Return how much of the reply `msg` is worth caching, and for how long (in
+// `ttl`), setting `nscount` to the number of its authority records kept:
+// answers are cached for the least of their TTLs; negative replies (NXDOMAIN,
+// or NOERROR with no answers) for as long as the SOA of their authority
+// section says (RFC 2308), along with it. The additional section is never
+// kept. Returns 0 if the reply is not to be cached: it is malformed,
+// truncated, an error, or has a TTL of 0.
+uint16_t get_cacheable(dns_message_t *msg, uint32_t *ttl, uint16_t *nscount) {
+    if (!read_answers(msg) || msg->qdcount != 1 || msg->tc ||
+        (msg->rcode != NO_ERROR_RCODE && msg->rcode != NAME_ERROR_RCODE)) {
+        return 0;
+    }
+    *ttl = get_answers_ttl(msg);
+    *nscount = 0;
+    uint16_t len = msg->answers_end;
+    if (msg->rcode == NAME_ERROR_RCODE || msg->ancount == 0) {
+        uint32_t negative_ttl = get_negative_ttl(msg);
+        if (msg->ancount == 0 || negative_ttl < *ttl) {
+            *ttl = negative_ttl;
+        }
+        len = msg->authority_end;
+        *nscount = msg->nscount;
+    }
+    return *ttl != 0 ? len : 0;
 }
 
-// Given a message `msg` that contains ONLY ONE AAAA query AND NO ANSWERS,
-// return a message to be sent back a message to the client, responding with
-// the record in `cached` as the only answer, deep copying the request `msg`
-// to form a reply. Exits if error.
-dns_message_t *new_response_message(dns_message_t *msg, record_t *record) {
-    bytes_t *bytes = new_bytes(msg->bytes->size + ANSWER_SIZE);
-    write16(bytes, msg->id);
+// Set the number of records in each section of the header of the DNS message
+// `data` (of at least HEADER_SIZE bytes)
+void set_record_counts(uint8_t *data, uint16_t ancount, uint16_t nscount,
+                       uint16_t arcount) {
+    bytes_t bytes = {.data = data, .size = HEADER_SIZE};
+    bytes.offset = ANCOUNT_OFFSET;
+    write16(&bytes, ancount);
+    write16(&bytes, nscount);
+    write16(&bytes, arcount);
+}
 
-    // Respond (QR=1) with RA = true
-    uint16_t flags = get_flags(msg);
-    flags |= true << RA_OFFSET;
-    flags |= true << QR_OFFSET;
-    write16(bytes, flags);
-
-    write16(bytes, msg->qdcount);
-    write16(bytes, 1);  // one answer in the reply
-    write16(bytes, msg->nscount);
-    write16(bytes, msg->arcount);
-
-    // copy all the questions
-    uint16_t qlen = msg->bytes->offset - bytes->offset;
-    memcpy(bytes->data + bytes->offset, msg->bytes->data + bytes->offset,
-           qlen);
-    bytes->offset += qlen;
-
-    // name offset field is fixed, based on assumptions
-    write16(bytes, (NAME_OFFSET_MASK | HEADER_SIZE));
-    write16(bytes, record->type);
-    write16(bytes, record->class);
-    write32(bytes, record->ttl);
-
-    uint16_t rdlen = sizeof(struct in6_addr);
-    write16(bytes, rdlen);
-    inet_pton(AF_INET6, record->rdata, bytes->data + bytes->offset);
-    bytes->offset += rdlen;
-
-    // copy additional records if any
-    uint16_t rest_len = msg->bytes->size - msg->bytes->offset;
-    memcpy(bytes->data + bytes->offset,
-           msg->bytes->data + msg->bytes->offset, rest_len);
-
-    dns_message_t *reply = init_dns_message(bytes->data, bytes->size);
-    free_bytes(bytes);
-    return reply;
+// Subtract `elapsed` seconds from the TTL of every answer and authority record
+// of the DNS message `data` of length `nbytes`, in place, stopping at
+// `min_ttl`
+void age_records(uint8_t *data, uint16_t nbytes, uint32_t elapsed,
+                 uint32_t min_ttl) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = ANCOUNT_OFFSET};
+    uint16_t ancount, nscount;
+    uint16_t offset = get_questions_end(data, nbytes);
+    if (offset == 0) {
+        return;  // malformed
+    }
+    read16(&ancount, &bytes);
+    read16(&nscount, &bytes);
+
+    for (size_t i = 0; i < (size_t)ancount + nscount; i++) {
+        record_t record;
+        if (!get_record(data, nbytes, offset, &record)) {
+            return;  // malformed
+        }
+        bytes.offset = record.name.offset + record.name.len +
+                       RECORD_TTL_OFFSET;
+        uint32_t ttl = record.ttl > elapsed ? record.ttl - elapsed : 0;
+        write32(&bytes, ttl > min_ttl ? ttl : min_ttl);
+        offset = record.rdata + record.rdlen;
+    }
+}
+
+// Make the reply `data` of length `nbytes` a reply to the query `query`,
+// whose questions end at `qend`, in place: give it the ID of the query, and
+// its RD flag, and its questions (as the client wrote them, in case it checks
+// the case of names) if they are as long as those of the reply
+void set_reply_query(uint8_t *data, uint16_t nbytes, uint8_t *query,
+                     uint16_t qend) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = FLAGS_OFFSET};
+    uint16_t flags;
+    memcpy(data, query, sizeof(uint16_t));  // the ID, as it is
+    read16(&flags, &bytes);
+    flags = (flags & ~RD_MASK) | ((query[FLAGS_OFFSET] << 8) & RD_MASK);
+    bytes.offset = FLAGS_OFFSET;
+    write16(&bytes, flags);
+
+    if (qend == get_questions_end(data, nbytes)) {
+        memcpy(data + HEADER_SIZE, query + HEADER_SIZE, qend - HEADER_SIZE);
+    }
+}
+
+// Given a reply `data` of length `nbytes` that is too large to be sent over
+// UDP, cut it down to its header and questions, in place, setting the TC
+// (truncated) bit to tell the client to retry over TCP. Returns the new
+// length of the reply.
+uint16_t truncate_reply(uint8_t *data, uint16_t nbytes) {
+    bytes_t bytes = {.data = data, .size = nbytes, .offset = FLAGS_OFFSET};
+    uint16_t qend = get_questions_end(data, nbytes);
+    uint16_t flags;
+    if (qend == 0) {
+        return nbytes < HEADER_SIZE ? nbytes : HEADER_SIZE;
+    }
+    read16(&flags, &bytes);
+    bytes.offset = FLAGS_OFFSET;
+    write16(&bytes, flags | TC_MASK);
+    set_record_counts(data, 0, 0, 0);
+    return qend;
 }
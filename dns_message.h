@@ -2,8 +2,9 @@
  * COMP30023 Project 2
  * Author: Jonathan Jauhari 1038331
  * 
- * DNS message module containing functions for creating (partial DNS
- * messages), parsing from bytes and interpreting them.
+ * DNS message module containing functions for parsing (partial) DNS
+ * messages in place, without copying or allocating, interpreting them and
+ * editing replies.
  */
 
 #ifndef DNS_MESSAGE_H
@@ -16,28 +17,67 @@
 
 // resource record type designating AAAA or IPv6
 #define AAAA_RR_TYPE 28
+// resource record type designating the start of a zone of authority
+#define SOA_RR_TYPE 6
+// resource record type designating an EDNS(0) OPT pseudo-record
+#define OPT_RR_TYPE 41
+// resource record type designating an IPv4 address
+#define A_RR_TYPE 1
+// class designating the Internet
+#define IN_CLASS 1
+
+// the number of bytes in the header of a DNS message
+#define HEADER_SIZE 12
+// operation code designating a standard query
+#define QUERY_OPCODE 0
+
+// the largest size of a DNS message (over TCP, its length is 16-bit)
+#define MAX_MESSAGE_SIZE UINT16_MAX
+// the largest size of a domain name on the wire, which bounds the size of its
+// text too, null byte included
+#define MAX_NAME_SIZE 255
+
+// response code designating no error
+#define NO_ERROR_RCODE 0
+// response code designating the name queried does not exist
+#define NAME_ERROR_RCODE 3
+// response code designating the server failed to process the query
+#define SERVER_FAILURE_RCODE 2
+// response code designating functionality that is not implemented
+#define NOT_IMPLEMENTED_RCODE 4
+
+// Represents a domain name as it is in a DNS message: where it starts, and
+// how many bytes it takes there, up to and including its terminating empty
+// label or a pointer to the rest of it elsewhere in the message. See
+// get_name() for its text.
+typedef struct {
+    uint16_t offset;
+    uint16_t len;
+} name_view_t;
 
 // Represents a 'question' in the questions section of a DNS message
 typedef struct {
+    name_view_t qname;
     uint16_t qtype;
     uint16_t qclass;
-    uint8_t *qname;
 } query_t;
 
-// Represents a 'resource record' in the answers section of a DNS message
+// Represents a 'resource record' in a DNS message
 typedef struct {
-    uint8_t *name;
+    name_view_t name;
     uint16_t type;
     uint16_t class;
     uint32_t ttl;
     uint16_t rdlen;
-    char *rdata;
+    uint16_t rdata;  // offset of the RDATA in the message, `rdlen` bytes
 } record_t;
 
-// Represents a (partial) DNS message. The 'Authority' and 'Additional'
-// sections are omitted. This structure also contains its representation in
-// bytes, in a `bytes_t`. The order of the fields is significant, as their
-// offset is used when setting certain fields by the DNS server implementation
+// Represents a (partial) DNS message, parsed where it lies: `data` is neither
+// copied nor owned, and names and records are views into it. Only the first
+// question and the first answer are kept; the other records are found from
+// the offsets of the ends of the sections. The answers and authority records
+// are only read when asked for, by read_answers(): until then, `answers_end`
+// and `authority_end` are 0.
 typedef struct {
     uint16_t id;
     bool qr;
@@ -51,17 +91,44 @@ typedef struct {
     uint16_t ancount;
     uint16_t nscount;
     uint16_t arcount;
-    query_t *queries;
-    record_t *answers;
-    bytes_t *bytes;
+    query_t question;  // the first, if `qdcount` > 0
+    record_t answer;  // the first, if `ancount` > 0 and they were read
+    uint16_t questions_end;
+    uint16_t answers_end;
+    uint16_t authority_end;
+    uint8_t *data;
+    uint16_t size;
 } dns_message_t;
 
-dns_message_t *new_dns_message(uint16_t nbytes);
-dns_message_t *init_dns_message(uint8_t *data,  uint16_t nbytes);
+bool init_dns_message(dns_message_t *msg, uint8_t *data, uint16_t nbytes);
+bool read_answers(dns_message_t *msg);
+
+uint16_t make_error_reply(dns_message_t *msg, uint8_t rcode, uint8_t *reply);
+uint16_t make_reply(dns_message_t *msg, uint8_t rcode, uint8_t *reply);
+uint16_t add_record(uint8_t *data, uint16_t nbytes, uint16_t max_size,
+                    uint16_t name_offset, uint16_t type, uint32_t ttl,
+                    uint8_t *rdata, uint16_t rdlen);
+uint16_t make_query(uint8_t *query, uint16_t id, char *name, uint16_t qtype);
 
-void free_dns_message(dns_message_t *msg);
+char *get_name(uint8_t *data, uint16_t nbytes, uint16_t offset, char *text);
+bool get_record(uint8_t *data, uint16_t nbytes, uint16_t offset,
+                record_t *record);
+uint16_t get_udp_payload_size(dns_message_t *msg, uint16_t min_size,
+                              uint16_t max_size);
+uint16_t get_questions_end(uint8_t *data, uint16_t nbytes);
+bool is_plain_query(uint8_t *data, uint16_t nbytes);
+bool get_truncated(uint8_t *data, uint16_t nbytes);
+char *get_ip_addr(uint8_t *data, record_t *record, char *addr);
+uint32_t get_answers_ttl(dns_message_t *msg);
+uint32_t get_negative_ttl(dns_message_t *msg);
+uint16_t get_cacheable(dns_message_t *msg, uint32_t *ttl, uint16_t *nscount);
 
-dns_message_t *new_unimplemented_message(dns_message_t *msg);
-dns_message_t *new_response_message(dns_message_t *msg, record_t *record);
+void set_record_counts(uint8_t *data, uint16_t ancount, uint16_t nscount,
+                       uint16_t arcount);
+void age_records(uint8_t *data, uint16_t nbytes, uint32_t elapsed,
+                 uint32_t min_ttl);
+void set_reply_query(uint8_t *data, uint16_t nbytes, uint8_t *query,
+                     uint16_t qend);
+uint16_t truncate_reply(uint8_t *data, uint16_t nbytes);
 
 #endif
@@ -0,0 +1,667 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Fake upstream program: a stand-in for the upstream server, to benchmark
+ * the DNS server against on one machine, with no network. It answers every
+ * query, over TCP and UDP, from a synthetic zone: every name exists (unless
+ * made to not), with made-up addresses for A and AAAA queries, and no data
+ * for other types. How long it takes to reply, how many queries it drops,
+ * the TTLs, the number of answers and how many UDP replies are truncated
+ * are drawn from distributions given on the command line, from a seed that
+ * can be fixed, so runs are reproducible.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "dns_message.h"
+#include "net.h"
+#include "udp.h"
+#include "util.h"
+
+// maximum number of connection requests to be queued up
+#define CONNECTION_QUEUE_SIZE SOMAXCONN
+// maximum number of events handled per call to epoll_wait()
+#define MAX_EVENTS 256
+// the largest number of answers in a reply
+#define MAX_ANSWERS 255
+// the refresh, retry and expire times of the zone's SOA record, in seconds
+#define SOA_REFRESH 3600
+#define SOA_RETRY 600
+#define SOA_EXPIRE 86400
+// the RDATA of the zone's SOA record, up to its timers: its name server and
+// the mailbox of its administrator, as names on the wire
+#define SOA_NAMES "\2ns\4fake\0\12hostmaster\4fake"
+
+// The socket connections are accepted on. The `kind` is first so that it can
+// be registered with epoll directly.
+typedef struct {
+    fd_kind_t kind;
+    int fd;
+} listener_t;
+
+// The kinds of distributions values are drawn from
+typedef enum {
+    DIST_FIXED,    // always `a`
+    DIST_UNIFORM,  // between `a` and `b`
+    DIST_EXP       // exponential, with mean `a`
+} dist_kind_t;
+
+// A distribution to draw values from, parsed from "N", "fixed:N",
+// "uniform:MIN:MAX" or "exp:MEAN"
+typedef struct {
+    dist_kind_t kind;
+    double a;
+    double b;
+} dist_t;
+
+// The settings of the fake upstream
+typedef struct {
+    char *port;
+    dist_t delay;    // in ms
+    dist_t ttl;      // in seconds
+    dist_t answers;  // per reply to A and AAAA queries
+    double drop_percent;      // of queries never replied to
+    double truncate_percent;  // of UDP replies truncated, whatever their size
+    double nx_percent;        // of names that do not exist
+    uint32_t seed;
+} fake_config_t;
+
+// A reply waiting for its delay to be up, to the client `client` over TCP,
+// or to the address `addr` over UDP
+typedef struct {
+    uint64_t due_time;  // in µs
+    conn_t *client;     // TCP only, referenced until sent
+    struct sockaddr_storage addr;  // UDP only
+    socklen_t addrlen;
+    uint16_t len;
+    uint8_t data[];
+} delayed_reply_t;
+
+// What the fake upstream did, printed when it is stopped
+typedef struct {
+    uint64_t queries;
+    uint64_t replies;
+    uint64_t dropped;
+    uint64_t truncated;
+} fake_counts_t;
+
+// A fake upstream: its sockets, and the replies waiting to be sent, in a
+// binary min-heap by when they are due
+typedef struct {
+    fake_config_t config;
+    uint32_t random_state;
+    conn_loop_t loop;
+    listener_t listener;
+    udp_socket_t *udp;
+    uint8_t *reply_buf;
+
+    delayed_reply_t **delayed;
+    size_t ndelayed;
+    size_t delayed_cap;
+
+    fake_counts_t counts;
+} fake_upstream_t;
+
+void parse_fake_config(fake_config_t *config, int argc, char *argv[]);
+void print_usage(char *prog);
+bool parse_dist(dist_t *dist, char *spec);
+double draw(fake_upstream_t *fake, dist_t *dist);
+bool chance(fake_upstream_t *fake, double percent);
+
+void free_fake_upstream(fake_upstream_t *fake);
+void run_fake_upstream(fake_upstream_t *fake);
+void accept_clients(fake_upstream_t *fake);
+void handle_client_event(fake_upstream_t *fake, conn_t *client);
+void close_client_if_done(conn_t *client);
+void handle_udp_event(fake_upstream_t *fake);
+uint16_t handle_query(fake_upstream_t *fake, uint8_t *query, uint16_t len,
+                      bool over_udp);
+uint16_t make_answers(fake_upstream_t *fake, dns_message_t *msg,
+                      uint8_t *reply, uint16_t max_size);
+uint16_t add_soa(uint8_t *reply, uint16_t len, uint16_t max_size,
+                 uint32_t ttl);
+uint32_t hash_name(char *name);
+
+void send_or_delay(fake_upstream_t *fake, conn_t *client,
+                   struct sockaddr_storage *addr, socklen_t addrlen,
+                   uint16_t len);
+void send_fake_reply(fake_upstream_t *fake, conn_t *client,
+                     struct sockaddr_storage *addr, socklen_t addrlen,
+                     uint8_t *reply, uint16_t len);
+int next_timeout(fake_upstream_t *fake, uint64_t now);
+void send_due(fake_upstream_t *fake, uint64_t now);
+void push_delayed(fake_upstream_t *fake, delayed_reply_t *reply);
+delayed_reply_t *pop_delayed(fake_upstream_t *fake);
+
+void stop(int signum);
+
+// set by the signal handler, to print what was done before exiting
+volatile sig_atomic_t stopping = 0;
+
+// Answers queries over TCP and UDP on the port given, from a synthetic zone,
+// until interrupted. See print_usage() for the options.
+int main(int argc, char *argv[]) {
+    fake_upstream_t fake;
+    parse_fake_config(&fake.config, argc, argv);
+    fake.random_state = fake.config.seed;
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    init_conn_loop(&fake.loop, epfd);
+    fake.reply_buf = malloc(MAX_MESSAGE_SIZE);
+    assert(fake.reply_buf);
+    fake.ndelayed = 0;
+    fake.delayed_cap = 1024;
+    fake.delayed = malloc(fake.delayed_cap * sizeof(*fake.delayed));
+    assert(fake.delayed);
+    memset(&fake.counts, 0, sizeof(fake.counts));
+
+    fake.listener.kind = FD_LISTENER;
+    fake.listener.fd = setup_server_socket(fake.config.port, SOCK_STREAM);
+    if (listen(fake.listener.fd, CONNECTION_QUEUE_SIZE) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &fake.listener};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fake.listener.fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    fake.udp = new_udp_socket(
+        setup_server_socket(fake.config.port, SOCK_DGRAM), FD_UDP);
+    event.data.ptr = fake.udp;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fake.udp->fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    // a client hanging up must not kill the server when writing to it
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    run_fake_upstream(&fake);
+
+    fprintf(stderr, "queries %llu, replies %llu, dropped %llu, "
+                    "truncated %llu\n",
+            (unsigned long long)fake.counts.queries,
+            (unsigned long long)fake.counts.replies,
+            (unsigned long long)fake.counts.dropped,
+            (unsigned long long)fake.counts.truncated);
+    free_fake_upstream(&fake);
+    return 0;
+}
+
+// The signal handler: stops the fake upstream
+void stop(int signum) {
+    (void)signum;
+    stopping = 1;
+}
+
+// Fills in `config` from the command line arguments `argv`: options first,
+// then the port to listen on. Exits if the arguments are invalid.
+void parse_fake_config(fake_config_t *config, int argc, char *argv[]) {
+    parse_dist(&config->delay, "0");
+    parse_dist(&config->ttl, "300");
+    parse_dist(&config->answers, "1");
+    config->drop_percent = 0;
+    config->truncate_percent = 0;
+    config->nx_percent = 0;
+    config->seed = random_seed();
+
+    int opt;
+    bool valid = true;
+    while ((opt = getopt(argc, argv, "l:t:a:x:T:n:s:")) != -1) {
+        switch (opt) {
+        case 'l':
+            valid &= parse_dist(&config->delay, optarg);
+            break;
+        case 't':
+            valid &= parse_dist(&config->ttl, optarg);
+            break;
+        case 'a':
+            valid &= parse_dist(&config->answers, optarg);
+            break;
+        case 'x':
+            config->drop_percent = atof(optarg);
+            break;
+        case 'T':
+            config->truncate_percent = atof(optarg);
+            break;
+        case 'n':
+            config->nx_percent = atof(optarg);
+            break;
+        case 's':
+            config->seed = strtoul(optarg, NULL, 10);
+            if (config->seed == 0) {
+                config->seed = 1;  // the generator is stuck at 0
+            }
+            break;
+        default:
+            valid = false;
+        }
+    }
+    if (!valid || argc - optind < 1) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    config->port = argv[optind];
+}
+
+// Print the usage of the program `prog` to stderr
+void print_usage(char *prog) {
+    fprintf(stderr, "usage %s [-l dist] [-t dist] [-a dist] [-x percent] "
+                    "[-T percent]\n"
+                    "       [-n percent] [-s seed] port\n", prog);
+    fprintf(stderr, "  -l dist     delay before replying, in ms (default 0)\n");
+    fprintf(stderr, "  -t dist     TTL of the records, in seconds "
+                    "(default 300)\n");
+    fprintf(stderr, "  -a dist     number of answers to A and AAAA queries "
+                    "(default 1)\n");
+    fprintf(stderr, "  -x percent  drop this percentage of queries\n");
+    fprintf(stderr, "  -T percent  truncate this percentage of UDP replies\n");
+    fprintf(stderr, "  -n percent  this percentage of names do not exist\n");
+    fprintf(stderr, "  -s seed     seed of the random number generator\n");
+    fprintf(stderr, "  dist is N, fixed:N, uniform:MIN:MAX or exp:MEAN\n");
+}
+
+// Parses the distribution `spec` into `dist`, see dist_t. Returns false if
+// it is invalid.
+bool parse_dist(dist_t *dist, char *spec) {
+    double a, b;
+    char end;
+    if (sscanf(spec, "uniform:%lf:%lf%c", &a, &b, &end) == 2 && a <= b) {
+        dist->kind = DIST_UNIFORM;
+    } else if (sscanf(spec, "exp:%lf%c", &a, &end) == 1) {
+        dist->kind = DIST_EXP;
+    } else if (sscanf(spec, "fixed:%lf%c", &a, &end) == 1 ||
+               sscanf(spec, "%lf%c", &a, &end) == 1) {
+        dist->kind = DIST_FIXED;
+    } else {
+        return false;
+    }
+    dist->a = a;
+    dist->b = dist->kind == DIST_UNIFORM ? b : a;
+    return a >= 0;
+}
+
+// Returns a value drawn from `dist` with the generator of `fake`
+double draw(fake_upstream_t *fake, dist_t *dist) {
+    double u = next_random(&fake->random_state) / (UINT32_MAX + 1.0);
+    switch (dist->kind) {
+    case DIST_UNIFORM:
+        return dist->a + u * (dist->b - dist->a);
+    case DIST_EXP:
+        return -dist->a * log(1 - u);
+    default:
+        return dist->a;
+    }
+}
+
+// Returns true `percent`% of the time, with the generator of `fake`
+bool chance(fake_upstream_t *fake, double percent) {
+    return percent > 0 &&
+           next_random(&fake->random_state) / (UINT32_MAX + 1.0) * 100 <
+               percent;
+}
+
+// Frees the sockets and buffers of `fake`, dropping the replies still
+// delayed
+void free_fake_upstream(fake_upstream_t *fake) {
+    while (fake->ndelayed > 0) {
+        delayed_reply_t *reply = pop_delayed(fake);
+        if (reply->client) {
+            conn_unref(reply->client);
+        }
+        free(reply);
+    }
+    free(fake->delayed);
+    free(fake->reply_buf);
+    close(fake->listener.fd);
+    free_udp_socket(fake->udp);
+    conn_loop_free_closed(&fake->loop);
+    close(fake->loop.epfd);
+}
+
+// Runs the event loop of `fake` until it is stopped
+void run_fake_upstream(fake_upstream_t *fake) {
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        int nevents = epoll_wait(fake->loop.epfd, events, MAX_EVENTS,
+                                 next_timeout(fake, get_time_us()));
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < nevents; i++) {
+            fd_kind_t *kind = events[i].data.ptr;
+            switch (*kind) {
+            case FD_LISTENER:
+                accept_clients(fake);
+                break;
+            case FD_CLIENT:
+                handle_client_event(fake, events[i].data.ptr);
+                break;
+            case FD_UDP:
+                handle_udp_event(fake);
+                break;
+            default:
+                break;
+            }
+        }
+        send_due(fake, get_time_us());
+        udp_flush(fake->udp);
+        conn_loop_free_closed(&fake->loop);
+    }
+}
+
+// Accepts every client connection queued up for the listening socket
+void accept_clients(fake_upstream_t *fake) {
+    int sockfd;
+    while ((sockfd = accept_client_connection(fake->listener.fd)) >= 0) {
+        new_conn(sockfd, &fake->loop, FD_CLIENT, CONN_OPEN);
+    }
+}
+
+// Advances the connection `client`: writes the replies queued up, and reads
+// and handles queries, closing it once it hung up and is done with
+void handle_client_event(fake_upstream_t *fake, conn_t *client) {
+    if (client->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn_write(client) == CONN_IO_ERROR) {
+        conn_close(client);
+        return;
+    }
+    conn_io_t status;
+    do {
+        status = conn_read(client);
+        uint8_t *query;
+        uint16_t len;
+        while (conn_next_message(client, &query, &len)) {
+            uint16_t reply_len = handle_query(fake, query, len, false);
+            if (reply_len > 0) {
+                send_or_delay(fake, client, NULL, 0, reply_len);
+            }
+        }
+    } while (status == CONN_IO_DONE && client->state == CONN_OPEN);
+    if (status == CONN_IO_ERROR) {
+        conn_close(client);
+    }
+    close_client_if_done(client);
+}
+
+// Closes `client` once it hung up, and every reply to it was sent
+void close_client_if_done(conn_t *client) {
+    if (client->eof && client->refs == 0 && conn_is_idle(client)) {
+        conn_close(client);
+    }
+}
+
+// Handles a batch of datagrams received by the UDP socket of `fake`, each a
+// query
+void handle_udp_event(fake_upstream_t *fake) {
+    udp_batch_t *batch = &fake->udp->recvd;
+    int nrecvd = udp_recv_batch(fake->udp);
+    for (int i = 0; i < nrecvd; i++) {
+        if (udp_truncated(batch, i)) {
+            continue;
+        }
+        uint16_t reply_len = handle_query(fake, batch->bufs[i],
+                                          batch->msgs[i].msg_len, true);
+        if (reply_len > 0) {
+            send_or_delay(fake, NULL, &batch->addrs[i],
+                          batch->msgs[i].msg_hdr.msg_namelen, reply_len);
+        }
+    }
+}
+
+// Puts together the reply to the query `query` of length `len` in the
+// reply buffer of `fake`, from the synthetic zone. Over UDP, replies larger
+// than the client accepts, and some others at random, are truncated.
+// Returns the length of the reply, or 0 if the query is malformed or
+// dropped.
+uint16_t handle_query(fake_upstream_t *fake, uint8_t *query, uint16_t len,
+                      bool over_udp) {
+    fake->counts.queries++;
+    dns_message_t msg;
+    if (!init_dns_message(&msg, query, len) || msg.qr ||
+        chance(fake, fake->config.drop_percent)) {
+        fake->counts.dropped++;
+        return 0;
+    }
+    uint8_t *reply = fake->reply_buf;
+    uint16_t reply_len;
+    if (msg.qdcount != 1 || msg.opcode != QUERY_OPCODE) {
+        reply_len = make_error_reply(&msg, NOT_IMPLEMENTED_RCODE, reply);
+    } else {
+        reply_len = make_answers(fake, &msg, reply, MAX_MESSAGE_SIZE);
+    }
+
+    if (over_udp &&
+        ((reply_len > UDP_MIN_SIZE &&
+          reply_len > get_udp_payload_size(&msg, UDP_MIN_SIZE,
+                                            UDP_MAX_SIZE)) ||
+         chance(fake, fake->config.truncate_percent))) {
+        reply_len = truncate_reply(reply, reply_len);
+        fake->counts.truncated++;
+    }
+    return reply_len;
+}
+
+// Puts together in `reply` the reply to the query `msg`, with one question,
+// from the synthetic zone, in at most `max_size` bytes: made-up addresses
+// for A and AAAA queries (as many as drawn, those that fit), no data for
+// other types or if none are drawn, or a name error for a share of names.
+// Negative replies have the zone's SOA record. Returns the length of the
+// reply.
+uint16_t make_answers(fake_upstream_t *fake, dns_message_t *msg,
+                      uint8_t *reply, uint16_t max_size) {
+    char name[MAX_NAME_SIZE];
+    get_name(msg->data, msg->size, msg->question.qname.offset, name);
+    uint32_t hash = hash_name(name);
+    uint32_t ttl = draw(fake, &fake->config.ttl);
+
+    // whether a name exists is up to the name alone, so it stays the same
+    bool exists = (hash % 10000) / 100.0 >= fake->config.nx_percent;
+    uint16_t qtype = msg->question.qtype;
+    int nanswers = 0;
+    if (exists && (qtype == AAAA_RR_TYPE || qtype == A_RR_TYPE)) {
+        nanswers = draw(fake, &fake->config.answers);
+        nanswers = nanswers > MAX_ANSWERS ? MAX_ANSWERS : nanswers;
+    }
+    uint16_t len =
+        make_reply(msg, exists ? NO_ERROR_RCODE : NAME_ERROR_RCODE, reply);
+    int ncount = 0;
+    for (; ncount < nanswers; ncount++) {
+        // 2001:db8::/32 (documentation) for IPv6, 198.18.0.0/15
+        // (benchmarking) for IPv4, then the hash of the name and the index
+        uint8_t rdata[16] = {0x20, 0x01, 0x0d, 0xb8};
+        uint32_t net_hash = htonl(hash);
+        uint16_t rdlen = 16;
+        memcpy(rdata + 8, &net_hash, sizeof(net_hash));
+        rdata[15] = ncount;
+        if (qtype == A_RR_TYPE) {
+            rdata[0] = 198;
+            rdata[1] = 18 + (hash & 1);
+            rdata[2] = hash >> 8;
+            rdata[3] = ncount;
+            rdlen = 4;
+        }
+        uint16_t new_len = add_record(reply, len, max_size, HEADER_SIZE,
+                                      qtype, ttl, rdata, rdlen);
+        if (new_len == 0) {
+            break;  // no room for more
+        }
+        len = new_len;
+    }
+    if (ncount > 0) {
+        set_record_counts(reply, ncount, 0, 0);
+        return len;
+    }
+    uint16_t soa_len = add_soa(reply, len, max_size, ttl);
+    if (soa_len > 0) {
+        set_record_counts(reply, 0, 1, 0);
+        len = soa_len;
+    }
+    return len;
+}
+
+// Appends the zone's SOA record, owned by the name queried, with TTL (and
+// negative caching TTL) `ttl`, to the reply `reply` of length `len` if it
+// fits in `max_size` bytes. Returns the new length of the reply, or 0 if it
+// does not fit.
+uint16_t add_soa(uint8_t *reply, uint16_t len, uint16_t max_size,
+                 uint32_t ttl) {
+    uint8_t rdata[sizeof(SOA_NAMES) + 5 * sizeof(uint32_t)];
+    uint32_t timers[] = {htonl(1), htonl(SOA_REFRESH), htonl(SOA_RETRY),
+                         htonl(SOA_EXPIRE), htonl(ttl)};
+    memcpy(rdata, SOA_NAMES, sizeof(SOA_NAMES));
+    memcpy(rdata + sizeof(SOA_NAMES), timers, sizeof(timers));
+    return add_record(reply, len, max_size, HEADER_SIZE, SOA_RR_TYPE, ttl,
+                      rdata, sizeof(rdata));
+}
+
+// Returns the (FNV-1a) hash of the domain name `name`, ignoring case
+uint32_t hash_name(char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (uint8_t)tolower((unsigned char)*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Sends the reply of length `len` in the reply buffer of `fake` to `client`
+// over TCP, or to the address `addr` of length `addrlen` over UDP, once a
+// delay drawn for it is up
+void send_or_delay(fake_upstream_t *fake, conn_t *client,
+                   struct sockaddr_storage *addr, socklen_t addrlen,
+                   uint16_t len) {
+    uint64_t delay = draw(fake, &fake->config.delay) * 1000;
+    if (delay == 0) {
+        send_fake_reply(fake, client, addr, addrlen, fake->reply_buf, len);
+        return;
+    }
+    delayed_reply_t *reply = malloc(sizeof(*reply) + len);
+    assert(reply);
+    reply->due_time = get_time_us() + delay;
+    reply->client = client;
+    if (client) {
+        conn_ref(client);
+    } else {
+        memcpy(&reply->addr, addr, addrlen);
+    }
+    reply->addrlen = addrlen;
+    reply->len = len;
+    memcpy(reply->data, fake->reply_buf, len);
+    push_delayed(fake, reply);
+}
+
+// Sends the reply `reply` of length `len` to `client` over TCP, unless it
+// hung up, or to the address `addr` of length `addrlen` over UDP
+void send_fake_reply(fake_upstream_t *fake, conn_t *client,
+                     struct sockaddr_storage *addr, socklen_t addrlen,
+                     uint8_t *reply, uint16_t len) {
+    fake->counts.replies++;
+    if (!client) {
+        udp_send(fake->udp, addr, addrlen, reply, len);
+        return;
+    }
+    if (client->state == CONN_OPEN) {
+        conn_send(client, reply, len);
+        if (conn_write(client) == CONN_IO_ERROR) {
+            conn_close(client);
+        }
+    }
+}
+
+// Returns how long `fake` may wait for events from the time `now`, in µs,
+// before it has a reply to send, in ms (rounded up), or -1 if it has none
+int next_timeout(fake_upstream_t *fake, uint64_t now) {
+    if (fake->ndelayed == 0) {
+        return -1;
+    }
+    uint64_t due_time = fake->delayed[0]->due_time;
+    return due_time > now ? (due_time - now + 999) / 1000 : 0;
+}
+
+// Sends every delayed reply of `fake` that is due by the time `now`, in µs
+void send_due(fake_upstream_t *fake, uint64_t now) {
+    while (fake->ndelayed > 0 && fake->delayed[0]->due_time <= now) {
+        delayed_reply_t *reply = pop_delayed(fake);
+        send_fake_reply(fake, reply->client, &reply->addr, reply->addrlen,
+                        reply->data, reply->len);
+        if (reply->client) {
+            conn_unref(reply->client);
+            close_client_if_done(reply->client);
+        }
+        free(reply);
+    }
+}
+
+// Adds `reply` to the heap of delayed replies of `fake`
+void push_delayed(fake_upstream_t *fake, delayed_reply_t *reply) {
+    if (fake->ndelayed == fake->delayed_cap) {
+        fake->delayed_cap *= 2;
+        fake->delayed = realloc(fake->delayed,
+                                fake->delayed_cap * sizeof(*fake->delayed));
+        assert(fake->delayed);
+    }
+    // sift up from the end
+    size_t i = fake->ndelayed++;
+    while (i > 0 && fake->delayed[(i - 1) / 2]->due_time > reply->due_time) {
+        fake->delayed[i] = fake->delayed[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    fake->delayed[i] = reply;
+}
+
+// Removes and returns the delayed reply of `fake` due first. There must be
+// one.
+delayed_reply_t *pop_delayed(fake_upstream_t *fake) {
+    delayed_reply_t *first = fake->delayed[0];
+    delayed_reply_t *last = fake->delayed[--fake->ndelayed];
+    // sift the last one down from the top
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= fake->ndelayed) {
+            break;
+        }
+        if (child + 1 < fake->ndelayed &&
+            fake->delayed[child + 1]->due_time <
+                fake->delayed[child]->due_time) {
+            child++;
+        }
+        if (fake->delayed[child]->due_time >= last->due_time) {
+            break;
+        }
+        fake->delayed[i] = fake->delayed[child];
+        i = child;
+    }
+    fake->delayed[i] = last;
+    return first;
+}
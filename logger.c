@@ -0,0 +1,259 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Logger module containing functions for logging the events of the DNS
+ * server without holding up the threads serving requests. Each event is
+ * pushed, as a fixed-size binary record, into a lock-free ring, and a
+ * background thread formats and writes them to the log file in batches,
+ * flushing once per batch. If the ring is full, events are dropped and
+ * counted rather than waited on.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include "logger.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// how long the logger's thread sleeps when there is nothing to write, in ms
+#define LOGGER_IDLE_MS 10
+
+void *logger_thread(void *arg);
+size_t logger_drain(logger_t *logger);
+void write_event(logger_t *logger, log_event_t *event);
+char *get_event_timestamp(logger_t *logger, time_t time);
+
+log_event_t *begin_event(logger_t *logger, log_kind_t kind, size_t *pos);
+void end_event(logger_t *logger, size_t pos);
+
+// Creates and returns a new logger writing to `fp`, and starts its thread.
+// Exits if error.
+logger_t *new_logger(FILE *fp) {
+    logger_t *logger = malloc(sizeof(*logger));
+    assert(logger);
+    logger->slots = malloc(LOGGER_RING_SIZE * sizeof(*logger->slots));
+    assert(logger->slots);
+
+    logger->fp = fp;
+    for (size_t i = 0; i < LOGGER_RING_SIZE; i++) {
+        atomic_init(&logger->slots[i].seq, i);
+    }
+    atomic_init(&logger->push_pos, 0);
+    logger->pop_pos = 0;
+    atomic_init(&logger->stopping, false);
+    atomic_init(&logger->ndropped, 0);
+    logger->ndropped_logged = 0;
+    logger->timestamp_time = -1;
+
+    if (pthread_create(&logger->thread, NULL, logger_thread, logger) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    return logger;
+}
+
+// Stops the thread of `logger`, once it has written every event pushed, and
+// frees the logger. The file it writes to is left open.
+void free_logger(logger_t *logger) {
+    atomic_store(&logger->stopping, true);
+    pthread_join(logger->thread, NULL);
+    free(logger->slots);
+    free(logger);
+}
+
+// The thread of a logger `arg`: writes the events in its ring as they come,
+// in batches, until it is stopped and there are none left
+void *logger_thread(void *arg) {
+    logger_t *logger = arg;
+    struct timespec idle = {.tv_sec = 0,
+                            .tv_nsec = LOGGER_IDLE_MS * 1000 * 1000};
+    while (true) {
+        // read before draining, so no event pushed before stopping is missed
+        bool stopping = atomic_load(&logger->stopping);
+        if (logger_drain(logger) == 0) {
+            if (stopping) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Writes every event in the ring of `logger`, along with how many events
+// were dropped since last time, if any, then flushes the log file. Returns
+// the number of events written.
+size_t logger_drain(logger_t *logger) {
+    size_t nwritten = 0;
+    while (true) {
+        log_slot_t *slot =
+            &logger->slots[logger->pop_pos & (LOGGER_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != logger->pop_pos + 1) {
+            break;  // the next event is not pushed yet
+        }
+        write_event(logger, &slot->event);
+        // the slot is free for the push a lap of the ring later
+        atomic_store_explicit(&slot->seq, logger->pop_pos + LOGGER_RING_SIZE,
+                              memory_order_release);
+        logger->pop_pos++;
+        nwritten++;
+    }
+
+    size_t ndropped = atomic_load(&logger->ndropped);
+    if (ndropped != logger->ndropped_logged) {
+        fprintf(logger->fp, "%s dropped %zu log events\n",
+                get_event_timestamp(logger, time(NULL)),
+                ndropped - logger->ndropped_logged);
+        logger->ndropped_logged = ndropped;
+        nwritten++;
+    }
+    if (nwritten > 0) {
+        fflush(logger->fp);
+    }
+    return nwritten;
+}
+
+// Formats the event `event` and writes it to the log file of `logger`
+void write_event(logger_t *logger, log_event_t *event) {
+    char *timestamp = get_event_timestamp(logger, event->time);
+    switch (event->kind) {
+    case LOG_QUERY:
+        fprintf(logger->fp, "%s requested %s\n", timestamp, event->name);
+        break;
+    case LOG_UNIMPLEMENTED:
+        fprintf(logger->fp, "%s unimplemented request\n", timestamp);
+        break;
+    case LOG_ANSWER: {
+        char addr[INET6_ADDRSTRLEN];
+        if (!event->has_addr ||
+            !inet_ntop(AF_INET6, event->addr, addr, sizeof(addr))) {
+            strcpy(addr, "?");
+        }
+        fprintf(logger->fp, "%s %s is at %s\n", timestamp, event->name, addr);
+        break;
+    }
+    case LOG_CACHED: {
+        char expiry[TIMESTAMP_LEN];
+        format_timestamp(expiry, TIMESTAMP_LEN, event->expiry_time);
+        fprintf(logger->fp, "%s %s expires at %s\n", timestamp, event->name,
+                expiry);
+        break;
+    }
+    case LOG_EVICTED:
+        fprintf(logger->fp, "%s replacing %s by %s\n", timestamp,
+                event->evicted_name, event->name);
+        break;
+    }
+}
+
+// Returns the timestamp of the time `time`, formatted only if it is not the
+// same second as that of the last event written by `logger`
+char *get_event_timestamp(logger_t *logger, time_t time) {
+    if (time != logger->timestamp_time) {
+        format_timestamp(logger->timestamp, TIMESTAMP_LEN, time);
+        logger->timestamp_time = time;
+    }
+    return logger->timestamp;
+}
+
+// Claims the next slot of the ring of `logger` for an event of kind `kind`
+// happening now, returning the event to fill in, and its position in `pos`
+// to pass to end_event(). Returns NULL, counting the event as dropped, if
+// the ring is full.
+log_event_t *begin_event(logger_t *logger, log_kind_t kind, size_t *pos) {
+    size_t push_pos = atomic_load_explicit(&logger->push_pos,
+                                           memory_order_relaxed);
+    while (true) {
+        log_slot_t *slot = &logger->slots[push_pos & (LOGGER_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == push_pos) {
+            // the slot is free: claim it, unless another thread just did
+            if (atomic_compare_exchange_weak_explicit(
+                    &logger->push_pos, &push_pos, push_pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *pos = push_pos;
+                slot->event.kind = kind;
+                slot->event.time = time(NULL);
+                return &slot->event;
+            }
+        } else if (seq < push_pos) {
+            // the slot is still to be popped a lap of the ring ago: full
+            atomic_fetch_add_explicit(&logger->ndropped, 1,
+                                      memory_order_relaxed);
+            return NULL;
+        } else {
+            push_pos = atomic_load_explicit(&logger->push_pos,
+                                            memory_order_relaxed);
+        }
+    }
+}
+
+// Hands the event claimed at position `pos` of the ring of `logger`, filled
+// in, over to the logger's thread
+void end_event(logger_t *logger, size_t pos) {
+    log_slot_t *slot = &logger->slots[pos & (LOGGER_RING_SIZE - 1)];
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// Log with `logger` that the name `name` was requested
+void log_query(logger_t *logger, char *name) {
+    size_t pos;
+    log_event_t *event = begin_event(logger, LOG_QUERY, &pos);
+    if (event) {
+        strcpy(event->name, name);
+        end_event(logger, pos);
+    }
+}
+
+// Log with `logger` that a query was detected as unimplemented by this
+// server
+void log_unimplemented(logger_t *logger) {
+    size_t pos;
+    if (begin_event(logger, LOG_UNIMPLEMENTED, &pos)) {
+        end_event(logger, pos);
+    }
+}
+
+// Log with `logger` that the resource record `answer` for the name `name`,
+// of the message `data`, is to be returned by this server
+void log_answer(logger_t *logger, char *name, uint8_t *data,
+                record_t *answer) {
+    size_t pos;
+    log_event_t *event = begin_event(logger, LOG_ANSWER, &pos);
+    if (event) {
+        strcpy(event->name, name);
+        event->has_addr = answer->rdlen == sizeof(event->addr);
+        if (event->has_addr) {
+            memcpy(event->addr, data + answer->rdata, sizeof(event->addr));
+        }
+        end_event(logger, pos);
+    }
+}
+
+// Log with `logger` that a reply to the name `name` being requested was
+// found in the cache of this server, expiring at `expiry_time`
+void log_cached(logger_t *logger, char *name, time_t expiry_time) {
+    size_t pos;
+    log_event_t *event = begin_event(logger, LOG_CACHED, &pos);
+    if (event) {
+        strcpy(event->name, name);
+        event->expiry_time = expiry_time;
+        end_event(logger, pos);
+    }
+}
+
+// Log with `logger` that a reply to the name `name` replaced the cache entry
+// `evicted` in this server's cache
+void log_evicted(logger_t *logger, char *name, cache_entry_t *evicted) {
+    size_t pos;
+    log_event_t *event = begin_event(logger, LOG_EVICTED, &pos);
+    if (event) {
+        strcpy(event->name, name);
+        cache_entry_name(evicted, event->evicted_name);
+        end_event(logger, pos);
+    }
+}
@@ -0,0 +1,89 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Logger module containing functions for logging the events of the DNS
+ * server without holding up the threads serving requests. Each event is
+ * pushed, as a fixed-size binary record, into a lock-free ring, and a
+ * background thread formats and writes them to the log file in batches,
+ * flushing once per batch. If the ring is full, events are dropped and
+ * counted rather than waited on.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "cache_entry.h"
+#include "dns_message.h"
+#include "util.h"
+
+// the number of events the ring holds, a power of 2
+#define LOGGER_RING_SIZE 4096
+
+// The kinds of events logged
+typedef enum {
+    LOG_QUERY,
+    LOG_UNIMPLEMENTED,
+    LOG_ANSWER,
+    LOG_CACHED,
+    LOG_EVICTED
+} log_kind_t;
+
+// An event to log, as it is pushed into the ring: only what it takes to
+// format it later, with the time it happened. Which fields are set depends
+// on its kind.
+typedef struct {
+    log_kind_t kind;
+    time_t time;
+    time_t expiry_time;  // LOG_CACHED
+    bool has_addr;  // LOG_ANSWER: whether the RDATA is an IPv6 address
+    uint8_t addr[sizeof(struct in6_addr)];
+    char name[MAX_NAME_SIZE];
+    char evicted_name[MAX_NAME_SIZE];  // LOG_EVICTED
+} log_event_t;
+
+// A slot of the ring. Its sequence number tells whose turn it is: it is free
+// for the push at the same position, and full for the pop one position
+// before it.
+typedef struct {
+    atomic_size_t seq;
+    log_event_t event;
+} log_slot_t;
+
+// A logger, writing the events pushed into its ring to `fp` from its own
+// thread. Any number of threads may push events at once; only the logger's
+// thread pops them.
+typedef struct {
+    FILE *fp;
+    pthread_t thread;
+    log_slot_t *slots;
+    atomic_size_t push_pos;
+    size_t pop_pos;
+    atomic_bool stopping;
+    atomic_size_t ndropped;
+    size_t ndropped_logged;
+
+    // the timestamp of the last event written, reused within the same second
+    time_t timestamp_time;
+    char timestamp[TIMESTAMP_LEN];
+} logger_t;
+
+logger_t *new_logger(FILE *fp);
+void free_logger(logger_t *logger);
+
+void log_query(logger_t *logger, char *name);
+void log_unimplemented(logger_t *logger);
+void log_answer(logger_t *logger, char *name, uint8_t *data,
+                record_t *answer);
+void log_cached(logger_t *logger, char *name, time_t expiry_time);
+void log_evicted(logger_t *logger, char *name, cache_entry_t *evicted);
+
+#endif
@@ -0,0 +1,325 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Metrics module containing functions for counting the events of the DNS
+ * server, and keeping histograms of its latencies, along with a stats server
+ * exporting them over a local UNIX socket, in the Prometheus text format.
+ * Each worker has its own metrics, only ever written by its own thread, so
+ * counting takes no lock nor atomic read-modify-write; the stats server sums
+ * them up when they are asked for.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include "metrics.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// maximum number of stats clients to be queued up
+#define STATS_QUEUE_SIZE 16
+
+// The name and help text of each counter, as exported
+static const char *counter_names[NUM_COUNTERS][2] = {
+    [METRIC_QUERIES] = {"dns_queries_total",
+                        "Queries received from clients."},
+    [METRIC_CACHE_HITS] = {"dns_cache_hits_total",
+                           "Queries replied to from the cache."},
+    [METRIC_CACHE_MISSES] = {"dns_cache_misses_total",
+                             "Queries the cache had no reply to."},
+    [METRIC_EVICTIONS] = {"dns_cache_evictions_total",
+                          "Cache entries evicted to make room."},
+    [METRIC_UNIMPLEMENTED] = {"dns_unimplemented_total",
+                              "Queries replied to as not implemented."},
+    [METRIC_FORWARDED] = {"dns_upstream_queries_total",
+                          "Queries forwarded upstream."},
+    [METRIC_COALESCED] = {"dns_coalesced_total",
+                          "Queries waiting on an identical one upstream."},
+    [METRIC_REFRESHES] = {"dns_cache_refreshes_total",
+                          "Cache entries refreshed ahead of their expiry."},
+    [METRIC_STALE] = {"dns_stale_replies_total",
+                      "Queries replied to with an expired reply."},
+    [METRIC_UPSTREAM_FAILURES] = {"dns_upstream_failures_total",
+                                  "Queries upstream failed to reply to."},
+};
+
+// The name and help text of each histogram, as exported
+static const char *histogram_names[NUM_HISTOGRAMS][2] = {
+    [HIST_RESPONSE] = {"dns_response_seconds",
+                       "Time from receiving a query to replying to it."},
+    [HIST_UPSTREAM_RTT] = {"dns_upstream_rtt_seconds",
+                           "Time from sending a query upstream to its "
+                           "reply."},
+    [HIST_UPSTREAM_CONNECT] = {"dns_upstream_connect_seconds",
+                               "Time to open a TCP connection to upstream."},
+};
+
+// The upper bounds of the buckets histograms are exported with, in µs: the
+// buckets kept are summed up into these
+static const uint64_t export_bounds[] = {
+    50,     100,    250,     500,     1000,    2500,    5000,    10000,
+    25000,  50000,  100000,  250000,  500000,  1000000, 2500000, 5000000,
+    10000000};
+
+void add_relaxed(atomic_uint_fast64_t *value, uint64_t n);
+uint64_t load_relaxed(atomic_uint_fast64_t *value);
+size_t get_bucket(uint64_t usecs);
+uint64_t get_bucket_max(size_t i);
+void write_histogram(FILE *fp, histogram_kind_t kind, metrics_t **metrics,
+                     int nmetrics);
+
+void *stats_thread(void *arg);
+
+// Initialises `histogram`, with nothing recorded
+void init_histogram(histogram_t *histogram) {
+    for (size_t i = 0; i < HIST_NBUCKETS; i++) {
+        atomic_init(&histogram->buckets[i], 0);
+    }
+    atomic_init(&histogram->sum, 0);
+}
+
+// Records a latency of `usecs` µs in `histogram`. Only to be called by the
+// thread owning `histogram`.
+void histogram_record(histogram_t *histogram, uint64_t usecs) {
+    add_relaxed(&histogram->buckets[get_bucket(usecs)], 1);
+    add_relaxed(&histogram->sum, usecs);
+}
+
+// Returns the number of latencies recorded in `histogram`
+uint64_t histogram_count(histogram_t *histogram) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < HIST_NBUCKETS; i++) {
+        count += load_relaxed(&histogram->buckets[i]);
+    }
+    return count;
+}
+
+// Returns the latency, in µs, that `percent`% of those recorded in
+// `histogram` are at most (the largest of its bucket), or 0 if there are
+// none
+uint64_t histogram_percentile(histogram_t *histogram, double percent) {
+    uint64_t count = histogram_count(histogram);
+    if (count == 0) {
+        return 0;
+    }
+    // the rank of the latency, from 1, rounded up
+    double exact_rank = count * percent / 100;
+    uint64_t rank = exact_rank;
+    if (rank < exact_rank || rank == 0) {
+        rank++;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_NBUCKETS; i++) {
+        seen += load_relaxed(&histogram->buckets[i]);
+        if (seen >= rank) {
+            return get_bucket_max(i);
+        }
+    }
+    return get_bucket_max(HIST_NBUCKETS - 1);
+}
+
+// Initialises `metrics`, with every count at 0
+void init_metrics(metrics_t *metrics) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        atomic_init(&metrics->counters[i], 0);
+    }
+    for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+        init_histogram(&metrics->histograms[i]);
+    }
+}
+
+// Counts one event of kind `kind` in `metrics`. Only to be called by the
+// thread owning `metrics`.
+void metrics_count(metrics_t *metrics, counter_kind_t kind) {
+    add_relaxed(&metrics->counters[kind], 1);
+}
+
+// Records a latency of `usecs` µs in the histogram of kind `kind` of
+// `metrics`. Only to be called by the thread owning `metrics`.
+void metrics_record(metrics_t *metrics, histogram_kind_t kind,
+                    uint64_t usecs) {
+    histogram_record(&metrics->histograms[kind], usecs);
+}
+
+// Adds `n` to `value`, which only the calling thread writes: a plain load and
+// store, rather than an atomic read-modify-write, which other threads reading
+// it see one or the other side of
+void add_relaxed(atomic_uint_fast64_t *value, uint64_t n) {
+    atomic_store_explicit(
+        value, atomic_load_explicit(value, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+// Returns `value`, which another thread may be writing
+uint64_t load_relaxed(atomic_uint_fast64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+// Returns the index of the bucket of a histogram the latency `usecs` falls in
+// (the last one if it is beyond every bucket)
+size_t get_bucket(uint64_t usecs) {
+    if (usecs < HIST_LINEAR) {
+        return usecs;
+    }
+    int msb = 63 - __builtin_clzll(usecs);
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_NBUCKETS - 1;
+    }
+    // the HIST_SUB_BITS + 1 top bits: the top one, then the sub-bucket
+    int shift = msb - HIST_SUB_BITS;
+    return HIST_LINEAR + (shift - 1) * HIST_SUB +
+           ((usecs >> shift) - HIST_SUB);
+}
+
+// Returns the largest latency that falls in the bucket at index `i` of a
+// histogram, in µs
+uint64_t get_bucket_max(size_t i) {
+    if (i < HIST_LINEAR) {
+        return i;
+    }
+    int shift = (i - HIST_LINEAR) / HIST_SUB + 1;
+    uint64_t sub = (i - HIST_LINEAR) % HIST_SUB + HIST_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+// Writes the sum of the metrics `metrics` of `nmetrics` workers to `fp`, in
+// the Prometheus text format
+void write_metrics(FILE *fp, metrics_t **metrics, int nmetrics) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        uint64_t total = 0;
+        for (int j = 0; j < nmetrics; j++) {
+            total += load_relaxed(&metrics[j]->counters[i]);
+        }
+        fprintf(fp, "# HELP %s %s\n", counter_names[i][0],
+                counter_names[i][1]);
+        fprintf(fp, "# TYPE %s counter\n", counter_names[i][0]);
+        fprintf(fp, "%s %llu\n", counter_names[i][0],
+                (unsigned long long)total);
+    }
+    for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+        write_histogram(fp, i, metrics, nmetrics);
+    }
+}
+
+// Writes the sum of the histograms of kind `kind` of the metrics `metrics`
+// of `nmetrics` workers to `fp`, as a Prometheus histogram in seconds. Its
+// count is that of its buckets, so it adds up even while being written to.
+void write_histogram(FILE *fp, histogram_kind_t kind, metrics_t **metrics,
+                     int nmetrics) {
+    const char *name = histogram_names[kind][0];
+    fprintf(fp, "# HELP %s %s\n", name, histogram_names[kind][1]);
+    fprintf(fp, "# TYPE %s histogram\n", name);
+
+    uint64_t count = 0, sum = 0;
+    size_t nbounds = sizeof(export_bounds) / sizeof(*export_bounds);
+    size_t bound = 0;
+    for (size_t i = 0; i < HIST_NBUCKETS; i++) {
+        // the buckets kept are in order, so each export bound is reached
+        // once every bucket below it is counted
+        for (; bound < nbounds && get_bucket_max(i) > export_bounds[bound];
+             bound++) {
+            fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", name,
+                    export_bounds[bound] / 1e6, (unsigned long long)count);
+        }
+        for (int j = 0; j < nmetrics; j++) {
+            count += load_relaxed(&metrics[j]->histograms[kind].buckets[i]);
+        }
+    }
+    for (; bound < nbounds; bound++) {
+        fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", name,
+                export_bounds[bound] / 1e6, (unsigned long long)count);
+    }
+    for (int j = 0; j < nmetrics; j++) {
+        sum += load_relaxed(&metrics[j]->histograms[kind].sum);
+    }
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+            (unsigned long long)count);
+    fprintf(fp, "%s_sum %.6f\n", name, sum / 1e6);
+    fprintf(fp, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+// Creates and returns a new stats server listening on the UNIX socket at
+// `path` (replacing whatever is there), exporting the metrics `metrics` of
+// `nmetrics` workers, and starts its thread. Exits if error.
+stats_server_t *new_stats_server(const char *path, metrics_t **metrics,
+                                 int nmetrics) {
+    stats_server_t *server = malloc(sizeof(*server));
+    assert(server);
+    server->path = malloc(strlen(path) + 1);
+    assert(server->path);
+    strcpy(server->path, path);
+    server->metrics = metrics;
+    server->nmetrics = nmetrics;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "stats socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    // a socket left over from a previous run would make bind() fail
+    unlink(path);
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(server->fd, STATS_QUEUE_SIZE) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    int status = pthread_create(&server->thread, NULL, stats_thread, server);
+    if (status != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(status));
+        exit(EXIT_FAILURE);
+    }
+    return server;
+}
+
+// Stops the thread of `server`, and frees it, removing its socket
+void free_stats_server(stats_server_t *server) {
+    // wakes the thread up from accept()
+    shutdown(server->fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    unlink(server->path);
+    free(server->path);
+    free(server);
+}
+
+// The thread of a stats server `arg`: writes the metrics to each client
+// connecting, one at a time, until its socket is shut down
+void *stats_thread(void *arg) {
+    stats_server_t *server = arg;
+    while (true) {
+        int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        FILE *fp = fdopen(fd, "w");
+        if (!fp) {
+            close(fd);
+            continue;
+        }
+        write_metrics(fp, server->metrics, server->nmetrics);
+        fclose(fp);
+    }
+    return NULL;
+}
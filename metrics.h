@@ -0,0 +1,93 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Metrics module containing functions for counting the events of the DNS
+ * server, and keeping histograms of its latencies, along with a stats server
+ * exporting them over a local UNIX socket, in the Prometheus text format.
+ * Each worker has its own metrics, only ever written by its own thread, so
+ * counting takes no lock nor atomic read-modify-write; the stats server sums
+ * them up when they are asked for.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Histograms are log-linear, as in HdrHistogram: values under HIST_LINEAR are
+// counted exactly, and each power of 2 above is split into HIST_SUB buckets,
+// so a value is known to within 1/HIST_SUB of it, up to 2^HIST_MAX_BITS µs
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB)
+#define HIST_MAX_BITS 40
+#define HIST_NBUCKETS \
+    (HIST_LINEAR + (HIST_MAX_BITS - HIST_SUB_BITS - 1) * HIST_SUB)
+
+// The events counted
+typedef enum {
+    METRIC_QUERIES,        // queries received from clients
+    METRIC_CACHE_HITS,     // queries replied to from the cache
+    METRIC_CACHE_MISSES,   // queries the cache had no reply to
+    METRIC_EVICTIONS,      // cache entries evicted to make room
+    METRIC_UNIMPLEMENTED,  // queries replied to with RCODE 4
+    METRIC_FORWARDED,      // queries forwarded upstream
+    METRIC_COALESCED,      // queries waiting on an identical one upstream
+    METRIC_REFRESHES,      // cache entries refreshed ahead of their expiry
+    METRIC_STALE,          // queries replied to with an expired reply
+    METRIC_UPSTREAM_FAILURES,  // queries upstream failed to reply to
+    NUM_COUNTERS
+} counter_kind_t;
+
+// The latencies kept histograms of
+typedef enum {
+    HIST_RESPONSE,          // from receiving a query to replying to it
+    HIST_UPSTREAM_RTT,      // from sending a query upstream to its reply
+    HIST_UPSTREAM_CONNECT,  // to open a TCP connection to upstream
+    NUM_HISTOGRAMS
+} histogram_kind_t;
+
+// A histogram of latencies in µs, with their sum
+typedef struct {
+    atomic_uint_fast64_t buckets[HIST_NBUCKETS];
+    atomic_uint_fast64_t sum;
+} histogram_t;
+
+// The metrics of one worker. Written only by the worker's thread, and read
+// by the stats server's.
+typedef struct {
+    atomic_uint_fast64_t counters[NUM_COUNTERS];
+    histogram_t histograms[NUM_HISTOGRAMS];
+} metrics_t;
+
+// A stats server, listening on a UNIX socket from its own thread: each
+// client connecting is written the sum of the metrics `metrics` of the
+// `nmetrics` workers, then hung up on
+typedef struct {
+    int fd;
+    char *path;
+    pthread_t thread;
+    metrics_t **metrics;
+    int nmetrics;
+} stats_server_t;
+
+void init_histogram(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t usecs);
+uint64_t histogram_count(histogram_t *histogram);
+uint64_t histogram_percentile(histogram_t *histogram, double percent);
+
+void init_metrics(metrics_t *metrics);
+void metrics_count(metrics_t *metrics, counter_kind_t kind);
+void metrics_record(metrics_t *metrics, histogram_kind_t kind,
+                    uint64_t usecs);
+void write_metrics(FILE *fp, metrics_t **metrics, int nmetrics);
+
+stats_server_t *new_stats_server(const char *path, metrics_t **metrics,
+                                 int nmetrics);
+void free_stats_server(stats_server_t *server);
+
+#endif
@@ -0,0 +1,521 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Microbenchmark program: times the building blocks of the DNS server on
+ * their own (parsing and putting together messages, the cache at a few
+ * sizes, what a request takes from its arena, and reading and writing
+ * fields), so that a change making one of
+ * them slower shows up before it is deployed. Run with `make bench`.
+ *
+ * Each benchmark runs for long enough to be timed, a few times over, and the
+ * fastest run is reported, as a line of tab-separated values: its name, the
+ * number of operations, nanoseconds, allocations (calls to malloc(), calloc()
+ * and realloc(), counted by wrapping them at link time) and instructions per
+ * operation. Instructions are counted by a perf counter, where the kernel
+ * allows it, and are "-" otherwise.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bytes.h"
+#include "cache.h"
+#include "dns_message.h"
+#include "util.h"
+#include "worker.h"
+
+// default time each run of a benchmark should take, in ms
+#define DEFAULT_RUN_MS 100
+// number of runs of each benchmark, of which the fastest is reported
+#define NUM_RUNS 5
+// the most a run's number of operations grows by, from one run to the next,
+// while finding how many it takes to run for long enough
+#define MAX_GROWTH 100
+// number of answers in the replies benchmarked
+#define NUM_ANSWERS 2
+// TTL of the replies cached, long enough not to expire during a benchmark
+#define CACHE_TTL 3600
+// number of fields read or written per operation of read16 and write16 (a
+// message's worth)
+#define NUM_FIELDS 256
+// size of the block of the arena evicted entries are copied into
+#define ARENA_SIZE 4096
+// the most bytes a reply benchmarked takes
+#define MAX_REPLY_SIZE \
+    (HEADER_SIZE + MAX_NAME_SIZE + 4 + NUM_ANSWERS * (12 + 16))
+
+// State set up for a benchmark: messages to parse and put together, or a
+// cache holding `nkeys` replies, along with `nkeys` * 2 replies and their
+// keys (the first `nkeys` in the cache, the others not)
+typedef struct {
+    uint8_t query[MAX_MESSAGE_SIZE];
+    uint16_t query_len;
+    uint8_t reply[MAX_MESSAGE_SIZE];
+    uint16_t reply_len;
+    uint8_t buf[MAX_MESSAGE_SIZE];
+
+    cache_t *cache;
+    cache_key_t *keys;
+    uint8_t *replies;  // of MAX_REPLY_SIZE bytes each
+    uint16_t *reply_lens;
+    size_t nkeys;
+    size_t *order;  // of the keys hit, shuffled
+    size_t next;
+    arena_t arena;
+} bench_state_t;
+
+// A benchmark: `run` performs `nops` operations on the state set up by
+// `setup` with `param`
+typedef struct {
+    char *name;
+    void (*setup)(bench_state_t *state, size_t param);
+    void (*run)(bench_state_t *state, uint64_t nops);
+    size_t param;
+} microbench_t;
+
+// What a run of a benchmark took
+typedef struct {
+    uint64_t nops;
+    uint64_t nsecs;
+    uint64_t nallocs;
+    int64_t instructions;  // -1 if they could not be counted
+} bench_result_t;
+
+void setup_messages(bench_state_t *state, size_t param);
+void setup_cache(bench_state_t *state, size_t nkeys);
+void setup_full_cache(bench_state_t *state, size_t nkeys);
+void setup_request_arena(bench_state_t *state, size_t query_len);
+void teardown(bench_state_t *state);
+uint16_t make_bench_reply(uint8_t *query, uint16_t len, uint8_t *reply);
+
+void run_read16(bench_state_t *state, uint64_t nops);
+void run_write16(bench_state_t *state, uint64_t nops);
+void run_parse_query(bench_state_t *state, uint64_t nops);
+void run_parse_reply(bench_state_t *state, uint64_t nops);
+void run_get_name(bench_state_t *state, uint64_t nops);
+void run_make_reply(bench_state_t *state, uint64_t nops);
+void run_make_error_reply(bench_state_t *state, uint64_t nops);
+void run_cache_get_hit(bench_state_t *state, uint64_t nops);
+void run_cache_get_miss(bench_state_t *state, uint64_t nops);
+void run_cache_put(bench_state_t *state, uint64_t nops);
+void run_request_arena(bench_state_t *state, uint64_t nops);
+
+void run_benchmark(microbench_t *bench, uint64_t run_nsecs, int counter);
+bench_result_t time_run(microbench_t *bench, bench_state_t *state,
+                        uint64_t nops, int counter);
+int open_instruction_counter(void);
+uint64_t get_time_ns(void);
+void keep(void *ptr);
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+// the benchmarks, in the order they run
+microbench_t benchmarks[] = {
+    {"read16", setup_messages, run_read16, 0},
+    {"write16", setup_messages, run_write16, 0},
+    {"init_dns_message/query", setup_messages, run_parse_query, 0},
+    {"init_dns_message+read_answers/reply", setup_messages, run_parse_reply,
+     0},
+    {"get_name", setup_messages, run_get_name, 0},
+    {"make_reply+add_record", setup_messages, run_make_reply, 0},
+    {"make_error_reply", setup_messages, run_make_error_reply, 0},
+    {"cache_get/hit/1024", setup_cache, run_cache_get_hit, 1024},
+    {"cache_get/hit/16384", setup_cache, run_cache_get_hit, 16384},
+    {"cache_get/hit/262144", setup_cache, run_cache_get_hit, 262144},
+    {"cache_get/miss/16384", setup_cache, run_cache_get_miss, 16384},
+    {"cache_put/evict/1024", setup_full_cache, run_cache_put, 1024},
+    {"cache_put/evict/16384", setup_full_cache, run_cache_put, 16384},
+    {"cache_put/evict/262144", setup_full_cache, run_cache_put, 262144},
+    {"request_arena/512", setup_request_arena, run_request_arena,
+     UDP_MIN_SIZE},
+    {"request_arena/4096", setup_request_arena, run_request_arena,
+     UDP_MAX_SIZE},
+};
+
+// number of calls to malloc(), calloc() and realloc() so far
+uint64_t nallocs = 0;
+
+// Runs the benchmarks whose names start with any of the arguments (all of
+// them, if none are given), each for about `-t ms` per run, and prints what
+// they took to stdout
+int main(int argc, char *argv[]) {
+    uint64_t run_ms = DEFAULT_RUN_MS;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't' || (run_ms = strtoull(optarg, NULL, 10)) == 0) {
+            fprintf(stderr, "usage %s [-t ms] [benchmark...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int counter = open_instruction_counter();
+    printf("benchmark\tops\tns/op\tallocs/op\tinstructions/op\n");
+    fflush(stdout);
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        bool selected = optind == argc;
+        for (int j = optind; j < argc; j++) {
+            selected |= strncmp(benchmarks[i].name, argv[j],
+                                strlen(argv[j])) == 0;
+        }
+        if (selected) {
+            run_benchmark(&benchmarks[i], run_ms * 1000000, counter);
+        }
+    }
+    if (counter >= 0) {
+        close(counter);
+    }
+    return 0;
+}
+
+// Runs `bench`: finds how many operations it takes to run for `run_nsecs`
+// ns, then runs that many NUM_RUNS times and prints the fastest run, with
+// its instructions counted by the perf counter `counter` (if not -1)
+void run_benchmark(microbench_t *bench, uint64_t run_nsecs, int counter) {
+    bench_state_t *state = calloc(1, sizeof(*state));
+    assert(state);
+    bench->setup(state, bench->param);
+
+    uint64_t nops = 1;
+    bench_result_t result = time_run(bench, state, nops, counter);
+    while (result.nsecs < run_nsecs) {
+        // aim a little past the time wanted, so as not to fall just short
+        uint64_t growth = result.nsecs == 0
+                              ? MAX_GROWTH
+                              : run_nsecs * 6 / 5 / result.nsecs + 1;
+        nops *= growth > MAX_GROWTH ? MAX_GROWTH : growth;
+        result = time_run(bench, state, nops, counter);
+    }
+    bench_result_t best = result;
+    for (int i = 1; i < NUM_RUNS; i++) {
+        result = time_run(bench, state, nops, counter);
+        if (result.nsecs < best.nsecs) {
+            best = result;
+        }
+    }
+
+    printf("%s\t%llu\t%.2f\t%.2f\t", bench->name,
+           (unsigned long long)best.nops, (double)best.nsecs / best.nops,
+           (double)best.nallocs / best.nops);
+    if (best.instructions >= 0) {
+        printf("%.1f\n", (double)best.instructions / best.nops);
+    } else {
+        printf("-\n");
+    }
+    fflush(stdout);
+    teardown(state);
+    free(state);
+}
+
+// Returns what running `nops` operations of `bench` on `state` took,
+// counting instructions with the perf counter `counter` (if not -1)
+bench_result_t time_run(microbench_t *bench, bench_state_t *state,
+                        uint64_t nops, int counter) {
+    bench_result_t result = {.nops = nops, .instructions = -1};
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t allocs_before = nallocs;
+    uint64_t start = get_time_ns();
+    bench->run(state, nops);
+    result.nsecs = get_time_ns() - start;
+    result.nallocs = nallocs - allocs_before;
+    uint64_t instructions;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &instructions, sizeof(instructions)) ==
+            sizeof(instructions)) {
+            result.instructions = instructions;
+        }
+    }
+    return result;
+}
+
+// Returns a perf counter of the instructions this process runs in user
+// space, disabled, or -1 if the kernel does not allow it
+int open_instruction_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Returns the current time (from an arbitrary point), in ns
+uint64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps the compiler from optimising away what is behind `ptr`
+void keep(void *ptr) {
+    __asm__ volatile("" : : "g"(ptr) : "memory");
+}
+
+// Sets up in `state` a query for an AAAA record, and a reply to it with
+// NUM_ANSWERS answers (`param` is unused)
+void setup_messages(bench_state_t *state, size_t param) {
+    (void)param;
+    state->query_len = make_query(state->query, 0x1234, "www.example.com",
+                                  AAAA_RR_TYPE);
+    state->reply_len =
+        make_bench_reply(state->query, state->query_len, state->reply);
+}
+
+// Sets up in `state` a cache with replies to `nkeys` distinct queries, as
+// many more replies not in it, and a shuffled order to hit the keys cached
+// in
+void setup_cache(bench_state_t *state, size_t nkeys) {
+    setup_messages(state, 0);
+    state->cache = new_cache(SIZE_MAX, 1, 0, 0, CACHE_EVICT_LEAST_TTL);
+    state->nkeys = nkeys;
+    state->keys = malloc(2 * nkeys * sizeof(*state->keys));
+    state->replies = malloc(2 * nkeys * MAX_REPLY_SIZE);
+    state->reply_lens = malloc(2 * nkeys * sizeof(*state->reply_lens));
+    state->order = malloc(nkeys * sizeof(*state->order));
+    uint8_t *block = malloc(ARENA_SIZE);
+    assert(state->keys && state->replies && state->reply_lens &&
+           state->order && block);
+    init_arena(&state->arena, block, ARENA_SIZE);
+
+    char name[MAX_NAME_SIZE];
+    for (size_t i = 0; i < 2 * nkeys; i++) {
+        snprintf(name, sizeof(name), "host%zu.bench.example.com", i);
+        uint16_t len = make_query(state->buf, 0x1234, name, AAAA_RR_TYPE);
+        uint8_t *reply = state->replies + i * MAX_REPLY_SIZE;
+        state->reply_lens[i] = make_bench_reply(state->buf, len, reply);
+        state->keys[i].question = reply + HEADER_SIZE;
+        state->keys[i].len = len - HEADER_SIZE;
+        if (i < nkeys) {
+            cache_put(state->cache, &state->keys[i], CACHE_TTL, reply,
+                      state->reply_lens[i], &state->arena);
+        }
+    }
+
+    uint32_t random_state = 1;
+    for (size_t i = 0; i < nkeys; i++) {
+        state->order[i] = i;
+    }
+    for (size_t i = nkeys - 1; i > 0; i--) {
+        size_t j = next_random(&random_state) % (i + 1);
+        size_t tmp = state->order[i];
+        state->order[i] = state->order[j];
+        state->order[j] = tmp;
+    }
+}
+
+// setup_cache(), with the cache made just large enough for the `nkeys`
+// replies in it, so that every new one put in evicts another
+void setup_full_cache(bench_state_t *state, size_t nkeys) {
+    setup_cache(state, nkeys);
+    state->cache->shards[0].max_bytes = state->cache->shards[0].nbytes;
+    state->next = nkeys;
+}
+
+// Sets up in `state` a block of the size a request's arena starts with, and
+// a query of length `query_len` to forward
+void setup_request_arena(bench_state_t *state, size_t query_len) {
+    setup_messages(state, 0);
+    state->query_len = query_len;
+    uint8_t *block = malloc(REQUEST_ARENA_SIZE);
+    assert(block);
+    init_arena(&state->arena, block, REQUEST_ARENA_SIZE);
+}
+
+// Frees what was set up in `state`
+void teardown(bench_state_t *state) {
+    if (state->cache) {
+        free_cache(state->cache);
+        free(state->keys);
+        free(state->replies);
+        free(state->reply_lens);
+        free(state->order);
+    }
+    if (state->arena.base) {
+        arena_reset(&state->arena);
+        free(state->arena.base);
+    }
+}
+
+// Puts together in `reply` a reply to the query `query` of length `len`,
+// with NUM_ANSWERS AAAA records. Returns its length.
+uint16_t make_bench_reply(uint8_t *query, uint16_t len, uint8_t *reply) {
+    dns_message_t msg;
+    bool valid = init_dns_message(&msg, query, len);
+    assert(valid);
+    uint8_t addr[16] = {0x20, 0x01, 0x0d, 0xb8};
+    uint16_t reply_len = make_reply(&msg, NO_ERROR_RCODE, reply);
+    for (int i = 0; i < NUM_ANSWERS; i++) {
+        addr[15] = i;
+        reply_len = add_record(reply, reply_len, MAX_MESSAGE_SIZE, HEADER_SIZE,
+                               AAAA_RR_TYPE, CACHE_TTL, addr, sizeof(addr));
+    }
+    set_record_counts(reply, NUM_ANSWERS, 0, 0);
+    return reply_len;
+}
+
+// One operation: reading NUM_FIELDS fields of the reply, one at a time
+void run_read16(bench_state_t *state, uint64_t nops) {
+    uint16_t field = 0;
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < nops; i++) {
+        bytes_t bytes = {.data = state->reply, .size = 2 * NUM_FIELDS,
+                         .offset = 0};
+        for (int j = 0; j < NUM_FIELDS; j++) {
+            sum += read16(&field, &bytes);
+        }
+    }
+    keep(&sum);
+}
+
+// One operation: writing NUM_FIELDS fields to a buffer, one at a time
+void run_write16(bench_state_t *state, uint64_t nops) {
+    for (uint64_t i = 0; i < nops; i++) {
+        bytes_t bytes = {.data = state->buf, .size = 2 * NUM_FIELDS,
+                         .offset = 0};
+        for (int j = 0; j < NUM_FIELDS; j++) {
+            write16(&bytes, j);
+        }
+        keep(state->buf);
+    }
+}
+
+// One operation: parsing the query
+void run_parse_query(bench_state_t *state, uint64_t nops) {
+    dns_message_t msg;
+    for (uint64_t i = 0; i < nops; i++) {
+        init_dns_message(&msg, state->query, state->query_len);
+        keep(&msg);
+    }
+}
+
+// One operation: parsing the reply, with its answers
+void run_parse_reply(bench_state_t *state, uint64_t nops) {
+    dns_message_t msg;
+    for (uint64_t i = 0; i < nops; i++) {
+        init_dns_message(&msg, state->reply, state->reply_len);
+        read_answers(&msg);
+        keep(&msg);
+    }
+}
+
+// One operation: getting the text of the name queried
+void run_get_name(bench_state_t *state, uint64_t nops) {
+    char name[MAX_NAME_SIZE];
+    for (uint64_t i = 0; i < nops; i++) {
+        get_name(state->query, state->query_len, HEADER_SIZE, name);
+        keep(name);
+    }
+}
+
+// One operation: putting together a reply to the query, with NUM_ANSWERS
+// answers, from the query parsed
+void run_make_reply(bench_state_t *state, uint64_t nops) {
+    for (uint64_t i = 0; i < nops; i++) {
+        make_bench_reply(state->query, state->query_len, state->buf);
+        keep(state->buf);
+    }
+}
+
+// One operation: putting together a reply to the query with RCODE 4 (not
+// implemented), from the query parsed
+void run_make_error_reply(bench_state_t *state, uint64_t nops) {
+    dns_message_t msg;
+    for (uint64_t i = 0; i < nops; i++) {
+        init_dns_message(&msg, state->query, state->query_len);
+        make_error_reply(&msg, NOT_IMPLEMENTED_RCODE, state->buf);
+        keep(state->buf);
+    }
+}
+
+// One operation: getting the reply to a key in the cache, in shuffled order
+void run_cache_get_hit(bench_state_t *state, uint64_t nops) {
+    time_t expiry_time;
+    bool refresh;
+    for (uint64_t i = 0; i < nops; i++) {
+        cache_key_t *key = &state->keys[state->order[state->next]];
+        state->next = (state->next + 1) % state->nkeys;
+        uint16_t len = cache_get(state->cache, key, state->buf,
+                                 MAX_MESSAGE_SIZE, &expiry_time, &refresh);
+        assert(len > 0);
+    }
+}
+
+// One operation: looking up a key not in the cache
+void run_cache_get_miss(bench_state_t *state, uint64_t nops) {
+    time_t expiry_time;
+    bool refresh;
+    for (uint64_t i = 0; i < nops; i++) {
+        cache_key_t *key = &state->keys[state->nkeys + state->next];
+        state->next = (state->next + 1) % state->nkeys;
+        uint16_t len = cache_get(state->cache, key, state->buf,
+                                 MAX_MESSAGE_SIZE, &expiry_time, &refresh);
+        assert(len == 0);
+    }
+}
+
+// One operation: putting a reply into the full cache, evicting another, in
+// turn for each of the keys (so each is put in after it was evicted)
+void run_cache_put(bench_state_t *state, uint64_t nops) {
+    for (uint64_t i = 0; i < nops; i++) {
+        cache_put(state->cache, &state->keys[state->next], CACHE_TTL,
+                  state->replies + state->next * MAX_REPLY_SIZE,
+                  state->reply_lens[state->next], &state->arena);
+        arena_reset(&state->arena);
+        state->next = (state->next + 1) % (2 * state->nkeys);
+    }
+}
+
+// Takes from the arena what a request forwarded upstream does, as the worker
+// does (see new_request() and upstream_send()): the request, a copy of its
+// query and what upstream keeps of it. Any allocation per operation means
+// the arena's block is too small for queries this long.
+void run_request_arena(bench_state_t *state, uint64_t nops) {
+    for (uint64_t i = 0; i < nops; i++) {
+        request_t *request = arena_alloc(&state->arena, sizeof(*request));
+        uint8_t *query = arena_alloc(&state->arena, state->query_len);
+        memcpy(query, state->query, state->query_len);
+        upstream_query_t *forwarded =
+            arena_alloc(&state->arena, sizeof(*forwarded));
+        keep(request);
+        keep(forwarded);
+        arena_reset(&state->arena);
+    }
+}
+
+// The wrappers of malloc(), calloc() and realloc(), for every call to them
+// from the server's modules and this program (linked with --wrap), counting
+// allocations
+void *__wrap_malloc(size_t size) {
+    nallocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    nallocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    nallocs++;
+    return __real_realloc(ptr, size);
+}
@@ -0,0 +1,187 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Networking module containing functions for setting up the (non-blocking)
+ * sockets this DNS server listens on and connects to upstream with.
+ */
+
+#define _GNU_SOURCE
+#include "net.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// This function contains code from Lab 9 solutions. Creates and returns a
+// non-blocking socket for this server to listen on, bound to the given port,
+// over IPv4 and either TCP or UDP (`socktype` SOCK_STREAM or SOCK_DGRAM).
+// This function reuses the port if possible, and lets
+// other sockets bind to the same port so that each worker thread can have
+// its own listener (the kernel spreads connections between them). Exits if
+// error.
+int setup_server_socket(const char *port, int socktype) {
+    struct addrinfo hints, *addrinfo;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;     // IPv4
+    hints.ai_socktype = socktype;  // TCP or UDP
+    hints.ai_flags = AI_PASSIVE;   // will be listening
+
+    int status = getaddrinfo(NULL, port, &hints, &addrinfo);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    // Create socket
+    int sockfd = socket(addrinfo->ai_family, addrinfo->ai_socktype,
+                        addrinfo->ai_protocol);
+    if (sockfd < 0) {
+        freeaddrinfo(addrinfo);
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Reuse port if possible
+    int enable = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) <
+        0) {
+        freeaddrinfo(addrinfo);
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) <
+        0) {
+        freeaddrinfo(addrinfo);
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind address to the socket
+    if (bind(sockfd, addrinfo->ai_addr, addrinfo->ai_addrlen) < 0) {
+        freeaddrinfo(addrinfo);
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(addrinfo);
+
+    set_nonblocking(sockfd);
+    return sockfd;
+}
+
+// Accepts a client connection request queued up for the given (non-blocking)
+// socket, and returns it, made non-blocking as well, see set_nodelay().
+// Returns -1 if there are no more connections queued up, or if accepting
+// failed.
+int accept_client_connection(int serv_sockfd) {
+    struct sockaddr_storage client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
+    socklen_t client_addr_size = sizeof(client_addr);
+    int sockfd = accept(serv_sockfd, (struct sockaddr *)&client_addr,
+                        &client_addr_size);
+    if (sockfd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept");
+        }
+        return -1;
+    }
+    set_nonblocking(sockfd);
+    set_nodelay(sockfd);
+    return sockfd;
+}
+
+// This function contains code from Lab 9 solutions. Resolves the given
+// server name and port into `addr` (the first result over IPv4 and TCP),
+// so that connecting to upstream does not need getaddrinfo() every time.
+// Exits if error.
+void resolve_address(net_addr_t *addr, const char *server_name,
+                     const char *port) {
+    struct addrinfo hints, *addrinfo;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;        // IPv4
+    hints.ai_socktype = SOCK_STREAM;  // TCP
+
+    int status = getaddrinfo(server_name, port, &hints, &addrinfo);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&addr->addr, addrinfo->ai_addr, addrinfo->ai_addrlen);
+    addr->addrlen = addrinfo->ai_addrlen;
+    addr->family = addrinfo->ai_family;
+    addr->socktype = addrinfo->ai_socktype;
+    addr->protocol = addrinfo->ai_protocol;
+
+    freeaddrinfo(addrinfo);
+}
+
+// Creates a non-blocking socket (see set_nodelay()) and starts connecting it
+// to `addr`, returning it. The connection is most likely still in progress
+// when this returns: wait for the socket to become writable, then check
+// SO_ERROR. Returns -1 if error.
+int connect_nonblocking(net_addr_t *addr) {
+    int sockfd = socket(addr->family, addr->socktype, addr->protocol);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    set_nonblocking(sockfd);
+    set_nodelay(sockfd);
+
+    if (connect(sockfd, (struct sockaddr *)&addr->addr, addr->addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Creates and returns a (non-blocking) UDP socket connected to the server at
+// `addr`, bound to a source port picked at random by the kernel, and only
+// receiving datagrams from that server. Returns -1 if error.
+int connect_udp(net_addr_t *addr) {
+    int sockfd = socket(addr->family, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    set_nonblocking(sockfd);
+
+    if (connect(sockfd, (struct sockaddr *)&addr->addr, addr->addrlen) < 0) {
+        perror("connect");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Puts the socket (or any file descriptor) `fd` in non-blocking mode. Exits
+// if error.
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Disables Nagle's algorithm on the TCP socket `fd`: messages are small and
+// pipelined, and holding one back until the last is acknowledged (which the
+// peer delays until it has something to send) would stall it a whole
+// message behind
+void set_nodelay(int fd) {
+    int enable = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) <
+        0) {
+        perror("setsockopt");
+    }
+}
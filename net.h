@@ -0,0 +1,46 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Networking module containing functions for setting up the (non-blocking)
+ * sockets this DNS server listens on and connects to upstream with.
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <sys/socket.h>
+
+// The kinds of file descriptors watched by an event loop. Every structure
+// registered with epoll starts with one of these, so events can be
+// dispatched on it.
+typedef enum {
+    FD_LISTENER,
+    FD_CLIENT,
+    FD_UPSTREAM,
+    FD_UDP,
+    FD_UPSTREAM_UDP
+} fd_kind_t;
+
+// A resolved address of a server, enough to create and connect a socket
+// to it without calling getaddrinfo() again
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family;
+    int socktype;
+    int protocol;
+} net_addr_t;
+
+int setup_server_socket(const char *port, int socktype);
+int accept_client_connection(int serv_sockfd);
+
+void resolve_address(net_addr_t *addr, const char *server_name,
+                     const char *port);
+int connect_nonblocking(net_addr_t *addr);
+int connect_udp(net_addr_t *addr);
+
+void set_nonblocking(int fd);
+void set_nodelay(int fd);
+
+#endif
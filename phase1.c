@@ -25,8 +25,8 @@
 #define LOG_FILE_PATH "./dns_svr.log"
 
 uint16_t read_msg_len(int fd);
-void log_query(FILE *fp, query_t *query);
-void log_answer(FILE *fp, record_t *answer);
+void log_query(FILE *fp, dns_message_t *msg);
+void log_answer(FILE *fp, dns_message_t *msg);
 
 // Read binary DNS requests/responses (indicated by the message itself and the
 // supplied command line argument) and print logs to a file.
@@ -42,22 +42,26 @@ int main(int argc, char *argv[]) {
         perror("read");
         exit(EXIT_FAILURE);
     }
-    dns_message_t *msg = init_dns_message(buf, msg_len);
+    dns_message_t msg;
+    if (!init_dns_message(&msg, buf, msg_len)) {
+        fprintf(stderr, "malformed message\n");
+        exit(EXIT_FAILURE);
+    }
 
     FILE *fp = fopen(LOG_FILE_PATH, "w");
     if (!fp) {
         perror("open log file");
         exit(EXIT_FAILURE);
     }
-    if (strcmp(argv[1], "query") == 0 && msg->qdcount > 0) {
-        log_query(fp, &msg->queries[0]);
-    } else if (strcmp(argv[1], "response") == 0 && msg->ancount > 0) {
-        log_answer(fp, &msg->answers[0]);
+    if (strcmp(argv[1], "query") == 0 && msg.qdcount > 0) {
+        log_query(fp, &msg);
+    } else if (strcmp(argv[1], "response") == 0 && msg.ancount > 0 &&
+               read_answers(&msg)) {
+        log_answer(fp, &msg);
     }
 
     // no need to parse or log authority/additional records
     fclose(fp);
-    free_dns_message(msg);
 
     return 0;
 }
@@ -72,30 +76,36 @@ uint16_t read_msg_len(int fd) {
     return ntohs(field);
 }
 
-// Print to `fp` the timestamped logs for when a query `query` is received by
-// this server
-void log_query(FILE *fp, query_t *query) {
+// Print to `fp` the timestamped logs for when the query `msg` (its first
+// question) is received by this server
+void log_query(FILE *fp, dns_message_t *msg) {
     char timestamp[TIMESTAMP_LEN];
     get_timestamp(timestamp, TIMESTAMP_LEN);
 
-    fprintf(fp, "%s requested %s\n", timestamp, query->qname);
+    char name[MAX_NAME_SIZE];
+    fprintf(fp, "%s requested %s\n", timestamp,
+            get_name(msg->data, msg->size, msg->question.qname.offset, name));
     fflush(fp);
-    if (query->qtype != AAAA_RR_TYPE) {
+    if (msg->question.qtype != AAAA_RR_TYPE) {
         fprintf(fp, "%s unimplemented request\n", timestamp);
         fflush(fp);
     }
 }
 
-// Print to `fd` the timestamped logs for when an resource record `answer`
-// is to be returned by this server.
-void log_answer(FILE *fp, record_t *answer) {
+// Print to `fd` the timestamped logs for when the first answer of the
+// response `msg` is to be returned by this server.
+void log_answer(FILE *fp, dns_message_t *msg) {
     char timestamp[TIMESTAMP_LEN];
     get_timestamp(timestamp, TIMESTAMP_LEN);
 
     // just in case, ensure answer is IPv6
+    record_t *answer = &msg->answer;
     if (answer->type == AAAA_RR_TYPE) {
-        fprintf(fp, "%s %s is at %s\n", timestamp, answer->name,
-                answer->rdata);
+        char name[MAX_NAME_SIZE];
+        char addr[INET6_ADDRSTRLEN];
+        fprintf(fp, "%s %s is at %s\n", timestamp,
+                get_name(msg->data, msg->size, answer->name.offset, name),
+                get_ip_addr(msg->data, answer, addr));
         fflush(fp);
     }
 }
\ No newline at end of file
@@ -0,0 +1,164 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Slab module containing functions for allocating many objects of the same
+ * size, carved out of large slabs of memory rather than one malloc() each.
+ * Freed objects are kept on the free list of their slab for the next
+ * allocation, so memory does not fragment however objects come and go, and a
+ * slab is given back to the system once none of its objects are in use.
+ */
+
+#include "slab.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+// alignment of every object, enough for the pointers and integers (at most
+// 64-bit) objects are made of
+#define SLAB_ALIGN 8
+// size of the header of a slab, which its objects follow
+#define SLAB_HEADER_SIZE \
+    ((sizeof(slab_header_t) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+
+void slab_grow(slab_t *slab);
+slab_header_t *slab_of(slab_t *slab, void *obj);
+void slab_link(slab_header_t **list, slab_header_t *header);
+void slab_unlink(slab_header_t **list, slab_header_t *header);
+void slab_free_all(slab_header_t *list);
+
+// Initialises `slab` to allocate objects of size `obj_size`, from slabs of
+// `slab_size` bytes, a power of 2. No memory is taken until the first
+// allocation.
+void init_slab(slab_t *slab, size_t obj_size, size_t slab_size) {
+    assert((slab_size & (slab_size - 1)) == 0);
+    // every object must be able to hold a free list link, and be aligned
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+    slab->obj_size = (obj_size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    slab->nper_slab = slab_size > SLAB_HEADER_SIZE
+                          ? (slab_size - SLAB_HEADER_SIZE) / slab->obj_size
+                          : 0;
+    slab->slab_size = slab_size;
+    if (slab->nper_slab < 2) {
+        // each object has a slab to itself
+        slab->nper_slab = 1;
+        slab->slab_size = SLAB_HEADER_SIZE + slab->obj_size;
+    }
+    slab->nbytes = 0;
+    slab->free_slabs = NULL;
+    slab->full_slabs = NULL;
+}
+
+// Frees every slab of `slab`, along with every object allocated from it
+void destroy_slab(slab_t *slab) {
+    slab_free_all(slab->free_slabs);
+    slab_free_all(slab->full_slabs);
+    slab->nbytes = 0;
+    slab->free_slabs = NULL;
+    slab->full_slabs = NULL;
+}
+
+// Returns a new object from `slab` (uninitialised), taking a new slab if
+// none have a free one
+void *slab_alloc(slab_t *slab) {
+    if (!slab->free_slabs) {
+        slab_grow(slab);
+    }
+    slab_header_t *header = slab->free_slabs;
+    void *obj = header->free_list;
+    header->free_list = *(void **)obj;
+    header->nallocated++;
+    if (!header->free_list) {
+        slab_unlink(&slab->free_slabs, header);
+        slab_link(&slab->full_slabs, header);
+    }
+    return obj;
+}
+
+// Gives the object `obj` back to `slab`, to be allocated again. Its slab is
+// freed if no other object of it is in use.
+void slab_free(slab_t *slab, void *obj) {
+    slab_header_t *header = slab_of(slab, obj);
+    bool was_full = !header->free_list;
+    *(void **)obj = header->free_list;
+    header->free_list = obj;
+    header->nallocated--;
+
+    if (was_full) {
+        slab_unlink(&slab->full_slabs, header);
+        slab_link(&slab->free_slabs, header);
+    }
+    if (header->nallocated == 0) {
+        slab_unlink(&slab->free_slabs, header);
+        slab->nbytes -= slab->slab_size;
+        free(header);
+    }
+}
+
+// Returns how many more bytes of memory `slab` takes to allocate another
+// object: none if one of its slabs has a free one, otherwise a new slab's
+size_t slab_alloc_nbytes(slab_t *slab) {
+    return slab->free_slabs ? 0 : slab->slab_size;
+}
+
+// Takes a new slab for `slab`, with every object in it on its free list
+void slab_grow(slab_t *slab) {
+    slab_header_t *header =
+        slab->nper_slab == 1 ? malloc(slab->slab_size)
+                             : aligned_alloc(slab->slab_size, slab->slab_size);
+    assert(header);
+    header->nallocated = 0;
+    header->free_list = NULL;
+
+    // in reverse, so objects are allocated in the order they are laid out
+    uint8_t *objs = (uint8_t *)header + SLAB_HEADER_SIZE;
+    for (size_t i = slab->nper_slab; i > 0; i--) {
+        void *obj = objs + (i - 1) * slab->obj_size;
+        *(void **)obj = header->free_list;
+        header->free_list = obj;
+    }
+    slab_link(&slab->free_slabs, header);
+    slab->nbytes += slab->slab_size;
+}
+
+// Returns the header of the slab of `slab` the object `obj` was carved from
+slab_header_t *slab_of(slab_t *slab, void *obj) {
+    if (slab->nper_slab == 1) {
+        return (slab_header_t *)((uint8_t *)obj - SLAB_HEADER_SIZE);
+    }
+    uintptr_t mask = ~(uintptr_t)(slab->slab_size - 1);
+    return (slab_header_t *)((uintptr_t)obj & mask);
+}
+
+// Puts the slab `header` at the front of the list `list`
+void slab_link(slab_header_t **list, slab_header_t *header) {
+    header->prev = NULL;
+    header->next = *list;
+    if (*list) {
+        (*list)->prev = header;
+    }
+    *list = header;
+}
+
+// Takes the slab `header` out of the list `list`
+void slab_unlink(slab_header_t **list, slab_header_t *header) {
+    if (header->prev) {
+        header->prev->next = header->next;
+    } else {
+        *list = header->next;
+    }
+    if (header->next) {
+        header->next->prev = header->prev;
+    }
+}
+
+// Frees every slab in the list `list`
+void slab_free_all(slab_header_t *list) {
+    while (list) {
+        slab_header_t *next = list->next;
+        free(list);
+        list = next;
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Slab module containing functions for allocating many objects of the same
+ * size, carved out of large slabs of memory rather than one malloc() each.
+ * Freed objects are kept on the free list of their slab for the next
+ * allocation, so memory does not fragment however objects come and go, and a
+ * slab is given back to the system once none of its objects are in use.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// size of each slab objects are carved from, unless given otherwise
+#define SLAB_SIZE (64 * 1024)
+
+// The header at the start of each slab: its links in the list of slabs of
+// its allocator it is in, the number of its objects in use, and those free to
+// allocate again, linked through their first bytes
+typedef struct slab_header slab_header_t;
+struct slab_header {
+    slab_header_t *prev;
+    slab_header_t *next;
+    size_t nallocated;
+    void *free_list;
+};
+
+// An allocator of objects of size `obj_size`, along with the slabs they are
+// carved from (freed along with the allocator): those with free objects, and
+// those without. Each slab is aligned to its size, a power of 2, for an
+// object to find its slab by, unless it is too small to hold more than one
+// object: then each object has a slab to itself, just large enough.
+typedef struct {
+    size_t obj_size;
+    size_t slab_size;
+    size_t nper_slab;
+    size_t nbytes;  // memory taken by its slabs
+    slab_header_t *free_slabs;
+    slab_header_t *full_slabs;
+} slab_t;
+
+void init_slab(slab_t *slab, size_t obj_size, size_t slab_size);
+void destroy_slab(slab_t *slab);
+
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *obj);
+size_t slab_alloc_nbytes(slab_t *slab);
+
+#endif
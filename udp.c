@@ -0,0 +1,130 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * UDP module containing functions for receiving and sending DNS messages
+ * over a non-blocking UDP socket in batches, so that many datagrams cost a
+ * single system call (recvmmsg/sendmmsg).
+ */
+
+#define _GNU_SOURCE
+#include "udp.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void init_udp_batch(udp_batch_t *batch);
+
+// Creates and returns a new UDP socket over the non-blocking socket `fd`,
+// of the given `kind`
+udp_socket_t *new_udp_socket(int fd, fd_kind_t kind) {
+    udp_socket_t *udp = malloc(sizeof(*udp));
+    assert(udp);
+
+    udp->kind = kind;
+    udp->fd = fd;
+    init_udp_batch(&udp->recvd);
+    init_udp_batch(&udp->queued);
+
+    return udp;
+}
+
+// Frees a UDP socket, sending anything still queued up and closing it
+void free_udp_socket(udp_socket_t *udp) {
+    udp_flush(udp);
+    close(udp->fd);
+    free(udp);
+}
+
+// Points every message header in `batch` at its own buffer and address
+void init_udp_batch(udp_batch_t *batch) {
+    memset(batch->msgs, 0, sizeof(batch->msgs));
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        batch->iovs[i].iov_base = batch->bufs[i];
+        batch->iovs[i].iov_len = UDP_MAX_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+    }
+    batch->count = 0;
+}
+
+// Receives as many datagrams as are available (up to a batch) from `udp`
+// with one system call, into `udp->recvd`. Datagrams too large to be handled
+// are cut short, and marked so (see udp_truncated()). Returns the number of
+// datagrams received, 0 if none.
+int udp_recv_batch(udp_socket_t *udp) {
+    udp_batch_t *batch = &udp->recvd;
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        batch->iovs[i].iov_len = UDP_MAX_SIZE;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        batch->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    int nrecvd;
+    do {
+        nrecvd = recvmmsg(udp->fd, batch->msgs, UDP_BATCH_SIZE, MSG_DONTWAIT,
+                          NULL);
+    } while (nrecvd < 0 && errno == EINTR);
+    if (nrecvd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recvmmsg");
+        }
+        batch->count = 0;
+        return 0;
+    }
+
+    batch->count = nrecvd;
+    return nrecvd;
+}
+
+// Returns true if the datagram at index `i` of `batch` was longer than
+// UDP_MAX_SIZE, so only its first UDP_MAX_SIZE bytes were received
+bool udp_truncated(udp_batch_t *batch, int i) {
+    return batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC;
+}
+
+// Queues up `len` bytes of a DNS message `data` (this function will copy it)
+// to be sent to the address `addr` (of length `addrlen`) from `udp`, by the
+// next udp_flush(). If the queue is full, it is flushed first.
+void udp_send(udp_socket_t *udp, struct sockaddr_storage *addr,
+              socklen_t addrlen, uint8_t *data, uint16_t len) {
+    assert(len <= UDP_MAX_SIZE);
+    udp_batch_t *batch = &udp->queued;
+    if (batch->count == UDP_BATCH_SIZE) {
+        udp_flush(udp);
+    }
+    int i = batch->count++;
+    memcpy(batch->bufs[i], data, len);
+    batch->iovs[i].iov_len = len;
+    memcpy(&batch->addrs[i], addr, addrlen);
+    batch->msgs[i].msg_hdr.msg_namelen = addrlen;
+}
+
+// Sends every datagram queued up on `udp`, with as few system calls as
+// possible. If the socket's send buffer is full, the rest are dropped: as
+// with any lost datagram, clients will retry.
+void udp_flush(udp_socket_t *udp) {
+    udp_batch_t *batch = &udp->queued;
+    int nsent = 0;
+    while (nsent < batch->count) {
+        int status = sendmmsg(udp->fd, batch->msgs + nsent,
+                              batch->count - nsent, MSG_DONTWAIT);
+        if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("sendmmsg");
+            }
+            break;
+        }
+        nsent += status;
+    }
+    batch->count = 0;
+}
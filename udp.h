@@ -0,0 +1,55 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * UDP module containing functions for receiving and sending DNS messages
+ * over a non-blocking UDP socket in batches, so that many datagrams cost a
+ * single system call (recvmmsg/sendmmsg).
+ */
+
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "net.h"
+
+// maximum number of datagrams received or sent per system call
+#define UDP_BATCH_SIZE 64
+// the largest UDP datagram handled, also the largest UDP payload advertised
+// by EDNS(0) clients that is honoured
+#define UDP_MAX_SIZE 4096
+// the largest UDP datagram a client accepts if it does not say otherwise
+#define UDP_MIN_SIZE 512
+
+// A batch of datagrams, along with the addresses they are from/to
+typedef struct {
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    struct sockaddr_storage addrs[UDP_BATCH_SIZE];
+    uint8_t bufs[UDP_BATCH_SIZE][UDP_MAX_SIZE];
+    int count;
+} udp_batch_t;
+
+// A non-blocking UDP socket, with a batch of datagrams received and a batch
+// queued up to be sent. The `kind` is first so that it can be registered
+// with epoll directly.
+typedef struct {
+    fd_kind_t kind;
+    int fd;
+    udp_batch_t recvd;
+    udp_batch_t queued;
+} udp_socket_t;
+
+udp_socket_t *new_udp_socket(int fd, fd_kind_t kind);
+void free_udp_socket(udp_socket_t *udp);
+
+int udp_recv_batch(udp_socket_t *udp);
+bool udp_truncated(udp_batch_t *batch, int i);
+void udp_send(udp_socket_t *udp, struct sockaddr_storage *addr,
+              socklen_t addrlen, uint8_t *data, uint16_t len);
+void udp_flush(udp_socket_t *udp);
+
+#endif
@@ -0,0 +1,612 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Upstream module containing functions for forwarding queries to the
+ * upstream server, either over a small set of UDP sockets, or over a pool of
+ * long-lived TCP connections. Many queries are in flight at once: each is
+ * sent with a random ID unique within the pool, so replies can be matched
+ * back to the query no matter the order they arrive in, or which socket they
+ * arrive on. Over TCP, many queries are in flight on each connection
+ * (pipelining, RFC 7766), and connections that drop are reopened, their
+ * queries sent again. Over UDP, queries whose replies are truncated are sent
+ * again over TCP.
+ */
+
+#define _GNU_SOURCE
+#include "upstream.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "dns_message.h"
+#include "util.h"
+
+// maximum number of queries in flight on one TCP connection
+#define UPSTREAM_MAX_PIPELINE 128
+// maximum number of times a query is sent before giving up on it
+#define UPSTREAM_MAX_ATTEMPTS 3
+// how long to wait for a reply to a query before sending it again
+#define UPSTREAM_TIMEOUT_MS 1500
+// number of UDP sockets queries are spread over at random
+#define UPSTREAM_NUM_UDP 4
+// number of queries sent from a UDP socket, or how long it is sent from, in
+// ms, before another with a new (random) source port takes its place, so that
+// forged replies have to guess the port as well as the ID
+#define UPSTREAM_UDP_ROTATE 256
+#define UPSTREAM_UDP_ROTATE_MS 1000
+
+int new_query_id(upstream_t *ups);
+void dispatch_query(upstream_t *ups, upstream_query_t *query);
+void dispatch_waiting(upstream_t *ups);
+
+int pick_conn(upstream_t *ups);
+bool has_conn(upstream_t *ups);
+int conn_index(upstream_t *ups, conn_t *conn);
+void set_query_id(upstream_query_t *query, uint16_t id);
+void send_query(upstream_t *ups, int i, upstream_query_t *query);
+void handle_tcp_reply(upstream_t *ups, int i, uint8_t *reply, uint16_t len);
+void drop_conn(upstream_t *ups, int i);
+
+int udp_index(upstream_t *ups, udp_socket_t *udp);
+void send_udp_query(upstream_t *ups, upstream_query_t *query);
+void handle_udp_reply(upstream_t *ups, uint8_t *reply, uint16_t len,
+                      bool cut_short);
+
+void track_sent(upstream_t *ups, upstream_query_t *query);
+void detach_query(upstream_t *ups, upstream_query_t *query);
+void complete_query(upstream_t *ups, upstream_query_t *query, uint8_t *reply,
+                    uint16_t len);
+void retry_query(upstream_t *ups, upstream_query_t *query);
+void fail_query(upstream_t *ups, upstream_query_t *query);
+
+// Creates and returns a new pool of sockets (opened as needed) to the
+// upstream server at `addr`, registered with `loop`: up to `nconns` TCP
+// connections, and if `over_udp`, UDP sockets that queries are sent over
+// first. `callback` is called with `ctx` whenever a query forwarded through
+// the pool is replied to. Latencies are recorded in `metrics`.
+upstream_t *new_upstream(conn_loop_t *loop, net_addr_t *addr, int nconns,
+                         bool over_udp, upstream_callback_t callback,
+                         void *ctx, metrics_t *metrics) {
+    upstream_t *ups = malloc(sizeof(*ups));
+    assert(ups);
+
+    ups->loop = loop;
+    ups->addr = addr;
+    ups->callback = callback;
+    ups->ctx = ctx;
+    ups->over_udp = over_udp;
+    ups->metrics = metrics;
+
+    ups->nconns = nconns;
+    ups->conns = calloc(nconns, sizeof(*ups->conns));
+    ups->conn_ninflight = calloc(nconns, sizeof(*ups->conn_ninflight));
+    ups->conn_opened = calloc(nconns, sizeof(*ups->conn_opened));
+    assert(ups->conns && ups->conn_ninflight && ups->conn_opened);
+
+    ups->nudp = UPSTREAM_NUM_UDP;
+    ups->udp_socks = calloc(2 * ups->nudp, sizeof(*ups->udp_socks));
+    ups->udp_ninflight = calloc(2 * ups->nudp, sizeof(*ups->udp_ninflight));
+    ups->udp_nsent = calloc(2 * ups->nudp, sizeof(*ups->udp_nsent));
+    ups->udp_opened = calloc(2 * ups->nudp, sizeof(*ups->udp_opened));
+    ups->udp_active = malloc(ups->nudp * sizeof(*ups->udp_active));
+    assert(ups->udp_socks && ups->udp_ninflight && ups->udp_nsent &&
+           ups->udp_opened && ups->udp_active);
+    for (int i = 0; i < ups->nudp; i++) {
+        ups->udp_active[i] = i;
+    }
+
+    ups->inflight = calloc(NUM_IDS, sizeof(*ups->inflight));
+    assert(ups->inflight);
+    ups->ninflight = 0;
+    init_random_pool(&ups->random);
+
+    ups->sent_head = NULL;
+    ups->sent_tail = NULL;
+    ups->waiting_head = NULL;
+    ups->waiting_tail = NULL;
+
+    return ups;
+}
+
+// Frees a pool of upstream sockets, closing them. Any queries still in
+// flight are dropped, without being replied to (their memory is their
+// caller's).
+void free_upstream(upstream_t *ups) {
+    for (int i = 0; i < ups->nconns; i++) {
+        if (ups->conns[i]) {
+            conn_close(ups->conns[i]);
+        }
+    }
+    for (int i = 0; i < 2 * ups->nudp; i++) {
+        if (ups->udp_socks[i]) {
+            free_udp_socket(ups->udp_socks[i]);
+        }
+    }
+    free(ups->inflight);
+    free(ups->udp_active);
+    free(ups->udp_opened);
+    free(ups->udp_nsent);
+    free(ups->udp_ninflight);
+    free(ups->udp_socks);
+    free(ups->conn_opened);
+    free(ups->conn_ninflight);
+    free(ups->conns);
+    free(ups);
+}
+
+// Forwards the query `query` of length `len` to upstream. The pool's
+// callback is called with `arg` once it is replied to, or once it fails.
+// Until then, the query must be left as it is: it is not copied, as what is
+// sent is (its ID only rewritten in place while it is). What the pool keeps
+// of the query is allocated from `arena`, which must not be reset until then
+// either.
+void upstream_send(upstream_t *ups, arena_t *arena, uint8_t *query,
+                   uint16_t len, void *arg) {
+    upstream_query_t *new_query = arena_alloc(arena, sizeof(*new_query));
+
+    uint16_t id;
+    memcpy(&id, query, sizeof(id));
+    new_query->client_id = ntohs(id);
+    new_query->data = query;
+    new_query->len = len;
+    new_query->arg = arg;
+    // queries too large for a datagram can only go over TCP
+    new_query->over_tcp = !ups->over_udp || len > UDP_MAX_SIZE;
+    new_query->conn = NULL;
+    new_query->udp_index = -1;
+    new_query->nattempts = 0;
+    new_query->sent_time = 0;
+    new_query->deadline = 0;
+    new_query->prev_sent = NULL;
+    new_query->next_sent = NULL;
+    new_query->next_waiting = NULL;
+
+    // a new ID, reserved until the query is done with
+    int new_id = new_query_id(ups);
+    if (new_id < 0) {
+        ups->callback(ups->ctx, arg, NULL, 0);
+        return;
+    }
+    new_query->id = new_id;
+    ups->inflight[new_id] = new_query;
+    ups->ninflight++;
+
+    dispatch_query(ups, new_query);
+}
+
+// Returns a random ID not used by any query in flight, or -1 if all are.
+// IDs in use are drawn again rather than stepped past, so that every ID free
+// is as likely as another.
+int new_query_id(upstream_t *ups) {
+    if (ups->ninflight == NUM_IDS) {
+        return -1;
+    }
+    uint16_t id;
+    do {
+        id = secure_random(&ups->random);
+    } while (ups->inflight[id]);
+    return id;
+}
+
+// Sends `query` over UDP, or over TCP on the least busy connection, opening
+// one if needed. Otherwise, if every connection is as busy as allowed, the
+// query waits for one to have room. If no connection can be opened, the
+// query fails.
+void dispatch_query(upstream_t *ups, upstream_query_t *query) {
+    if (!query->over_tcp) {
+        send_udp_query(ups, query);
+        return;
+    }
+    int i = pick_conn(ups);
+    if (i >= 0) {
+        send_query(ups, i, query);
+    } else if (has_conn(ups)) {
+        if (ups->waiting_tail) {
+            ups->waiting_tail->next_waiting = query;
+        } else {
+            ups->waiting_head = query;
+        }
+        ups->waiting_tail = query;
+    } else {
+        fail_query(ups, query);
+    }
+}
+
+// Sends as many queries waiting for a connection as there is room for
+void dispatch_waiting(upstream_t *ups) {
+    while (ups->waiting_head) {
+        int i = pick_conn(ups);
+        if (i < 0) {
+            if (!has_conn(ups)) {
+                // nothing will ever make room
+                while (ups->waiting_head) {
+                    upstream_query_t *query = ups->waiting_head;
+                    ups->waiting_head = query->next_waiting;
+                    fail_query(ups, query);
+                }
+                ups->waiting_tail = NULL;
+            }
+            return;
+        }
+        upstream_query_t *query = ups->waiting_head;
+        ups->waiting_head = query->next_waiting;
+        if (!ups->waiting_head) {
+            ups->waiting_tail = NULL;
+        }
+        query->next_waiting = NULL;
+        send_query(ups, i, query);
+    }
+}
+
+// Returns the index of the connection with the fewest queries in flight,
+// opening a new one if that would spread them out better. Returns -1 if
+// every connection is as busy as allowed, or if none can be opened.
+int pick_conn(upstream_t *ups) {
+    int best = -1, unused = -1;
+    for (int i = 0; i < ups->nconns; i++) {
+        if (!ups->conns[i]) {
+            unused = i;
+        } else if (ups->conn_ninflight[i] < UPSTREAM_MAX_PIPELINE &&
+                   (best < 0 ||
+                    ups->conn_ninflight[i] < ups->conn_ninflight[best])) {
+            best = i;
+        }
+    }
+    if (unused >= 0 && (best < 0 || ups->conn_ninflight[best] > 0)) {
+        int sockfd = connect_nonblocking(ups->addr);
+        if (sockfd >= 0) {
+            ups->conns[unused] =
+                new_conn(sockfd, ups->loop, FD_UPSTREAM, CONN_CONNECTING);
+            ups->conn_ninflight[unused] = 0;
+            ups->conn_opened[unused] = get_time_us();
+            return unused;
+        }
+    }
+    return best;
+}
+
+// Returns true if any connection to upstream is open (or opening)
+bool has_conn(upstream_t *ups) {
+    for (int i = 0; i < ups->nconns; i++) {
+        if (ups->conns[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the index of `conn` in the pool, or -1 if it is not in it
+int conn_index(upstream_t *ups, conn_t *conn) {
+    for (int i = 0; i < ups->nconns; i++) {
+        if (ups->conns[i] == conn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Sets the ID in the header of `query` to `id`
+void set_query_id(upstream_query_t *query, uint16_t id) {
+    id = htons(id);
+    memcpy(query->data, &id, sizeof(id));
+}
+
+// Sends `query` on the TCP connection at index `i`, writing it right away if
+// the connection is open already
+void send_query(upstream_t *ups, int i, upstream_query_t *query) {
+    conn_t *conn = ups->conns[i];
+    query->conn = conn;
+    query->nattempts++;
+    ups->conn_ninflight[i]++;
+    track_sent(ups, query);
+
+    // copied as it is sent upstream, with its own ID
+    set_query_id(query, query->id);
+    conn_send(conn, query->data, query->len);
+    set_query_id(query, query->client_id);
+    if (conn->state == CONN_OPEN && conn_write(conn) == CONN_IO_ERROR) {
+        drop_conn(ups, i);
+    }
+}
+
+// Advances the TCP connection `conn` in the pool, which epoll reported as
+// ready: finishes connecting, writes the queries queued up, and reads
+// replies.
+void upstream_handle_event(upstream_t *ups, conn_t *conn) {
+    int i = conn_index(ups, conn);
+    if (i < 0 || conn->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn->state == CONN_CONNECTING) {
+        if (conn_finish_connect(conn) == CONN_IO_ERROR) {
+            drop_conn(ups, i);
+            return;
+        }
+        metrics_record(ups->metrics, HIST_UPSTREAM_CONNECT,
+                       get_time_us() - ups->conn_opened[i]);
+    }
+    if (conn_write(conn) == CONN_IO_ERROR) {
+        drop_conn(ups, i);
+        return;
+    }
+
+    conn_io_t status;
+    do {
+        status = conn_read(conn);
+        uint8_t *reply;
+        uint16_t len;
+        while (conn_next_message(conn, &reply, &len)) {
+            handle_tcp_reply(ups, i, reply, len);
+        }
+    } while (status == CONN_IO_DONE && ups->conns[i] == conn);
+
+    if (ups->conns[i] != conn) {
+        // dropped while handling the replies
+        return;
+    }
+    if (status == CONN_IO_EOF || status == CONN_IO_ERROR) {
+        drop_conn(ups, i);
+    } else {
+        dispatch_waiting(ups);
+    }
+}
+
+// Handles the reply `reply` of length `len` read from the TCP connection at
+// index `i`, if it answers a query in flight on it
+void handle_tcp_reply(upstream_t *ups, int i, uint8_t *reply, uint16_t len) {
+    uint16_t id;
+    if (len < HEADER_SIZE) {
+        return;
+    }
+    memcpy(&id, reply, sizeof(id));
+    upstream_query_t *query = ups->inflight[ntohs(id)];
+    if (!query || !query->over_tcp || query->conn != ups->conns[i]) {
+        return;
+    }
+    complete_query(ups, query, reply, len);
+}
+
+// Closes the TCP connection at index `i`, which dropped or failed, making
+// room for a new one. Its queries in flight are sent again (on another
+// connection if possible), unless they were already sent too many times.
+void drop_conn(upstream_t *ups, int i) {
+    conn_t *conn = ups->conns[i];
+    int ninflight = ups->conn_ninflight[i];
+    ups->conns[i] = NULL;
+    ups->conn_ninflight[i] = 0;
+    conn_close(conn);
+
+    for (int id = 0; ninflight > 0 && id < NUM_IDS; id++) {
+        upstream_query_t *query = ups->inflight[id];
+        if (!query || !query->over_tcp || query->conn != conn) {
+            continue;
+        }
+        ninflight--;
+        retry_query(ups, query);
+    }
+    dispatch_waiting(ups);
+}
+
+// Returns the slot of the UDP socket `udp` in the pool, or -1 if it is not
+// in it
+int udp_index(upstream_t *ups, udp_socket_t *udp) {
+    for (int i = 0; i < 2 * ups->nudp; i++) {
+        if (ups->udp_socks[i] == udp) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Queues up `query` to be sent from one of the UDP sockets sent from, picked
+// at random (opening it if needed), by the next upstream_flush(). If the
+// socket cannot be opened, the query fails.
+void send_udp_query(upstream_t *ups, upstream_query_t *query) {
+    int i = ups->udp_active[secure_random(&ups->random) % ups->nudp];
+    if (!ups->udp_socks[i]) {
+        int sockfd = connect_udp(ups->addr);
+        if (sockfd < 0) {
+            fail_query(ups, query);
+            return;
+        }
+        udp_socket_t *udp = new_udp_socket(sockfd, FD_UPSTREAM_UDP);
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = udp};
+        if (epoll_ctl(ups->loop->epfd, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        ups->udp_socks[i] = udp;
+        ups->udp_ninflight[i] = 0;
+        ups->udp_nsent[i] = 0;
+        ups->udp_opened[i] = get_time_ms();
+    }
+
+    query->udp_index = i;
+    query->nattempts++;
+    ups->udp_ninflight[i]++;
+    ups->udp_nsent[i]++;
+    track_sent(ups, query);
+    set_query_id(query, query->id);
+    udp_send(ups->udp_socks[i], &ups->addr->addr, ups->addr->addrlen,
+             query->data, query->len);
+    set_query_id(query, query->client_id);
+}
+
+// Handles a batch of datagrams received by the UDP socket `udp` in the pool
+void upstream_handle_udp_event(upstream_t *ups, udp_socket_t *udp) {
+    if (udp_index(ups, udp) < 0) {
+        return;
+    }
+    udp_batch_t *batch = &udp->recvd;
+    int nrecvd = udp_recv_batch(udp);
+    for (int j = 0; j < nrecvd; j++) {
+        handle_udp_reply(ups, batch->bufs[j], batch->msgs[j].msg_len,
+                         udp_truncated(batch, j));
+    }
+}
+
+// Handles the reply `reply` of length `len` received by a UDP socket in the
+// pool, if it answers a query in flight over UDP (with the same
+// question, so that forged replies are harder to slip in). A late reply to an
+// earlier attempt, sent from another socket, is as good. If the reply is
+// truncated, either by upstream or because it was cut short (`cut_short`) as
+// too large to receive, the query is sent again over TCP.
+void handle_udp_reply(upstream_t *ups, uint8_t *reply, uint16_t len,
+                      bool cut_short) {
+    uint16_t id;
+    if (len < HEADER_SIZE) {
+        return;
+    }
+    memcpy(&id, reply, sizeof(id));
+    upstream_query_t *query = ups->inflight[ntohs(id)];
+    if (!query || query->over_tcp) {
+        return;
+    }
+    uint16_t qend = get_questions_end(query->data, query->len);
+    if (qend == 0 || len < qend ||
+        memcmp(reply + HEADER_SIZE, query->data + HEADER_SIZE,
+               qend - HEADER_SIZE) != 0) {
+        return;
+    }
+
+    if (cut_short || get_truncated(reply, len)) {
+        detach_query(ups, query);
+        query->over_tcp = true;
+        dispatch_query(ups, query);
+        return;
+    }
+    complete_query(ups, query, reply, len);
+}
+
+// Sends every query queued up on the UDP sockets. A socket sent from long
+// enough is replaced by the other slot of its pair (opened on the next query
+// sent from it) as soon as that slot is free, whatever it has in flight.
+// Sockets no longer sent from are closed once nothing is in flight on them.
+void upstream_flush(upstream_t *ups) {
+    uint64_t now = get_time_ms();
+    for (int i = 0; i < 2 * ups->nudp; i++) {
+        if (!ups->udp_socks[i]) {
+            continue;
+        }
+        udp_flush(ups->udp_socks[i]);
+        int pair = i % ups->nudp;
+        int other = (i + ups->nudp) % (2 * ups->nudp);
+        if (ups->udp_active[pair] != i) {
+            if (ups->udp_ninflight[i] == 0) {
+                free_udp_socket(ups->udp_socks[i]);
+                ups->udp_socks[i] = NULL;
+            }
+        } else if (!ups->udp_socks[other] &&
+                   (ups->udp_nsent[i] >= UPSTREAM_UDP_ROTATE ||
+                    now - ups->udp_opened[i] >= UPSTREAM_UDP_ROTATE_MS)) {
+            ups->udp_active[pair] = other;
+        }
+    }
+}
+
+// Returns the number of milliseconds from `now` until a query sent to
+// upstream should be given up on, or -1 if none were sent
+int upstream_next_timeout(upstream_t *ups, uint64_t now) {
+    if (!ups->sent_head) {
+        return -1;
+    }
+    if (ups->sent_head->deadline <= now) {
+        return 0;
+    }
+    return ups->sent_head->deadline - now;
+}
+
+// Sends again every query sent to upstream that was not replied to by `now`,
+// unless they were already sent too many times
+void upstream_expire(upstream_t *ups, uint64_t now) {
+    while (ups->sent_head && ups->sent_head->deadline <= now) {
+        retry_query(ups, ups->sent_head);
+    }
+}
+
+// Keeps track of `query`, just sent, in order of when to give up on it. As
+// every query waits as long, this is the order they were sent in.
+void track_sent(upstream_t *ups, upstream_query_t *query) {
+    query->sent_time = get_time_us();
+    query->deadline = get_time_ms() + UPSTREAM_TIMEOUT_MS;
+    query->next_sent = NULL;
+    query->prev_sent = ups->sent_tail;
+    if (ups->sent_tail) {
+        ups->sent_tail->next_sent = query;
+    } else {
+        ups->sent_head = query;
+    }
+    ups->sent_tail = query;
+}
+
+// Stops keeping track of `query` as sent on any socket, if it was
+void detach_query(upstream_t *ups, upstream_query_t *query) {
+    if (query->deadline == 0) {
+        return;
+    }
+    if (query->prev_sent) {
+        query->prev_sent->next_sent = query->next_sent;
+    } else {
+        ups->sent_head = query->next_sent;
+    }
+    if (query->next_sent) {
+        query->next_sent->prev_sent = query->prev_sent;
+    } else {
+        ups->sent_tail = query->prev_sent;
+    }
+    query->prev_sent = query->next_sent = NULL;
+    query->deadline = 0;
+
+    if (query->over_tcp) {
+        int i = conn_index(ups, query->conn);
+        if (i >= 0) {
+            ups->conn_ninflight[i]--;
+        }
+        query->conn = NULL;
+    } else {
+        ups->udp_ninflight[query->udp_index]--;
+        query->udp_index = -1;
+    }
+}
+
+// Done with `query`, replied to with `reply` of length `len`: the callback
+// is called with the reply, its ID restored. The query is not touched after,
+// as the callback may free it.
+void complete_query(upstream_t *ups, upstream_query_t *query, uint8_t *reply,
+                    uint16_t len) {
+    metrics_record(ups->metrics, HIST_UPSTREAM_RTT,
+                   get_time_us() - query->sent_time);
+    detach_query(ups, query);
+    ups->inflight[query->id] = NULL;
+    ups->ninflight--;
+
+    uint16_t id = htons(query->client_id);
+    memcpy(reply, &id, sizeof(id));
+    ups->callback(ups->ctx, query->arg, reply, len);
+}
+
+// Sends `query` again, as it was not replied to, unless it was already sent
+// too many times, in which case it fails.
+void retry_query(upstream_t *ups, upstream_query_t *query) {
+    detach_query(ups, query);
+    if (query->nattempts >= UPSTREAM_MAX_ATTEMPTS) {
+        fail_query(ups, query);
+    } else {
+        dispatch_query(ups, query);
+    }
+}
+
+// Gives up on `query`: the callback is called without a reply (and may free
+// the query)
+void fail_query(upstream_t *ups, upstream_query_t *query) {
+    detach_query(ups, query);
+    ups->inflight[query->id] = NULL;
+    ups->ninflight--;
+
+    ups->callback(ups->ctx, query->arg, NULL, 0);
+}
@@ -0,0 +1,112 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Upstream module containing functions for forwarding queries to the
+ * upstream server, either over a small set of UDP sockets, or over a pool of
+ * long-lived TCP connections. Many queries are in flight at once: each is
+ * sent with a random ID unique within the pool, so replies can be matched
+ * back to the query no matter the order they arrive in, or which socket they
+ * arrive on. Over TCP, many queries are in flight on each connection
+ * (pipelining, RFC 7766), and connections that drop are reopened, their
+ * queries sent again. Over UDP, queries whose replies are truncated are sent
+ * again over TCP.
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "conn.h"
+#include "metrics.h"
+#include "net.h"
+#include "udp.h"
+#include "util.h"
+
+// the number of possible DNS message IDs
+#define NUM_IDS (UINT16_MAX + 1)
+
+// Called with the reply `reply` of length `len` to a query forwarded with
+// argument `arg`, its ID restored to the original one. If the query could
+// not be answered by upstream, `reply` is NULL instead. `ctx` is the context
+// the pool was created with. The reply is only valid during the call.
+typedef void (*upstream_callback_t)(void *ctx, void *arg, uint8_t *reply,
+                                    uint16_t len);
+
+// A query forwarded to upstream, waiting for a connection or a reply
+typedef struct upstream_query upstream_query_t;
+struct upstream_query {
+    uint16_t id;         // the ID of the query as sent upstream
+    uint16_t client_id;  // the ID of the query as given
+    uint8_t *data;       // the query as given, its ID rewritten only to send
+    uint16_t len;
+    void *arg;
+    bool over_tcp;
+    conn_t *conn;   // TCP: the connection it was sent on, NULL if waiting
+    int udp_index;  // UDP: the slot of the socket it was sent on
+    int nattempts;
+    uint64_t sent_time;  // when last sent, in µs
+
+    // queries sent are kept in order of when to give up waiting on them
+    uint64_t deadline;
+    upstream_query_t *prev_sent;
+    upstream_query_t *next_sent;
+
+    upstream_query_t *next_waiting;
+};
+
+// A pool of sockets to the upstream server at `addr`, along with the queries
+// in flight on them (indexed by the ID they were sent with), those sent in
+// order of their deadlines, and those waiting for room on a TCP connection.
+// How long upstream takes to connect to and reply is recorded in `metrics`.
+typedef struct {
+    conn_loop_t *loop;
+    net_addr_t *addr;
+    upstream_callback_t callback;
+    void *ctx;
+    bool over_udp;
+    metrics_t *metrics;
+
+    int nconns;
+    conn_t **conns;
+    int *conn_ninflight;
+    uint64_t *conn_opened;  // when each connection started opening, in µs
+
+    // UDP sockets come in pairs of slots: one is sent from, while the other,
+    // replaced not long ago, only waits for the replies still due to it
+    int nudp;
+    udp_socket_t **udp_socks;
+    int *udp_ninflight;
+    int *udp_nsent;
+    uint64_t *udp_opened;  // when each socket was opened, in ms
+    int *udp_active;       // which slot of each pair is sent from
+
+    upstream_query_t **inflight;
+    int ninflight;
+    random_pool_t random;
+
+    upstream_query_t *sent_head;
+    upstream_query_t *sent_tail;
+
+    upstream_query_t *waiting_head;
+    upstream_query_t *waiting_tail;
+} upstream_t;
+
+upstream_t *new_upstream(conn_loop_t *loop, net_addr_t *addr, int nconns,
+                         bool over_udp, upstream_callback_t callback,
+                         void *ctx, metrics_t *metrics);
+void free_upstream(upstream_t *ups);
+
+void upstream_send(upstream_t *ups, arena_t *arena, uint8_t *query,
+                   uint16_t len, void *arg);
+void upstream_handle_event(upstream_t *ups, conn_t *conn);
+void upstream_handle_udp_event(upstream_t *ups, udp_socket_t *udp);
+void upstream_flush(upstream_t *ups);
+
+int upstream_next_timeout(upstream_t *ups, uint64_t now);
+void upstream_expire(upstream_t *ups, uint64_t now);
+
+#endif
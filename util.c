@@ -5,12 +5,18 @@
  * Util module containing miscellaneous functions
  */
 
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "util.h"
 
@@ -60,9 +66,108 @@ size_t write_fully(int fd, uint8_t *buf, size_t nbytes) {
 // length `len`, formatted like 2021-05-10T02:07:11+0000. Returns a pointer
 // to `timestamp`
 char *get_timestamp(char *timestamp, size_t len) {
-    const time_t rawtime = time(NULL);
-    struct tm *tm = gmtime(&rawtime);
+    return format_timestamp(timestamp, len, time(NULL));
+}
+
+// Put the time `rawtime` in `timestamp`, which has length `len`, formatted
+// like get_timestamp(). Returns a pointer to `timestamp`.
+char *format_timestamp(char *timestamp, size_t len, time_t rawtime) {
+    struct tm tm;
+    gmtime_r(&rawtime, &tm);
 
-    strftime(timestamp, len, "%FT%T%z", tm);
+    strftime(timestamp, len, "%FT%T%z", &tm);
     return timestamp;
 }
+
+// Parses the time in `timestamp`, formatted like get_timestamp(), into
+// `rawtime`. Returns a pointer to the first character after it, or NULL if
+// there is no such time.
+char *parse_timestamp(char *timestamp, time_t *rawtime) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(timestamp, "%Y-%m-%dT%H:%M:%S%z", &tm);
+    if (end) {
+        *rawtime = timegm(&tm) - tm.tm_gmtoff;
+    }
+    return end;
+}
+
+// Returns the current time in milliseconds, from a clock that only moves
+// forward (so it is only meaningful compared to another such time)
+uint64_t get_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Returns the current time in microseconds, from the same clock as
+// get_time_ms()
+uint64_t get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Returns a random number from the kernel, suitable to seed next_random()
+// with. Falls back on the time and process ID if there is none.
+uint32_t random_seed(void) {
+    uint32_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    }
+    // the generator is stuck at 0
+    return seed ? seed : 1;
+}
+
+// Advances the (xorshift) random number generator with the non-zero state
+// `state` and returns the next pseudo-random number. Cheap, but not meant
+// to resist an attacker who sees many of its outputs.
+uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Initialises the empty pool of random bytes `pool`, filled on first use
+void init_random_pool(random_pool_t *pool) {
+    pool->used = RANDOM_POOL_SIZE;
+}
+
+// Returns a random number from the kernel's cryptographically secure
+// generator, by way of `pool`, refilled when it runs out. Exits if error.
+uint32_t secure_random(random_pool_t *pool) {
+    uint32_t x;
+    if (pool->used + sizeof(x) > RANDOM_POOL_SIZE) {
+        ssize_t nread;
+        do {
+            nread = getrandom(pool->buf, RANDOM_POOL_SIZE, 0);
+        } while (nread < 0 && errno == EINTR);
+        if (nread != RANDOM_POOL_SIZE) {
+            perror("getrandom");
+            exit(EXIT_FAILURE);
+        }
+        pool->used = 0;
+    }
+    memcpy(&x, pool->buf + pool->used, sizeof(x));
+    pool->used += sizeof(x);
+    return x;
+}
+
+// Returns the contents of the file at `path`, allocated, and puts its size in
+// `size`. Exits if error.
+uint8_t *read_file(char *path, size_t *size) {
+    FILE *fp = fopen(path, "rb");
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    assert(data);
+    *size = fread(data, 1, st.st_size, fp);
+    fclose(fp);
+    return data;
+}
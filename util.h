@@ -10,11 +10,33 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 #define TIMESTAMP_LEN 41  // maximum length based on ISO 8601 limits
+// number of random bytes fetched from the kernel at once (getrandom() never
+// returns fewer, once the kernel has entropy, up to 256)
+#define RANDOM_POOL_SIZE 256
+
+// Random bytes from the kernel, handed out a few at a time, so that numbers
+// an attacker cannot predict cost a system call only once in a while
+typedef struct {
+    uint8_t buf[RANDOM_POOL_SIZE];
+    size_t used;
+} random_pool_t;
 
 size_t read_fully(int fd, uint8_t *buf, size_t nbytes);
 size_t write_fully(int fd, uint8_t *buf, size_t nbytes);
 char *get_timestamp(char *timestamp, size_t len);
+char *format_timestamp(char *timestamp, size_t len, time_t rawtime);
+char *parse_timestamp(char *timestamp, time_t *rawtime);
+uint64_t get_time_ms(void);
+uint64_t get_time_us(void);
+
+uint32_t random_seed(void);
+uint32_t next_random(uint32_t *state);
+void init_random_pool(random_pool_t *pool);
+uint32_t secure_random(random_pool_t *pool);
+
+uint8_t *read_file(char *path, size_t *size);
 
 #endif
@@ -0,0 +1,959 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Worker module containing the event loop of the DNS server: it accepts
+ * clients over TCP and UDP, and serves their requests either from the cache
+ * or by forwarding them upstream, without ever blocking on a single client
+ * or upstream. Each worker runs in its own thread, with its own listening
+ * sockets.
+ */
+
+#define _GNU_SOURCE
+#include "worker.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cache_entry.h"
+#include "dns_message.h"
+#include "util.h"
+
+// maximum number of connection requests to be queued up
+#define CONNECTION_QUEUE_SIZE SOMAXCONN
+// maximum number of events handled per call to epoll_wait()
+#define MAX_EVENTS 256
+// maximum number of requests from one TCP client in flight at once, beyond
+// which reading from it pauses
+#define CLIENT_MAX_PIPELINE 64
+// the number of refreshes of the cache a worker may start per second, and at
+// once, so that they cannot crowd out the requests of clients upstream
+#define REFRESH_RATE 50
+#define REFRESH_BURST 50
+// how long a client waits on upstream before being replied to with the
+// expired reply in the cache, if any (the client response timer of RFC 8767)
+#define STALE_DEADLINE_MS 1800
+
+void *worker_thread(void *arg);
+
+void accept_clients(worker_t *worker);
+void handle_client_event(worker_t *worker, conn_t *client, uint32_t events);
+void read_client(worker_t *worker, conn_t *client);
+void take_queries(worker_t *worker, conn_t *client);
+bool client_is_busy(conn_t *client);
+void resume_clients(worker_t *worker);
+void close_client_if_done(conn_t *client);
+void handle_udp_event(worker_t *worker);
+
+request_t *new_request(worker_t *worker, uint8_t *data, uint16_t len);
+void free_request(worker_t *worker, request_t *request);
+
+void handle_query(worker_t *worker, request_t *request, bool cache_missed);
+void handle_reply(void *ctx, void *arg, uint8_t *reply, uint16_t len);
+void respond(worker_t *worker, request_t *request, uint8_t *reply,
+             uint16_t len);
+void reply_to_client(worker_t *worker, request_t *request, uint8_t *reply,
+                     uint16_t len);
+void respond_with_error(worker_t *worker, request_t *request, uint8_t rcode);
+void send_reply(conn_t *client, uint8_t *reply, uint16_t len);
+
+uint16_t reply_from_cache(worker_t *worker, uint8_t *data, uint16_t len,
+                          bool *missed);
+bool respond_from_cache(worker_t *worker, request_t *request, char *name);
+uint16_t get_cached_reply(worker_t *worker, uint8_t *query, uint16_t qend,
+                          uint16_t max_len, time_t *expiry_time,
+                          bool *refresh);
+bool may_refresh(worker_t *worker);
+void refresh_entry(worker_t *worker, uint8_t *query, uint16_t len);
+void start_refreshes(worker_t *worker);
+void forward_message(worker_t *worker, request_t *request);
+bool wait_on_pending(worker_t *worker, request_t *request);
+void remove_pending(worker_t *worker, request_t *request);
+void respond_to_waiters(worker_t *worker, request_t *request, uint8_t *reply,
+                        uint16_t len);
+void start_deadline(worker_t *worker, request_t *request);
+void stop_deadline(worker_t *worker, request_t *request);
+int next_timeout(worker_t *worker, uint64_t now);
+void expire_deadlines(worker_t *worker, uint64_t now);
+bool serve_stale(worker_t *worker, request_t *request);
+uint16_t get_stale_reply(worker_t *worker, request_t *request);
+void cache_reply(worker_t *worker, dns_message_t *msg_reply, arena_t *arena);
+
+void log_cached_reply(worker_t *worker, char *name, uint16_t qend,
+                      uint16_t len, time_t expiry_time);
+
+// Creates and returns a new worker with number `id`, listening for TCP and
+// UDP on `port`, forwarding requests to the upstream server at `ups_addr`
+// over up to `ups_nconns` connections (over UDP first if `ups_over_udp`),
+// caching answers in `cache` and logging its events with `logger`. The
+// worker is pinned to CPU `cpu` once started, unless it is -1. Exits if
+// error.
+worker_t *new_worker(int id, int cpu, const char *port, net_addr_t *ups_addr,
+                     int ups_nconns, bool ups_over_udp, cache_t *cache,
+                     logger_t *logger) {
+    worker_t *worker = malloc(sizeof(*worker));
+    assert(worker);
+
+    worker->id = id;
+    worker->cpu = cpu;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    init_conn_loop(&worker->loop, epfd);
+    init_metrics(&worker->metrics);
+    worker->upstream =
+        new_upstream(&worker->loop, ups_addr, ups_nconns, ups_over_udp,
+                     handle_reply, worker, &worker->metrics);
+    worker->cache = cache;
+    init_slab(&worker->request_blocks, REQUEST_ARENA_SIZE, SLAB_SIZE);
+    worker->pending = calloc(PENDING_TABLE_SIZE, sizeof(*worker->pending));
+    assert(worker->pending);
+    worker->deadline_head = NULL;
+    worker->deadline_tail = NULL;
+    worker->reply_buf = malloc(MAX_MESSAGE_SIZE);
+    assert(worker->reply_buf);
+    worker->refresh_tokens = REFRESH_BURST;
+    worker->refresh_time = get_time_ms();
+    worker->refreshes = NULL;
+    worker->logger = logger;
+
+    // queue up to some number of connection requests
+    worker->listener.kind = FD_LISTENER;
+    worker->listener.fd = setup_server_socket(port, SOCK_STREAM);
+    if (listen(worker->listener.fd, CONNECTION_QUEUE_SIZE) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = {.events = EPOLLIN,
+                                .data.ptr = &worker->listener};
+    if (epoll_ctl(worker->loop.epfd, EPOLL_CTL_ADD, worker->listener.fd,
+                  &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    worker->udp =
+        new_udp_socket(setup_server_socket(port, SOCK_DGRAM), FD_UDP);
+    event.data.ptr = worker->udp;
+    if (epoll_ctl(worker->loop.epfd, EPOLL_CTL_ADD, worker->udp->fd,
+                  &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    return worker;
+}
+
+// Frees a worker, closing its listening sockets, its connections to upstream
+// and epoll instance
+void free_worker(worker_t *worker) {
+    free_upstream(worker->upstream);
+    conn_loop_free_closed(&worker->loop);
+    while (worker->refreshes) {
+        request_t *request = worker->refreshes;
+        worker->refreshes = request->next_pending;
+        free_request(worker, request);
+    }
+    free_udp_socket(worker->udp);
+    close(worker->listener.fd);
+    close(worker->loop.epfd);
+    destroy_slab(&worker->request_blocks);
+    free(worker->pending);
+    free(worker->reply_buf);
+    free(worker);
+}
+
+// Starts running the event loop of `worker` in a new thread. Exits if error.
+void worker_start(worker_t *worker) {
+    int status = pthread_create(&worker->thread, NULL, worker_thread, worker);
+    if (status != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(status));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Waits for the thread of `worker` to finish
+void worker_join(worker_t *worker) {
+    pthread_join(worker->thread, NULL);
+}
+
+// The start routine of a worker thread, given the worker `arg`: pins the
+// thread to the worker's CPU if needed, then runs its event loop.
+void *worker_thread(void *arg) {
+    worker_t *worker = arg;
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        int status =
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (status != 0) {
+            // still usable, just not pinned
+            fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(status));
+        }
+    }
+    worker_run(worker);
+    return NULL;
+}
+
+// Runs the event loop of `worker`, forever. Exits if error.
+void worker_run(worker_t *worker) {
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        // wake up in time to give up on queries upstream did not reply to,
+        // or to reply stale to clients it is too slow for
+        int timeout = next_timeout(worker, get_time_ms());
+        int nevents =
+            epoll_wait(worker->loop.epfd, events, MAX_EVENTS, timeout);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            fd_kind_t *kind = events[i].data.ptr;
+            switch (*kind) {
+            case FD_LISTENER:
+                accept_clients(worker);
+                break;
+            case FD_CLIENT:
+                handle_client_event(worker, events[i].data.ptr,
+                                    events[i].events);
+                break;
+            case FD_UPSTREAM:
+                upstream_handle_event(worker->upstream, events[i].data.ptr);
+                break;
+            case FD_UDP:
+                handle_udp_event(worker);
+                break;
+            case FD_UPSTREAM_UDP:
+                upstream_handle_udp_event(worker->upstream,
+                                          events[i].data.ptr);
+                break;
+            }
+        }
+        upstream_expire(worker->upstream, get_time_ms());
+        expire_deadlines(worker, get_time_ms());
+        resume_clients(worker);
+        start_refreshes(worker);
+        // queries and replies over UDP are sent all at once
+        upstream_flush(worker->upstream);
+        udp_flush(worker->udp);
+        // only now can no event refer to a closed connection
+        conn_loop_free_closed(&worker->loop);
+    }
+}
+
+// Accepts every client connection queued up for the listening socket
+void accept_clients(worker_t *worker) {
+    int sockfd;
+    while ((sockfd = accept_client_connection(worker->listener.fd)) >= 0) {
+        new_conn(sockfd, &worker->loop, FD_CLIENT, CONN_OPEN);
+    }
+}
+
+// Advances the connection `client` given the epoll `events` for it: writes
+// the replies queued up, and reads requests.
+void handle_client_event(worker_t *worker, conn_t *client, uint32_t events) {
+    if (client->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn_write(client) == CONN_IO_ERROR) {
+        conn_close(client);
+        return;
+    }
+    if (client->paused && !client_is_busy(client)) {
+        // its replies were written out, making room for more requests
+        conn_mark_ready(client);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        // anything left to read is read before noticing a hang up
+        read_client(worker, client);
+    }
+    close_client_if_done(client);
+}
+
+// Reads as much as is available from `client`, and handles every whole
+// request read
+void read_client(worker_t *worker, conn_t *client) {
+    conn_io_t status;
+    do {
+        status = conn_read(client);
+        take_queries(worker, client);
+    } while (status == CONN_IO_DONE && !client->paused &&
+             client->state == CONN_OPEN);
+    if (status == CONN_IO_ERROR) {
+        conn_close(client);
+    }
+}
+
+// Handles the requests read from `client` so far, as long as it is not busy,
+// see client_is_busy(). If it is, reading from it pauses until some requests
+// are replied to, or their replies written out. Requests are timed from when
+// they were read, however long they waited to be taken.
+void take_queries(worker_t *worker, conn_t *client) {
+    uint8_t *data;
+    uint16_t len;
+    uint64_t received_time = client->read_time;
+    while (client->state == CONN_OPEN && !client_is_busy(client) &&
+           conn_next_message(client, &data, &len)) {
+        metrics_count(&worker->metrics, METRIC_QUERIES);
+        bool missed;
+        uint16_t reply_len = reply_from_cache(worker, data, len, &missed);
+        if (reply_len > 0) {
+            send_reply(client, worker->reply_buf, reply_len);
+            metrics_record(&worker->metrics, HIST_RESPONSE,
+                           get_time_us() - received_time);
+            continue;
+        }
+        request_t *request = new_request(worker, data, len);
+        if (!request) {
+            continue;
+        }
+        request->received_time = received_time;
+        request->client = client;
+        conn_ref(client);
+        handle_query(worker, request, missed);
+    }
+    if (client->state == CONN_OPEN) {
+        conn_pause(client, client_is_busy(client));
+    }
+}
+
+// Returns true if `client` is to be sent no more replies for now: it has too
+// many requests in flight already, or too many bytes of replies it is yet to
+// read
+bool client_is_busy(conn_t *client) {
+    return client->refs >= CLIENT_MAX_PIPELINE || conn_is_backlogged(client);
+}
+
+// Handles the requests read but not yet handled from each client marked
+// ready, as replies made room for them. This is done from the event loop,
+// rather than as each reply is sent, so that handling a request cannot lead
+// to handling the next of the same client deeper down the stack.
+void resume_clients(worker_t *worker) {
+    conn_t *client;
+    while ((client = conn_loop_next_ready(&worker->loop))) {
+        conn_unref(client);
+        if (client->state == CONN_OPEN) {
+            take_queries(worker, client);
+            close_client_if_done(client);
+        }
+    }
+}
+
+// Closes `client` if it hung up, and all its requests have been replied to
+void close_client_if_done(conn_t *client) {
+    if (client->eof && client->refs == 0 && conn_is_idle(client)) {
+        conn_close(client);
+    }
+}
+
+// Handles a batch of datagrams received by the UDP socket of `worker`: each
+// is a request, replied to over UDP. Replies from the cache that every client
+// accepts are sent straight away; longer ones are only checked against what
+// the client accepts once its query is parsed.
+void handle_udp_event(worker_t *worker) {
+    udp_batch_t *batch = &worker->udp->recvd;
+    int nrecvd = udp_recv_batch(worker->udp);
+    uint64_t received_time = get_time_us();
+    for (int i = 0; i < nrecvd; i++) {
+        if (udp_truncated(batch, i)) {
+            // too large to be a query worth answering
+            continue;
+        }
+        metrics_count(&worker->metrics, METRIC_QUERIES);
+        bool missed;
+        uint16_t reply_len = reply_from_cache(worker, batch->bufs[i],
+                                              batch->msgs[i].msg_len,
+                                              &missed);
+        if (reply_len > 0 && reply_len <= UDP_MIN_SIZE) {
+            udp_send(worker->udp, &batch->addrs[i],
+                     batch->msgs[i].msg_hdr.msg_namelen, worker->reply_buf,
+                     reply_len);
+            metrics_record(&worker->metrics, HIST_RESPONSE,
+                           get_time_us() - received_time);
+            continue;
+        }
+        request_t *request =
+            new_request(worker, batch->bufs[i], batch->msgs[i].msg_len);
+        if (!request) {
+            continue;
+        }
+        request->received_time = received_time;
+        request->over_udp = true;
+        memcpy(&request->addr, &batch->addrs[i],
+               batch->msgs[i].msg_hdr.msg_namelen);
+        request->addrlen = batch->msgs[i].msg_hdr.msg_namelen;
+        if (reply_len > 0) {
+            respond(worker, request, worker->reply_buf, reply_len);
+        } else {
+            handle_query(worker, request, missed);
+        }
+    }
+}
+
+// Creates and returns a new request of `worker` for the query `data` of
+// length `len` (this function will copy it), in a new arena over a block of
+// the worker's, or returns NULL if the query is malformed. Where to reply to
+// is left for the caller to fill in.
+request_t *new_request(worker_t *worker, uint8_t *data, uint16_t len) {
+    arena_t arena;
+    init_arena(&arena, slab_alloc(&worker->request_blocks),
+               REQUEST_ARENA_SIZE);
+    request_t *request = arena_alloc(&arena, sizeof(*request));
+    request->arena = arena;
+
+    uint8_t *query = arena_alloc(&request->arena, len);
+    memcpy(query, data, len);
+    if (!init_dns_message(&request->query, query, len)) {
+        free_request(worker, request);
+        return NULL;
+    }
+    request->over_udp = false;
+    request->client = NULL;
+    request->addrlen = 0;
+    request->received_time = 0;
+    request->hash = 0;
+    request->next_pending = NULL;
+    request->waiters = NULL;
+    request->next_waiter = NULL;
+    request->served_stale = false;
+    request->deadline = 0;
+    request->prev_deadline = NULL;
+    request->next_deadline = NULL;
+
+    return request;
+}
+
+// Frees a request of `worker`, along with everything allocated for it, by
+// resetting its arena
+void free_request(worker_t *worker, request_t *request) {
+    arena_t arena = request->arena;  // the request is in its own arena
+    arena_reset(&arena);
+    slab_free(&worker->request_blocks, arena.base);
+}
+
+// Handles a request just received: respond to it right away if possible,
+// otherwise forward it upstream, logging events. If `cache_missed`, its
+// question was looked up in the cache already, see reply_from_cache(), and
+// is not there.
+void handle_query(worker_t *worker, request_t *request, bool cache_missed) {
+    dns_message_t *msg_send = &request->query;
+    query_t *question = &msg_send->question;
+    char name[MAX_NAME_SIZE];
+    if (msg_send->qdcount > 0) {
+        get_name(msg_send->data, msg_send->size, question->qname.offset, name);
+        log_query(worker->logger, name);
+    }
+    // queries of any type are forwarded as they are, but only standard queries
+    // with a question can be: log and respond to the others with RCODE 4
+    if (msg_send->qdcount == 0 || msg_send->opcode != QUERY_OPCODE) {
+        log_unimplemented(worker->logger);
+        metrics_count(&worker->metrics, METRIC_UNIMPLEMENTED);
+        respond_with_error(worker, request, NOT_IMPLEMENTED_RCODE);
+        return;
+    }
+
+    // get from cache if possible, otherwise wait on an identical request
+    // already forwarded, if any, or forward to upstream
+    if ((cache_missed || !respond_from_cache(worker, request, name)) &&
+        !wait_on_pending(worker, request)) {
+        forward_message(worker, request);
+    }
+}
+
+// Handles the reply `reply` of length `len` from upstream to the request
+// `arg` (by the worker `ctx`): cache and log it once, then relay it to the
+// client that made the request, and to those of the requests waiting on it.
+// If upstream failed to reply, the clients are sent the expired reply in the
+// cache if any, otherwise a server failure reply. A request replied to stale
+// already only has the cache to update.
+void handle_reply(void *ctx, void *arg, uint8_t *reply, uint16_t len) {
+    worker_t *worker = ctx;
+    request_t *request = arg;
+
+    remove_pending(worker, request);
+    stop_deadline(worker, request);
+    if (!reply) {
+        metrics_count(&worker->metrics, METRIC_UPSTREAM_FAILURES);
+        serve_stale(worker, request);
+        respond_to_waiters(worker, request, NULL, 0);
+        if (request->over_udp || request->client) {
+            respond_with_error(worker, request, SERVER_FAILURE_RCODE);
+        } else {
+            // a refresh, or a request replied to stale: no one to reply to
+            free_request(worker, request);
+        }
+        return;
+    }
+    // a reply that cannot be parsed is relayed all the same, uncached
+    dns_message_t msg_reply;
+    if (init_dns_message(&msg_reply, reply, len)) {
+        cache_reply(worker, &msg_reply, &request->arena);
+    }
+    // the waiters first: responding may truncate `reply` in place
+    respond_to_waiters(worker, request, reply, len);
+    respond(worker, request, reply, len);
+}
+
+// Relays the reply `reply` of length `len` to `request` to each request
+// waiting on it, made its own (with the ID and question of the request it is
+// for) in the worker's buffer. If `reply` is NULL, they are sent a server
+// failure reply instead. The waiting requests are done with after.
+void respond_to_waiters(worker_t *worker, request_t *request, uint8_t *reply,
+                        uint16_t len) {
+    request_t *waiter = request->waiters;
+    request->waiters = NULL;
+    while (waiter) {
+        request_t *next = waiter->next_waiter;
+        if (!reply) {
+            respond_with_error(worker, waiter, SERVER_FAILURE_RCODE);
+        } else {
+            memcpy(worker->reply_buf, reply, len);
+            set_reply_query(worker->reply_buf, len, waiter->query.data,
+                            waiter->query.questions_end);
+            respond(worker, waiter, worker->reply_buf, len);
+        }
+        waiter = next;
+    }
+}
+
+// Replies to `request` with `reply` of length `len`, see reply_to_client(),
+// then frees the request
+void respond(worker_t *worker, request_t *request, uint8_t *reply,
+             uint16_t len) {
+    reply_to_client(worker, request, reply, len);
+    free_request(worker, request);
+}
+
+// Replies to the client of `request` with `reply` of length `len`, over the
+// transport the request arrived on, after which the request has no client.
+// Over UDP, a reply larger than the client accepts is truncated (in place),
+// so the client retries over TCP. How much the client accepts is only looked
+// up in its query if the reply is longer than every client accepts.
+void reply_to_client(worker_t *worker, request_t *request, uint8_t *reply,
+                     uint16_t len) {
+    // a refresh of the cache has no client to reply to
+    conn_t *client = request->client;
+    if (!request->over_udp && !client) {
+        return;
+    }
+    metrics_record(&worker->metrics, HIST_RESPONSE,
+                   get_time_us() - request->received_time);
+
+    if (request->over_udp) {
+        if (len > UDP_MIN_SIZE &&
+            len > get_udp_payload_size(&request->query, UDP_MIN_SIZE,
+                                       UDP_MAX_SIZE)) {
+            len = truncate_reply(reply, len);
+        }
+        udp_send(worker->udp, &request->addr, request->addrlen, reply, len);
+        request->over_udp = false;
+        return;
+    }
+
+    // if the client hung up, there is no one to reply to
+    if (client->state == CONN_OPEN) {
+        send_reply(client, reply, len);
+    }
+    request->client = NULL;
+    conn_unref(client);
+
+    if (client->state == CONN_OPEN) {
+        if (client->paused && !client_is_busy(client)) {
+            // there is room for the requests read but not yet handled, taken
+            // once back in the event loop
+            conn_mark_ready(client);
+        }
+        close_client_if_done(client);
+    }
+}
+
+// Replies to `request` with no answers and RCODE `rcode`, put together in
+// the worker's buffer, see respond()
+void respond_with_error(worker_t *worker, request_t *request, uint8_t rcode) {
+    uint16_t len = make_error_reply(&request->query, rcode, worker->reply_buf);
+    respond(worker, request, worker->reply_buf, len);
+}
+
+// Queues up the reply `reply` of length `len` to be written to `client`,
+// writing as much of it as possible right away.
+void send_reply(conn_t *client, uint8_t *reply, uint16_t len) {
+    conn_send(client, reply, len);
+    if (conn_write(client) == CONN_IO_ERROR) {
+        conn_close(client);
+    }
+}
+
+// Replies to the query `data` of length `len` from the cache, straight from
+// the buffer it was received in, if it is a plain query whose reply is
+// cached, and log events. It is not parsed into a dns_message_t: only the end
+// of its question is found, to look it up by. Returns the length of the reply
+// put together in the worker's buffer, or 0 if the query is to be handled in
+// full, see handle_query(). `missed` is set to whether it was looked up and
+// is not in the cache, so that it need not be looked up again.
+uint16_t reply_from_cache(worker_t *worker, uint8_t *data, uint16_t len,
+                          bool *missed) {
+    *missed = false;
+    if (!is_plain_query(data, len)) {
+        return 0;
+    }
+    uint16_t qend = get_questions_end(data, len);
+    if (qend == 0) {
+        return 0;
+    }
+    time_t expiry_time;
+    bool refresh;
+    uint16_t reply_len = get_cached_reply(worker, data, qend,
+                                          MAX_MESSAGE_SIZE, &expiry_time,
+                                          &refresh);
+    if (reply_len == 0) {
+        metrics_count(&worker->metrics, METRIC_CACHE_MISSES);
+        *missed = true;
+        return 0;
+    }
+
+    char name[MAX_NAME_SIZE];
+    get_name(data, len, HEADER_SIZE, name);
+    log_query(worker->logger, name);
+    log_cached_reply(worker, name, qend, reply_len, expiry_time);
+    if (refresh) {
+        refresh_entry(worker, data, len);
+    }
+    return reply_len;
+}
+
+// Replies to `request` from the cache, if it holds a reply to its question,
+// with name `name`, and log events. Returns false if there is no such reply.
+bool respond_from_cache(worker_t *worker, request_t *request, char *name) {
+    dns_message_t *msg_query = &request->query;
+    time_t expiry_time;
+    bool refresh;
+    uint16_t len = get_cached_reply(worker, msg_query->data,
+                                    msg_query->questions_end,
+                                    MAX_MESSAGE_SIZE, &expiry_time, &refresh);
+    if (len == 0) {
+        metrics_count(&worker->metrics, METRIC_CACHE_MISSES);
+        return false;
+    }
+    log_cached_reply(worker, name, msg_query->questions_end, len,
+                     expiry_time);
+    if (refresh) {
+        refresh_entry(worker, msg_query->data, msg_query->size);
+    }
+    respond(worker, request, worker->reply_buf, len);
+    return true;
+}
+
+// Puts together a reply to the query `query`, whose questions end at `qend`,
+// in the worker's buffer, from the cache if it holds one no longer than
+// `max_len`. The reply is copied straight from the cache, with only its ID
+// and TTLs to patch. When it expires is put in `expiry_time`, and whether
+// the caller is to refresh it, see refresh_entry(), in `refresh`. Returns the
+// length of the reply, or 0 if there is no such reply.
+uint16_t get_cached_reply(worker_t *worker, uint8_t *query, uint16_t qend,
+                          uint16_t max_len, time_t *expiry_time,
+                          bool *refresh) {
+    cache_key_t key = {.question = query + HEADER_SIZE,
+                       .len = qend - HEADER_SIZE};
+    *refresh = false;
+    uint16_t len = cache_get(worker->cache, &key, worker->reply_buf, max_len,
+                             expiry_time, may_refresh(worker) ? refresh : NULL);
+    if (len > 0) {
+        set_reply_query(worker->reply_buf, len, query, qend);
+        metrics_count(&worker->metrics, METRIC_CACHE_HITS);
+    }
+    return len;
+}
+
+// Returns true if `worker` may start a refresh of the cache now. Refreshes
+// are limited by a token bucket: tokens accrue at REFRESH_RATE per second, up
+// to REFRESH_BURST, and each refresh takes one.
+bool may_refresh(worker_t *worker) {
+    uint64_t now = get_time_ms();
+    worker->refresh_tokens += (now - worker->refresh_time) * REFRESH_RATE /
+                              1000.0;
+    if (worker->refresh_tokens > REFRESH_BURST) {
+        worker->refresh_tokens = REFRESH_BURST;
+    }
+    worker->refresh_time = now;
+    return worker->refresh_tokens >= 1;
+}
+
+// Refreshes the cached reply to the query `query` of length `len` ahead of
+// its expiry, in the background: a copy of the query is made into a request
+// with no client, so its reply is only cached. Takes one of the worker's
+// tokens. The request is only queued here, see start_refreshes(), as the
+// cached reply in the worker's buffer is yet to be sent, and a refresh that
+// fails right away would make a reply of its own there.
+void refresh_entry(worker_t *worker, uint8_t *query, uint16_t len) {
+    worker->refresh_tokens--;
+    metrics_count(&worker->metrics, METRIC_REFRESHES);
+    request_t *request = new_request(worker, query, len);
+    if (request) {
+        request->next_pending = worker->refreshes;
+        worker->refreshes = request;
+    }
+}
+
+// Starts the refreshes of the cache queued up by `worker`: each is forwarded
+// upstream, unless an identical request is pending already
+void start_refreshes(worker_t *worker) {
+    while (worker->refreshes) {
+        request_t *request = worker->refreshes;
+        worker->refreshes = request->next_pending;
+        request->next_pending = NULL;
+        if (!wait_on_pending(worker, request)) {
+            forward_message(worker, request);
+        }
+    }
+}
+
+// Forwards the query of `request` to upstream, which takes ownership of
+// `request`. The reply is relayed back to the client once it arrives, by
+// handle_reply().
+void forward_message(worker_t *worker, request_t *request) {
+    metrics_count(&worker->metrics, METRIC_FORWARDED);
+    start_deadline(worker, request);
+    upstream_send(worker->upstream, &request->arena, request->query.data,
+                  request->query.size, request);
+}
+
+// Makes `request` wait on the reply to an identical request (one for the same
+// question, keyed as the cache is) if `worker` has one pending upstream,
+// returning true. If that one was replied to stale already, `request` is too,
+// right away. Otherwise, it is put in the table of pending requests, for it
+// is about to be forwarded, and false is returned. Only requests with one
+// question wait or are waited on.
+bool wait_on_pending(worker_t *worker, request_t *request) {
+    dns_message_t *msg_query = &request->query;
+    if (msg_query->qdcount != 1) {
+        return false;
+    }
+    cache_key_t key = {.question = msg_query->data + HEADER_SIZE,
+                       .len = msg_query->questions_end - HEADER_SIZE};
+    request->hash = cache_key_hash(&key);
+    request_t **bucket =
+        &worker->pending[request->hash & (PENDING_TABLE_SIZE - 1)];
+
+    for (request_t *pending = *bucket; pending;
+         pending = pending->next_pending) {
+        cache_key_t pending_key = {
+            .question = pending->query.data + HEADER_SIZE,
+            .len = pending->query.questions_end - HEADER_SIZE};
+        if (pending->hash == request->hash &&
+            cache_key_eq(&pending_key, &key)) {
+            if (pending->served_stale) {
+                uint16_t len = get_stale_reply(worker, request);
+                if (len > 0) {
+                    metrics_count(&worker->metrics, METRIC_STALE);
+                    respond(worker, request, worker->reply_buf, len);
+                    return true;
+                }
+            }
+            request->next_waiter = pending->waiters;
+            pending->waiters = request;
+            metrics_count(&worker->metrics, METRIC_COALESCED);
+            return true;
+        }
+    }
+    request->next_pending = *bucket;
+    *bucket = request;
+    return false;
+}
+
+// Removes `request` from the table of requests `worker` has pending upstream,
+// if it is in it
+void remove_pending(worker_t *worker, request_t *request) {
+    request_t **link =
+        &worker->pending[request->hash & (PENDING_TABLE_SIZE - 1)];
+    for (; *link; link = &(*link)->next_pending) {
+        if (*link == request) {
+            *link = request->next_pending;
+            return;
+        }
+    }
+}
+
+// Gives `request`, forwarded upstream, a deadline to be replied to stale by,
+// if it has a client and may be replied to from the cache
+void start_deadline(worker_t *worker, request_t *request) {
+    if ((!request->over_udp && !request->client) ||
+        request->query.qdcount != 1 || worker->cache->max_stale == 0) {
+        return;
+    }
+    request->deadline = get_time_ms() + STALE_DEADLINE_MS;
+    request->prev_deadline = worker->deadline_tail;
+    request->next_deadline = NULL;
+    if (worker->deadline_tail) {
+        worker->deadline_tail->next_deadline = request;
+    } else {
+        worker->deadline_head = request;
+    }
+    worker->deadline_tail = request;
+}
+
+// Takes the deadline of `request` away, if it has one
+void stop_deadline(worker_t *worker, request_t *request) {
+    if (request->deadline == 0) {
+        return;
+    }
+    if (request->prev_deadline) {
+        request->prev_deadline->next_deadline = request->next_deadline;
+    } else {
+        worker->deadline_head = request->next_deadline;
+    }
+    if (request->next_deadline) {
+        request->next_deadline->prev_deadline = request->prev_deadline;
+    } else {
+        worker->deadline_tail = request->prev_deadline;
+    }
+    request->deadline = 0;
+    request->prev_deadline = NULL;
+    request->next_deadline = NULL;
+}
+
+// Returns how long `worker` may wait for events from the time `now`, in ms,
+// before it has a query upstream to give up on or a request to reply stale
+// to, or -1 if it has neither
+int next_timeout(worker_t *worker, uint64_t now) {
+    int timeout = upstream_next_timeout(worker->upstream, now);
+    request_t *request = worker->deadline_head;
+    if (request) {
+        int until = request->deadline > now ? request->deadline - now : 0;
+        if (timeout < 0 || until < timeout) {
+            timeout = until;
+        }
+    }
+    return timeout;
+}
+
+// Replies stale to each request of `worker` upstream has not replied to by
+// the time `now`, if there is an expired reply in the cache for it
+void expire_deadlines(worker_t *worker, uint64_t now) {
+    while (worker->deadline_head && worker->deadline_head->deadline <= now) {
+        request_t *request = worker->deadline_head;
+        stop_deadline(worker, request);
+        serve_stale(worker, request);
+    }
+}
+
+// Replies to the client of `request`, and to the requests waiting on it, with
+// the expired reply in the cache to its question, if there is one and it was
+// not replied to stale already, returning true. The request is left upstream,
+// with no client: whatever upstream replies only refreshes the cache.
+bool serve_stale(worker_t *worker, request_t *request) {
+    if (request->served_stale) {
+        return false;
+    }
+    uint16_t len = get_stale_reply(worker, request);
+    if (len == 0) {
+        return false;
+    }
+    // copied, as the worker's buffer is where the waiters' replies are made
+    uint8_t *reply = arena_alloc(&request->arena, len);
+    memcpy(reply, worker->reply_buf, len);
+    request->served_stale = true;
+    for (request_t *waiter = request->waiters; waiter;
+         waiter = waiter->next_waiter) {
+        metrics_count(&worker->metrics, METRIC_STALE);
+    }
+    if (request->over_udp || request->client) {
+        metrics_count(&worker->metrics, METRIC_STALE);
+    }
+    respond_to_waiters(worker, request, reply, len);
+    reply_to_client(worker, request, reply, len);
+    return true;
+}
+
+// Puts together a reply to the query of `request` in the worker's buffer,
+// from the expired reply in the cache to its question, if the cache still
+// keeps one. Returns the length of the reply, or 0 if there is no such reply.
+uint16_t get_stale_reply(worker_t *worker, request_t *request) {
+    dns_message_t *msg_query = &request->query;
+    if (msg_query->qdcount != 1) {
+        return 0;
+    }
+    cache_key_t key = {.question = msg_query->data + HEADER_SIZE,
+                       .len = msg_query->questions_end - HEADER_SIZE};
+    uint16_t len = cache_get_stale(worker->cache, &key, worker->reply_buf,
+                                   MAX_MESSAGE_SIZE);
+    if (len > 0) {
+        set_reply_query(worker->reply_buf, len, msg_query->data,
+                        msg_query->questions_end);
+    }
+    return len;
+}
+
+// Given a reply `msg_reply` from upstream, of any type, cache it if
+// appropriate (see get_cacheable()), and log events. Its answers are read
+// only now. It is cached by its question, as it is on the wire (so by name,
+// type and class), in the cache of `worker`. The copies of the entries it
+// evicts are allocated from `arena`.
+void cache_reply(worker_t *worker, dns_message_t *msg_reply, arena_t *arena) {
+    if (!read_answers(msg_reply)) {
+        return;
+    }
+    record_t *first_record = &msg_reply->answer;
+    char name[MAX_NAME_SIZE];
+    // keep the whole answer section (all its RRsets, CNAME chains included),
+    // and the authority section if negative, for its SOA, without the
+    // additional section, as it would be sent
+    uint32_t ttl;
+    uint16_t nscount;
+    uint16_t len = get_cacheable(msg_reply, &ttl, &nscount);
+    if (len > 0) {
+        // the counts are set in place for the cache to copy the reply as it
+        // would be sent, then put back, as the reply is relayed in full
+        uint8_t header[HEADER_SIZE];
+        memcpy(header, msg_reply->data, HEADER_SIZE);
+        set_record_counts(msg_reply->data, msg_reply->ancount, nscount, 0);
+
+        // cache, logging and counting evictions
+        cache_key_t key = {.question = msg_reply->data + HEADER_SIZE,
+                           .len = msg_reply->questions_end - HEADER_SIZE};
+        get_name(msg_reply->data, msg_reply->size, HEADER_SIZE, name);
+        cache_entry_t *evicted =
+            cache_put(worker->cache, &key, ttl, msg_reply->data, len, arena);
+        memcpy(msg_reply->data, header, HEADER_SIZE);
+        for (; evicted; evicted = evicted->next) {
+            log_evicted(worker->logger, name, evicted);
+            metrics_count(&worker->metrics, METRIC_EVICTIONS);
+        }
+    }
+    // spec: if first answer is not AAAA, then do not log any
+    if (msg_reply->ancount > 0 && first_record->type == AAAA_RR_TYPE) {
+        get_name(msg_reply->data, msg_reply->size, first_record->name.offset,
+                 name);
+        log_answer(worker->logger, name, msg_reply->data, first_record);
+    }
+}
+
+// Log with the logger of `worker` that a reply of length `len` to the name
+// `name`, in the worker's buffer, was found in the cache of this server,
+// expiring at `expiry_time`, along with its first answer (right after its
+// questions, which end at `qend`).
+void log_cached_reply(worker_t *worker, char *name, uint16_t qend,
+                      uint16_t len, time_t expiry_time) {
+    log_cached(worker->logger, name, expiry_time);
+    // spec: if first answer is not AAAA, then do not log any
+    record_t answer;
+    if (get_record(worker->reply_buf, len, qend, &answer) &&
+        answer.type == AAAA_RR_TYPE) {
+        log_answer(worker->logger, name, worker->reply_buf, &answer);
+    }
+}
@@ -0,0 +1,116 @@
+/**
+ * COMP30023 Project 2
+ * Author: Jonathan Jauhari 1038331
+ *
+ * Worker module containing the event loop of the DNS server: it accepts
+ * clients over TCP and UDP, and serves their requests either from the cache
+ * or by forwarding them upstream, without ever blocking on a single client
+ * or upstream. Each worker runs in its own thread, with its own listening
+ * sockets.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "conn.h"
+#include "dns_message.h"
+#include "logger.h"
+#include "metrics.h"
+#include "net.h"
+#include "slab.h"
+#include "udp.h"
+#include "upstream.h"
+
+// A socket this worker accepts connections on. The `kind` is first so that
+// it can be registered with epoll directly.
+typedef struct {
+    fd_kind_t kind;
+    int fd;
+} listener_t;
+
+// the number of buckets of the table of requests pending upstream, a power
+// of 2
+#define PENDING_TABLE_SIZE 4096
+
+// A request from a client, along with where to send the reply to: over TCP
+// on the client's connection, or over UDP to the client's address. The
+// request, its query (parsed where it is) and everything else made for it
+// until it is replied to are allocated from its own arena, freed in one go.
+// A request forwarded upstream is pending until it is replied to, and
+// identical requests (those for the same question) made meanwhile wait on it
+// rather than being forwarded too. If upstream is too slow to reply, the
+// client is replied to with the expired reply in the cache, if any, and the
+// request is left to refresh the cache in the background.
+typedef struct request request_t;
+struct request {
+    dns_message_t query;
+    bool over_udp;
+    conn_t *client;  // TCP only, referenced until the request is done, or
+                     // NULL for a refresh of the cache, which has no client
+    struct sockaddr_storage addr;  // UDP only
+    socklen_t addrlen;
+    uint64_t received_time;  // in µs, 0 for a refresh of the cache
+    arena_t arena;
+
+    uint32_t hash;  // of its question, once forwarded
+    request_t *next_pending;  // in its bucket of the worker's pending table,
+                              // or in its list of refreshes to start
+    request_t *waiters;  // identical requests waiting on its reply
+    request_t *next_waiter;
+
+    bool served_stale;  // replied to stale, its query still upstream
+    uint64_t deadline;  // to reply stale by, in ms, or 0 if not to
+    request_t *prev_deadline;  // in the worker's list of those with one
+    request_t *next_deadline;
+};
+
+// size of the block each request's arena starts with: enough for the
+// request, a query of up to UDP_MIN_SIZE bytes (far more than one question
+// and its EDNS options take) and what upstream keeps of it once forwarded,
+// which leaves room for the keys of a few entries evicted to cache its reply.
+// Only longer queries, and what does not fit in the rest of the block (such
+// as a reply served stale), are allocated on their own.
+#define REQUEST_ARENA_SIZE \
+    (sizeof(request_t) + UDP_MIN_SIZE + sizeof(upstream_query_t))
+
+// A worker runs an epoll event loop over its listening sockets, its clients
+// and its own pool of connections to upstream, and keeps a table of the
+// requests it has pending upstream, and of how many refreshes of the cache it
+// may start. Only the cache and the logger are shared with other workers;
+// its metrics are its own, only read by others.
+typedef struct {
+    int id;
+    int cpu;  // the CPU the worker is pinned to, or -1 if not pinned
+    pthread_t thread;
+    conn_loop_t loop;
+    listener_t listener;
+    udp_socket_t *udp;
+    upstream_t *upstream;
+    cache_t *cache;
+    slab_t request_blocks;  // the blocks the arenas of requests are over
+    request_t **pending;  // requests forwarded upstream, by their questions
+    request_t *deadline_head;  // those to reply stale to if upstream is slow,
+    request_t *deadline_tail;  // in order of their deadlines
+    uint8_t *reply_buf;  // where replies from the cache are put together
+    double refresh_tokens;  // refreshes it may start now, see may_refresh()
+    uint64_t refresh_time;  // when `refresh_tokens` was last topped up, in ms
+    request_t *refreshes;  // refreshes to start once the batch is replied to
+    logger_t *logger;
+    metrics_t metrics;
+} worker_t;
+
+worker_t *new_worker(int id, int cpu, const char *port, net_addr_t *ups_addr,
+                     int ups_nconns, bool ups_over_udp, cache_t *cache,
+                     logger_t *logger);
+void free_worker(worker_t *worker);
+
+void worker_start(worker_t *worker);
+void worker_join(worker_t *worker);
+void worker_run(worker_t *worker);
+
+#endif